@@ -0,0 +1,828 @@
+/**
+ * bvh_bench - compares bvh build methods: build time, node count, SAH cost and how
+ * many nodes and triangles the shader's traversal visits per primary ray, measured by
+ * tracing every pixel on the CPU with the same traversal as the compute shader. Each
+ * tree is also collapsed into 4 and 8 wide bvhs (rows marked /4 and /8, timed on the
+ * collapse alone), whose nodes/ray counts wide node fetches and boxes/ray every child
+ * box tested.
+ * Usage: bvh_bench [--width n] [--height n] [--threads n] [--leaf-size n] [--max-depth n] [--spatial-budget f]
+ *                  [--scaling max_threads | --formats | --layout | --node-layout | --stackless | --stats |
+ *                   --optimize seconds | --refit frames | --instances copies]
+ *                  [--synthetic triangles] [scene files...]
+ * When no files are given, every .txt scene in the data directory is measured.
+ * --synthetic adds a generated height field of about the given number of triangles.
+ * --leaf-size sets the most triangles a leaf may hold (1 to 8, 4 by default).
+ * --max-depth caps the depth of the leaves (63 by default). The stack column is the most
+ * entries the traversal's stack held.
+ * --spatial-budget sets how many duplicate references per triangle the sbvh may add (0.3).
+ * --scaling instead reports how the SAH build time scales from 1 to max_threads threads,
+ * and checks every build made the same tree as the single threaded one.
+ * --formats instead compares the node formats of the SAH tree: binary, and 2, 4 and 8 wide
+ * with float, 16 bit and 8 bit child bounds. For each it reports the node bytes per
+ * triangle and the CPU traversal throughput (the best of 3 runs).
+ * --layout instead compares the memory traffic of the triangle and vertex orders, feeding
+ * every read of the traversal through a model of a 32 KB cache, and the CPU throughput.
+ * --node-layout instead compares the depth first node order with sibling pairs in cache
+ * lines, alone and in treelets of 6, 24 and 96 nodes: the node memory, the bytes a 32 KB
+ * cache model fetched per primary ray and per random bounce ray, and the time to trace
+ * the bounces.
+ * --stackless instead compares the stack based traversal of the SAH tree with the stackless
+ * one over skip links: the nodes and stack pushes per ray, the stack entries and bytes each
+ * shader thread would hold, and the CPU throughput (the best of 3 runs).
+ * --stats instead prints every method's tree statistics (bvh::stats) as one line of JSON
+ * per scene and method, for scripts to compare.
+ * --optimize instead builds every method's tree twice, the second time spending up to the
+ * given seconds reinserting subtrees after the build, and prints the usual row for each.
+ * The optimized rows' build time includes the optimization.
+ * --refit instead twists each scene a little more every frame, refitting its SAH tree,
+ * and compares the refit with the build: the time of each, the nodes a refit changed,
+ * how many times the tree got loose enough to be rebuilt, and the final SAH cost and
+ * nodes/ray against a tree built from scratch over the twisted mesh.
+ * --instances instead places copies of each scene's mesh on a grid, each turned at random,
+ * and compares baking the copies into one bvh with a two level bvh over one shared mesh:
+ * build time, the bytes of every buffer, the time to rebuild the top level after moving
+ * every copy, and the traversal counts, whose hits should match.
+ */
+#define _USE_MATH_DEFINES
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "bvh.h"
+#include "bvh_stats.h"
+#include "cache_model.h"
+#include "config.h"
+#include "instancing.h"
+#include "motor.h"
+#include "scene.h"
+#include "skip_bvh.h"
+#include "synthetic_scene.h"
+#include "traversal.h"
+#include "wide_bvh.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+struct Method {
+    const char *name;
+    BvhSplitMethod method;
+};
+
+const Method kMethods[] = { { "median", SPLIT_MEDIAN }, { "sah", SPLIT_SAH }, { "morton", SPLIT_MORTON }, { "sbvh", SPLIT_SBVH } };
+
+/**
+ * The buffers the shader would be given for tree: its mesh and its nodes
+ */
+SceneBuffers treeBuffers(bvh &tree) {
+    const TriangleMesh &mesh = tree.getMesh();
+    SceneBuffers buffers;
+    buffers.vertices = mesh.vertices.data();
+    buffers.num_vertices = mesh.vertices.size();
+    buffers.normals = mesh.normals.data();
+    buffers.num_normals = mesh.normals.size();
+    buffers.triangles = mesh.triangles.data();
+    buffers.num_triangles = mesh.triangles.size();
+    int num_nodes;
+    buffers.nodes = tree.getCompact(num_nodes);
+    buffers.num_nodes = num_nodes;
+    return buffers;
+}
+
+void printHeader() {
+    std::cout << std::left << std::setw(24) << "scene" << std::setw(10) << "method" << std::right
+              << std::setw(12) << "triangles" << std::setw(12) << "build ms" << std::setw(10) << "nodes"
+              << std::setw(10) << "node KB" << std::setw(10) << "SAH cost" << std::setw(12) << "nodes/ray"
+              << std::setw(11) << "boxes/ray" << std::setw(11) << "tris/ray" << std::setw(8) << "stack"
+              << std::setw(10) << "hits" << std::endl;
+}
+
+void printRow(const std::string &name, const std::string &method, size_t triangles, double secs, size_t nodes,
+              size_t node_bytes, float sah_cost, const TraversalStats &stats) {
+    std::cout << std::left << std::setw(24) << name << std::setw(10) << method << std::right
+              << std::setw(12) << triangles << std::fixed << std::setprecision(1) << std::setw(12) << secs * 1e3
+              << std::setw(10) << nodes << std::setw(10) << node_bytes / 1024.0 << std::setprecision(2)
+              << std::setw(10) << sah_cost << std::setprecision(1) << std::setw(12) << stats.nodesPerRay()
+              << std::setw(11) << stats.boxesPerRay() << std::setw(11) << stats.trianglesPerRay()
+              << std::setw(8) << stats.max_stack << std::setw(10) << stats.hits << std::endl;
+}
+
+/**
+ * Collapse the binary nodes in buffers into a Width wide bvh, trace it and print its row
+ */
+template<int Width>
+void benchWide(const std::string &name, const char *method, const SceneBuffers &buffers, float sah_cost,
+               const SceneData &scene, int width, int height) {
+    std::vector<WideNodeGL<Width>> wide;
+    auto start = std::chrono::high_resolution_clock::now();
+    collapseBvh<Width>(buffers.nodes, buffers.num_nodes, wide);
+    auto end = std::chrono::high_resolution_clock::now();
+    TraversalStats stats = traceCameraRays(buffers, data(wide), wide.size(), scene, width, height);
+    printRow(name, std::string(method) + "/" + std::to_string(Width), buffers.num_triangles,
+             std::chrono::duration<double>(end - start).count(), wide.size(), wide.size() * sizeof(WideNodeGL<Width>),
+             sah_cost, stats);
+}
+
+/**
+ * Build scene's bvh with every method and print a row for each
+ */
+void benchScene(const std::string &name, const SceneData &scene, int width, int height, int num_threads, int leaf_size,
+                float spatial_budget, int max_depth) {
+    for (const Method &method : kMethods) {
+        TriangleMesh mesh = scene.mesh;
+        BvhOptions options(method.method, num_threads, leaf_size);
+        options.spatial_budget = spatial_budget;
+        options.max_depth = max_depth;
+        auto start = std::chrono::high_resolution_clock::now();
+        bvh tree(mesh, options);
+        auto end = std::chrono::high_resolution_clock::now();
+
+        SceneBuffers buffers = treeBuffers(tree);
+        TraversalStats stats = traceCameraRays(buffers, scene, width, height);
+        printRow(name, method.name, buffers.num_triangles, std::chrono::duration<double>(end - start).count(),
+                 buffers.num_nodes, buffers.num_nodes * sizeof(NodeGL), tree.sahCost(), stats);
+        benchWide<4>(name, method.name, buffers, tree.sahCost(), scene, width, height);
+        benchWide<8>(name, method.name, buffers, tree.sahCost(), scene, width, height);
+    }
+}
+
+/**
+ * Build scene's bvh with every method, then again spending up to seconds optimizing the
+ * tree, and print a row for each (the optimized ones marked +opt)
+ */
+void benchOptimize(const std::string &name, const SceneData &scene, float seconds, int width, int height,
+                   int num_threads, int leaf_size, int max_depth) {
+    for (const Method &method : kMethods) {
+        for (float budget : { 0.0f, seconds }) {
+            TriangleMesh mesh = scene.mesh;
+            BvhOptions options(method.method, num_threads, leaf_size);
+            options.max_depth = max_depth;
+            options.optimize_seconds = budget;
+            auto start = std::chrono::high_resolution_clock::now();
+            bvh tree(mesh, options);
+            auto end = std::chrono::high_resolution_clock::now();
+
+            SceneBuffers buffers = treeBuffers(tree);
+            TraversalStats stats = traceCameraRays(buffers, scene, width, height);
+            printRow(name, std::string(method.name) + (budget > 0.0f ? "+opt" : ""), buffers.num_triangles,
+                     std::chrono::duration<double>(end - start).count(), buffers.num_nodes,
+                     buffers.num_nodes * sizeof(NodeGL), tree.sahCost(), stats);
+        }
+    }
+}
+
+void printFormatHeader() {
+    std::cout << std::left << std::setw(24) << "scene" << std::setw(10) << "format" << std::right
+              << std::setw(10) << "nodes" << std::setw(10) << "node KB" << std::setw(11) << "bytes/tri"
+              << std::setw(12) << "nodes/ray" << std::setw(11) << "boxes/ray" << std::setw(11) << "tris/ray"
+              << std::setw(10) << "Mrays/s" << std::setw(10) << "hits" << std::endl;
+}
+
+/**
+ * Trace buffers' triangles through nodes three times and print the format's row
+ */
+template<typename Node>
+void benchFormat(const std::string &name, const std::string &format, const SceneBuffers &buffers, const Node *nodes,
+                 size_t num_nodes, const SceneData &scene, int width, int height) {
+    TraversalStats stats;
+    double secs = 1e30;
+    for (int run = 0; run < 3; ++run) {
+        auto start = std::chrono::high_resolution_clock::now();
+        if constexpr (std::is_same<Node, NodeGL>::value) {
+            stats = traceCameraRays(buffers, scene, width, height);
+        }
+        else {
+            stats = traceCameraRays(buffers, nodes, num_nodes, scene, width, height);
+        }
+        secs = std::min(secs, std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count());
+    }
+    size_t bytes = num_nodes * sizeof(Node);
+    std::cout << std::left << std::setw(24) << name << std::setw(10) << format << std::right
+              << std::setw(10) << num_nodes << std::fixed << std::setprecision(1) << std::setw(10) << bytes / 1024.0
+              << std::setw(11) << static_cast<double>(bytes) / buffers.num_triangles << std::setw(12) << stats.nodesPerRay()
+              << std::setw(11) << stats.boxesPerRay() << std::setw(11) << stats.trianglesPerRay() << std::setprecision(2)
+              << std::setw(10) << stats.rays / secs * 1e-6 << std::setw(10) << stats.hits << std::endl;
+}
+
+/**
+ * Collapse buffers' nodes to Width wide and print the rows of the float, 16 bit and 8 bit
+ * child bounds
+ */
+template<int Width>
+void benchWideFormats(const std::string &name, const SceneBuffers &buffers, const SceneData &scene, int width, int height) {
+    std::vector<WideNodeGL<Width>> wide;
+    collapseBvh<Width>(buffers.nodes, buffers.num_nodes, wide);
+    std::string prefix = std::to_string(Width) + " wide";
+    if (Width != 2) {
+        benchFormat(name, prefix, buffers, data(wide), wide.size(), scene, width, height);
+    }
+    std::vector<QuantizedNodeGL<Width, 16>> wide16;
+    quantizeBvh<Width, 16>(wide, wide16);
+    benchFormat(name, prefix + "/16", buffers, data(wide16), wide16.size(), scene, width, height);
+    std::vector<QuantizedNodeGL<Width, 8>> wide8;
+    quantizeBvh<Width, 8>(wide, wide8);
+    benchFormat(name, prefix + "/8", buffers, data(wide8), wide8.size(), scene, width, height);
+}
+
+/**
+ * Build scene's SAH bvh and compare every node format
+ */
+void benchFormats(const std::string &name, const SceneData &scene, int width, int height, int num_threads, int leaf_size) {
+    TriangleMesh mesh = scene.mesh;
+    bvh tree(mesh, BvhOptions(SPLIT_SAH, num_threads, leaf_size));
+    SceneBuffers buffers = treeBuffers(tree);
+    benchFormat(name, "binary", buffers, buffers.nodes, buffers.num_nodes, scene, width, height);
+    benchWideFormats<2>(name, buffers, scene, width, height);
+    benchWideFormats<4>(name, buffers, scene, width, height);
+    benchWideFormats<8>(name, buffers, scene, width, height);
+}
+
+/**
+ * Twist vertices about the vertical axis through the middle of box, by up to angle
+ * radians at the top of the box and not at all at the bottom
+ */
+void twistVertices(const std::vector<VertexGL> &rest, const DimensionGL &box, float angle, std::vector<VertexGL> &twisted) {
+    twisted = rest;
+    float center_x = 0.5f * (box.min_x + box.max_x);
+    float center_z = 0.5f * (box.min_z + box.max_z);
+    float height = box.max_y - box.min_y;
+    for (VertexGL &vertex : twisted) {
+        float turn = height > 0.0f ? angle * (vertex.pos[1] - box.min_y) / height : 0.0f;
+        float x = vertex.pos[0] - center_x;
+        float z = vertex.pos[2] - center_z;
+        vertex.pos[0] = center_x + x * std::cos(turn) - z * std::sin(turn);
+        vertex.pos[2] = center_z + x * std::sin(turn) + z * std::cos(turn);
+    }
+}
+
+void printRefitHeader() {
+    std::cout << std::left << std::setw(24) << "scene" << std::right << std::setw(12) << "triangles"
+              << std::setw(12) << "build ms" << std::setw(12) << "refit ms" << std::setw(12) << "changed %"
+              << std::setw(10) << "rebuilds" << std::setw(12) << "refit SAH" << std::setw(12) << "built SAH"
+              << std::setw(12) << "refit n/ray" << std::setw(12) << "built n/ray" << std::endl;
+}
+
+/**
+ * Twist scene a little more over each of frames frames, refitting its SAH bvh each time,
+ * and print how the refits compare with building the tree over the final mesh
+ */
+void benchRefit(const std::string &name, const SceneData &scene, int frames, int width, int height, int num_threads,
+                int leaf_size) {
+    TriangleMesh mesh = scene.mesh;
+    bvh tree(mesh, BvhOptions(SPLIT_SAH, num_threads, leaf_size));
+    int num_nodes;
+    DimensionGL box = tree.getCompact(num_nodes)[0].AABB;
+    const std::vector<VertexGL> rest = tree.getMesh().vertices;
+    std::vector<VertexGL> twisted;
+    double refit_secs = 0.0;
+    size_t changed_nodes = 0, total_nodes = 0;
+    int rebuilds = 0;
+    BvhUpdate update;
+    for (int frame = 1; frame <= frames; ++frame) {
+        // a quarter turn at the top by the last frame
+        twistVertices(rest, box, 0.5f * static_cast<float>(M_PI) * frame / frames, twisted);
+        auto start = std::chrono::high_resolution_clock::now();
+        tree.refit(twisted, std::vector<VertexGL>(), update, num_threads);
+        refit_secs += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+        rebuilds += update.rebuilt;
+        for (const BufferRange &range : update.nodes) {
+            changed_nodes += range.second - range.first;
+        }
+        tree.getCompact(num_nodes);
+        total_nodes += num_nodes;
+    }
+
+    TraversalStats refit_stats = traceCameraRays(treeBuffers(tree), scene, width, height);
+    TriangleMesh final_mesh = tree.getMesh();
+    auto start = std::chrono::high_resolution_clock::now();
+    bvh built(final_mesh, BvhOptions(SPLIT_SAH, num_threads, leaf_size));
+    double build_secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    TraversalStats built_stats = traceCameraRays(treeBuffers(built), scene, width, height);
+
+    std::cout << std::left << std::setw(24) << name << std::right << std::setw(12) << scene.mesh.triangles.size()
+              << std::fixed << std::setprecision(2) << std::setw(12) << build_secs * 1e3
+              << std::setw(12) << refit_secs * 1e3 / frames << std::setprecision(1)
+              << std::setw(12) << 100.0 * changed_nodes / std::max<size_t>(total_nodes, 1) << std::setw(10) << rebuilds
+              << std::setprecision(2) << std::setw(12) << update.sah_cost << std::setw(12) << built.sahCost()
+              << std::setprecision(1) << std::setw(12) << refit_stats.nodesPerRay() << std::setw(12)
+              << built_stats.nodesPerRay() << std::endl;
+}
+
+void printInstancesHeader() {
+    std::cout << std::left << std::setw(24) << "scene" << std::setw(12) << "layout" << std::right
+              << std::setw(8) << "copies" << std::setw(12) << "triangles" << std::setw(12) << "build ms"
+              << std::setw(12) << "move ms" << std::setw(10) << "KB" << std::setw(12) << "nodes/ray"
+              << std::setw(11) << "tris/ray" << std::setw(8) << "stack" << std::setw(10) << "hits" << std::endl;
+}
+
+void printInstancesRow(const std::string &name, const char *layout, int copies, size_t triangles, double build_secs,
+                       double move_secs, size_t bytes, const TraversalStats &stats) {
+    std::cout << std::left << std::setw(24) << name << std::setw(12) << layout << std::right << std::setw(8) << copies
+              << std::setw(12) << triangles << std::fixed << std::setprecision(2) << std::setw(12) << build_secs * 1e3
+              << std::setw(12) << move_secs * 1e3 << std::setprecision(1) << std::setw(10) << bytes / 1024.0
+              << std::setw(12) << stats.nodesPerRay() << std::setw(11) << stats.trianglesPerRay()
+              << std::setw(8) << stats.max_stack << std::setw(10) << stats.hits << std::endl;
+}
+
+size_t bufferBytes(const SceneBuffers &buffers) {
+    return buffers.num_vertices * sizeof(VertexGL) + buffers.num_normals * sizeof(VertexGL)
+           + buffers.num_triangles * sizeof(TriangleIndexGL) + buffers.num_nodes * sizeof(NodeGL);
+}
+
+/**
+ * Place copies of scene's mesh on a square grid around where it is, spaced by its size,
+ * each turned about a random axis. jitter moves every copy a little off its grid spot.
+ */
+std::vector<Motor3D> gridMotors(const DimensionGL &box, int copies, float jitter, std::mt19937 &random) {
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    float spacing = 1.5f * std::max({ box.max_x - box.min_x, box.max_y - box.min_y, box.max_z - box.min_z });
+    Dir3D center(0.5f * (box.min_x + box.max_x), 0.5f * (box.min_y + box.max_y), 0.5f * (box.min_z + box.max_z));
+    int side = static_cast<int>(std::ceil(std::sqrt(static_cast<double>(copies))));
+    std::vector<Motor3D> motors;
+    for (int i = 0; i < copies; ++i) {
+        Dir3D spot((i % side - 0.5f * (side - 1)) * spacing + jitter * unit(random), jitter * unit(random),
+                   (i / side - 0.5f * (side - 1)) * spacing + jitter * unit(random));
+        Dir3D axis(unit(random), unit(random), unit(random));
+        float angle = static_cast<float>(M_PI) * unit(random);
+        // turn about the mesh's middle, then move it to its spot
+        Motor3D turn = rigidMotor(axis, angle, Dir3D(0, 0, 0));
+        motors.push_back(rigidMotor(axis, angle, center + spot - motorDirection(turn, center)));
+    }
+    return motors;
+}
+
+/**
+ * Compare copies of scene's mesh baked into one bvh with a two level bvh over one mesh
+ */
+void benchInstances(const std::string &name, const SceneData &scene, int copies, int width, int height,
+                    int num_threads, int leaf_size) {
+    const BvhOptions options(SPLIT_SAH, num_threads, leaf_size);
+    DimensionGL box;
+    for (const VertexGL &vertex : scene.mesh.vertices) {
+        box.min_x = std::min(box.min_x, vertex.pos[0]);
+        box.min_y = std::min(box.min_y, vertex.pos[1]);
+        box.min_z = std::min(box.min_z, vertex.pos[2]);
+        box.max_x = std::max(box.max_x, vertex.pos[0]);
+        box.max_y = std::max(box.max_y, vertex.pos[1]);
+        box.max_z = std::max(box.max_z, vertex.pos[2]);
+    }
+    std::mt19937 random(7);
+    std::vector<Motor3D> motors = gridMotors(box, copies, 0.0f, random);
+    const size_t triangles = scene.mesh.triangles.size() * copies;
+
+    // every copy baked into the mesh
+    TriangleMesh baked;
+    for (const Motor3D &motor : motors) {
+        int vertex_base = static_cast<int>(baked.vertices.size());
+        int normal_base = static_cast<int>(baked.normals.size());
+        for (VertexGL vertex : scene.mesh.vertices) {
+            Point3D moved = motorPoint(motor, Point3D(vertex.pos[0], vertex.pos[1], vertex.pos[2]));
+            vertex.pos[0] = moved.x;
+            vertex.pos[1] = moved.y;
+            vertex.pos[2] = moved.z;
+            baked.vertices.push_back(vertex);
+        }
+        for (VertexGL normal : scene.mesh.normals) {
+            Dir3D turned = motorDirection(motor, Dir3D(normal.pos[0], normal.pos[1], normal.pos[2]));
+            normal.pos[0] = turned.x;
+            normal.pos[1] = turned.y;
+            normal.pos[2] = turned.z;
+            baked.normals.push_back(normal);
+        }
+        for (TriangleIndexGL tri : scene.mesh.triangles) {
+            tri.v1 += vertex_base;
+            tri.v2 += vertex_base;
+            tri.v3 += vertex_base;
+            if (tri.n1 >= 0) {
+                tri.n1 += normal_base;
+                tri.n2 += normal_base;
+                tri.n3 += normal_base;
+            }
+            baked.triangles.push_back(tri);
+        }
+    }
+    auto start = std::chrono::high_resolution_clock::now();
+    bvh flat(baked, options);
+    double flat_secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    SceneBuffers flat_buffers = treeBuffers(flat);
+    TraversalStats flat_stats = traceCameraRays(flat_buffers, scene, width, height);
+
+    // one shared mesh
+    SceneData instanced;
+    instanced.instance_meshes.push_back(scene.mesh);
+    for (const Motor3D &motor : motors) {
+        instanced.instances.push_back({ 0, motor });
+    }
+    bvh no_scene_mesh;
+    start = std::chrono::high_resolution_clock::now();
+    TwoLevelBvh two_level(no_scene_mesh, instanced, options);
+    double two_level_secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    TraversalStats two_level_stats = traceCameraRays(two_level.buffers(), data(two_level.gpuInstances()), scene, width,
+                                                     height);
+    // move every copy a little and rebuild the top level
+    std::vector<Motor3D> moved = gridMotors(box, copies, 0.1f * (box.max_x - box.min_x), random);
+    start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < copies; ++i) {
+        two_level.moveInstance(i, moved[i]);
+    }
+    two_level.buildTopLevel();
+    double move_secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+    printInstancesRow(name, "baked", copies, triangles, flat_secs, flat_secs, bufferBytes(flat_buffers), flat_stats);
+    printInstancesRow(name, "two level", copies, triangles, two_level_secs, move_secs,
+                      bufferBytes(two_level.buffers()) + two_level.gpuInstances().size() * sizeof(InstanceGL),
+                      two_level_stats);
+}
+
+/**
+ * Build scene's SAH bvh with 1, 2, 4... up to max_threads threads and print the best
+ * time of each, and whether the tree matched the single threaded build
+ */
+void benchScaling(const std::string &name, const SceneData &scene, int max_threads, int leaf_size) {
+    std::cout << name << ": " << scene.mesh.triangles.size() << " triangles" << std::endl;
+    std::cout << std::setw(8) << "threads" << std::setw(12) << "best ms" << std::setw(10) << "speedup"
+              << std::setw(8) << "same" << std::endl;
+    // the reference tree, which also warms up the allocator before anything is timed
+    std::vector<NodeGL> single_nodes;
+    {
+        TriangleMesh mesh = scene.mesh;
+        bvh tree(mesh, BvhOptions(SPLIT_SAH, 1, leaf_size));
+        int num_nodes;
+        const NodeGL *nodes = tree.getCompact(num_nodes);
+        single_nodes.assign(nodes, nodes + num_nodes);
+    }
+    double single = 0.0;
+    int runs = scene.mesh.triangles.size() > 1000000 ? 1 : 3;
+    for (int threads = 1; ; threads = std::min(threads * 2, max_threads)) {
+        double secs = 1e30;
+        bool same = true;
+        for (int run = 0; run < runs; ++run) {
+            TriangleMesh mesh = scene.mesh;
+            auto start = std::chrono::high_resolution_clock::now();
+            bvh tree(mesh, BvhOptions(SPLIT_SAH, threads, leaf_size));
+            secs = std::min(secs, std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count());
+            int num_nodes;
+            const NodeGL *nodes = tree.getCompact(num_nodes);
+            same = same && static_cast<size_t>(num_nodes) == single_nodes.size()
+                   && !memcmp(nodes, data(single_nodes), num_nodes * sizeof(NodeGL));
+        }
+        if (threads == 1) {
+            single = secs;
+        }
+        std::cout << std::setw(8) << threads << std::fixed << std::setprecision(1) << std::setw(12) << secs * 1e3
+                  << std::setprecision(2) << std::setw(10) << single / secs << std::setw(8) << (same ? "yes" : "NO")
+                  << std::endl;
+        if (threads == max_threads) {
+            break;
+        }
+    }
+}
+
+void printLayoutHeader() {
+    std::cout << std::left << std::setw(24) << "scene" << std::setw(12) << "layout" << std::right
+              << std::setw(12) << "lines/ray" << std::setw(10) << "miss %" << std::setw(12) << "bytes/ray"
+              << std::setw(10) << "Mrays/s" << std::setw(10) << "hits" << std::endl;
+}
+
+/**
+ * Trace buffers with a cache model and then three times without, and print the layout's row
+ */
+void benchLayoutRow(const std::string &name, const std::string &layout, const SceneBuffers &buffers,
+                    const SceneData &scene, int width, int height) {
+    CacheModel cache;
+    TraversalStats stats = traceCameraRays(buffers, scene, width, height, &cache);
+    double secs = 1e30;
+    for (int run = 0; run < 3; ++run) {
+        auto start = std::chrono::high_resolution_clock::now();
+        traceCameraRays(buffers, scene, width, height);
+        secs = std::min(secs, std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count());
+    }
+    std::cout << std::left << std::setw(24) << name << std::setw(12) << layout << std::right << std::fixed
+              << std::setprecision(1) << std::setw(12) << static_cast<double>(cache.accesses()) / stats.rays
+              << std::setw(10) << 100.0 * cache.missRate() << std::setw(12)
+              << static_cast<double>(cache.trafficBytes()) / stats.rays << std::setprecision(2) << std::setw(10)
+              << stats.rays / secs * 1e-6 << std::setw(10) << stats.hits << std::endl;
+}
+
+/**
+ * Compare the memory traffic of scene's triangle and vertex orders. The SAH tree has one
+ * triangle per leaf so its leaves can also point into the file's order: the rows are the
+ * triangles and vertices as the file has them, the triangles in leaf order, and the
+ * vertices in the order those triangles first use them as well.
+ */
+void benchLayout(const std::string &name, const SceneData &scene, int width, int height, int num_threads) {
+    BvhOptions options(SPLIT_SAH, num_threads, 1);
+    options.sort_vertices = false;
+    TriangleMesh mesh = scene.mesh;
+    bvh tree(mesh, options);
+    SceneBuffers buffers = treeBuffers(tree);
+
+    // point every leaf back at its triangle's place in the file. The corners weren't
+    // moved, so equal triangles are the same triangle (or an exact duplicate)
+    std::map<std::array<int, 7>, std::vector<int>> file_places;
+    for (size_t i = 0; i < scene.mesh.triangles.size(); ++i) {
+        const TriangleIndexGL &tri = scene.mesh.triangles[i];
+        file_places[{ tri.v1, tri.v2, tri.v3, tri.mat, tri.n1, tri.n2, tri.n3 }].push_back(static_cast<int>(i));
+    }
+    std::vector<NodeGL> file_nodes(buffers.nodes, buffers.nodes + buffers.num_nodes);
+    for (NodeGL &node : file_nodes) {
+        if (node.triangle_count) {
+            const TriangleIndexGL &tri = buffers.triangles[node.triangle_offset];
+            std::vector<int> &places = file_places[{ tri.v1, tri.v2, tri.v3, tri.mat, tri.n1, tri.n2, tri.n3 }];
+            node.triangle_offset = places.back();
+            places.pop_back();
+        }
+    }
+    SceneBuffers file_buffers = buffers;
+    file_buffers.vertices = scene.mesh.vertices.data();
+    file_buffers.normals = scene.mesh.normals.data();
+    file_buffers.triangles = scene.mesh.triangles.data();
+    file_buffers.nodes = data(file_nodes);
+    benchLayoutRow(name, "file", file_buffers, scene, width, height);
+    benchLayoutRow(name, "tris", buffers, scene, width, height);
+
+    mesh = scene.mesh;
+    options.sort_vertices = true;
+    bvh sorted(mesh, options);
+    benchLayoutRow(name, "tris+verts", treeBuffers(sorted), scene, width, height);
+}
+
+/**
+ * Build scene's bvh with every method and print each tree's stats as a line of JSON
+ */
+void benchStats(const std::string &name, const SceneData &scene, int num_threads, int leaf_size, float spatial_budget,
+                int max_depth) {
+    for (const Method &method : kMethods) {
+        TriangleMesh mesh = scene.mesh;
+        BvhOptions options(method.method, num_threads, leaf_size);
+        options.spatial_budget = spatial_budget;
+        options.max_depth = max_depth;
+        bvh tree(mesh, options);
+        std::cout << "{\"scene\": \"" << name << "\", \"method\": \"" << method.name << "\", \"bvh\": ";
+        writeJson(std::cout, tree.stats(num_threads));
+        std::cout << "}" << std::endl;
+    }
+}
+
+void printStacklessHeader() {
+    std::cout << std::left << std::setw(24) << "scene" << std::setw(10) << "traversal" << std::right
+              << std::setw(12) << "nodes/ray" << std::setw(12) << "pushes/ray" << std::setw(8) << "stack"
+              << std::setw(12) << "stack B" << std::setw(10) << "Mrays/s" << std::setw(10) << "hits" << std::endl;
+}
+
+/**
+ * Trace scene three times with trace, which returns the stats of one run, and print the
+ * traversal's row. stack_size is the entries the shader's stack would be given.
+ */
+template<typename Trace>
+void benchTraversal(const std::string &name, const std::string &traversal, int stack_size, Trace trace) {
+    TraversalStats stats;
+    double secs = 1e30;
+    for (int run = 0; run < 3; ++run) {
+        auto start = std::chrono::high_resolution_clock::now();
+        stats = trace();
+        secs = std::min(secs, std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count());
+    }
+    std::cout << std::left << std::setw(24) << name << std::setw(10) << traversal << std::right << std::fixed
+              << std::setprecision(1) << std::setw(12) << stats.nodesPerRay() << std::setw(12) << stats.pushesPerRay()
+              << std::setw(8) << stack_size << std::setw(12) << stack_size * sizeof(int) << std::setprecision(2)
+              << std::setw(10) << stats.rays / secs * 1e-6 << std::setw(10) << stats.hits << std::endl;
+}
+
+/**
+ * Compare the stack based traversal of scene's SAH tree with the stackless one over
+ * skip links
+ */
+void benchStackless(const std::string &name, const SceneData &scene, int width, int height, int num_threads,
+                    int leaf_size) {
+    TriangleMesh mesh = scene.mesh;
+    bvh tree(mesh, BvhOptions(SPLIT_SAH, num_threads, leaf_size));
+    SceneBuffers buffers = treeBuffers(tree);
+    std::vector<SkipNodeGL> threaded;
+    threadBvh(buffers.nodes, buffers.num_nodes, threaded);
+    benchTraversal(name, "stack", tree.stackSize(), [&]() { return traceCameraRays(buffers, scene, width, height); });
+    benchTraversal(name, "skip", 0, [&]() {
+        return traceCameraRays(buffers, data(threaded), threaded.size(), scene, width, height);
+    });
+}
+
+void printNodeLayoutHeader() {
+    std::cout << std::left << std::setw(24) << "scene" << std::setw(12) << "nodes" << std::right << std::setw(10)
+              << "node KB" << std::setw(14) << "primary B/ray" << std::setw(14) << "bounce B/ray" << std::setw(15)
+              << "bounce miss %" << std::setw(12) << "bounce ms" << std::setw(10) << "hits" << std::endl;
+}
+
+/**
+ * Compare the depth first node order of scene's SAH tree with treelets of a few sizes
+ * (2 is the sibling pairs alone). The bytes per ray are what a 32 KB cache model fetched
+ * from memory, for the primary rays and for one random bounce from each of their hits.
+ * The nodes are traced from a copy which starts on a cache line, like a GPU buffer. The
+ * bounce time is the best of 3 runs of both passes.
+ */
+void benchNodeLayout(const std::string &name, const SceneData &scene, int width, int height, int num_threads,
+                     int leaf_size) {
+    for (int treelet_nodes : { 0, 2, 6, 24, 96 }) {
+        TriangleMesh mesh = scene.mesh;
+        BvhOptions options(SPLIT_SAH, num_threads, leaf_size);
+        options.treelet_nodes = treelet_nodes;
+        bvh tree(mesh, options);
+        SceneBuffers buffers = treeBuffers(tree);
+        // a vector is only 16 byte aligned, but one of the first 8 nodes starts a line
+        std::vector<NodeGL> aligned(buffers.num_nodes + 8);
+        size_t first = 0;
+        while (reinterpret_cast<uintptr_t>(aligned.data() + first) % 128) {
+            ++first;
+        }
+        std::copy(buffers.nodes, buffers.nodes + buffers.num_nodes, aligned.begin() + first);
+        buffers.nodes = aligned.data() + first;
+
+        CacheModel primary_cache;
+        TraversalStats primary = traceCameraRays(buffers, scene, width, height, &primary_cache);
+        CacheModel bounce_cache;
+        TraversalStats bounce = traceBounceRays(buffers, scene, width, height, &bounce_cache);
+        double secs = 1e30;
+        for (int run = 0; run < 3; ++run) {
+            auto start = std::chrono::high_resolution_clock::now();
+            traceBounceRays(buffers, scene, width, height);
+            secs = std::min(secs, std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count());
+        }
+        std::string layout = treelet_nodes ? "treelet " + std::to_string(treelet_nodes) : "depth first";
+        std::cout << std::left << std::setw(24) << name << std::setw(12) << layout << std::right << std::fixed
+                  << std::setprecision(1) << std::setw(10) << buffers.num_nodes * sizeof(NodeGL) / 1024.0 << std::setw(14)
+                  << static_cast<double>(primary_cache.trafficBytes()) / std::max<size_t>(primary.rays, 1)
+                  << std::setw(14) << static_cast<double>(bounce_cache.trafficBytes()) / std::max<size_t>(bounce.rays, 1)
+                  << std::setw(15) << 100.0 * bounce_cache.missRate() << std::setprecision(2) << std::setw(12)
+                  << secs * 1e3 << std::setw(10) << bounce.hits << std::endl;
+    }
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    int width = 256;
+    int height = 192;
+    int num_threads = 0;
+    int max_threads = 0;
+    int leaf_size = BvhOptions().max_leaf_size;
+    float spatial_budget = kSpatialSplitBudget;
+    int max_depth = kMaxLeafDepth;
+    bool formats = false;
+    bool layout = false;
+    bool stats = false;
+    bool stackless = false;
+    bool node_layout = false;
+    float optimize_seconds = 0.0f;
+    int refit_frames = 0;
+    int instance_copies = 0;
+    size_t synthetic_triangles = 0;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--width") && i + 1 < argc) {
+            width = std::max(1, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--height") && i + 1 < argc) {
+            height = std::max(1, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            num_threads = std::max(1, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--leaf-size") && i + 1 < argc) {
+            leaf_size = std::min(std::max(1, atoi(argv[++i])), kMaxLeafSize);
+        }
+        else if (!strcmp(argv[i], "--max-depth") && i + 1 < argc) {
+            max_depth = std::min(std::max(1, atoi(argv[++i])), kMaxLeafDepth);
+        }
+        else if (!strcmp(argv[i], "--spatial-budget") && i + 1 < argc) {
+            spatial_budget = std::max(0.0f, static_cast<float>(atof(argv[++i])));
+        }
+        else if (!strcmp(argv[i], "--formats")) {
+            formats = true;
+        }
+        else if (!strcmp(argv[i], "--layout")) {
+            layout = true;
+        }
+        else if (!strcmp(argv[i], "--stats")) {
+            stats = true;
+        }
+        else if (!strcmp(argv[i], "--stackless")) {
+            stackless = true;
+        }
+        else if (!strcmp(argv[i], "--node-layout")) {
+            node_layout = true;
+        }
+        else if (!strcmp(argv[i], "--optimize") && i + 1 < argc) {
+            optimize_seconds = std::max(0.0f, static_cast<float>(atof(argv[++i])));
+        }
+        else if (!strcmp(argv[i], "--refit") && i + 1 < argc) {
+            refit_frames = std::max(1, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--instances") && i + 1 < argc) {
+            instance_copies = std::max(1, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--scaling") && i + 1 < argc) {
+            max_threads = std::max(1, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--synthetic") && i + 1 < argc) {
+            synthetic_triangles = strtoull(argv[++i], nullptr, 10);
+        }
+        else {
+            files.push_back(argv[i]);
+        }
+    }
+    if (files.empty() && !synthetic_triangles) {
+        std::error_code err;
+        for (const fs::directory_entry &entry : fs::directory_iterator(DEBUG_DIR, err)) {
+            if (entry.path().extension() == ".txt") {
+                files.push_back(entry.path().string());
+            }
+        }
+        std::sort(files.begin(), files.end());
+    }
+
+    auto bench = [&](const std::string &name, const SceneData &scene) {
+        if (max_threads) {
+            benchScaling(name, scene, max_threads, leaf_size);
+        }
+        else if (formats) {
+            benchFormats(name, scene, width, height, num_threads, leaf_size);
+        }
+        else if (layout) {
+            benchLayout(name, scene, width, height, num_threads);
+        }
+        else if (stackless) {
+            benchStackless(name, scene, width, height, num_threads, leaf_size);
+        }
+        else if (node_layout) {
+            benchNodeLayout(name, scene, width, height, num_threads, leaf_size);
+        }
+        else if (optimize_seconds > 0.0f) {
+            benchOptimize(name, scene, optimize_seconds, width, height, num_threads, leaf_size, max_depth);
+        }
+        else if (stats) {
+            benchStats(name, scene, num_threads, leaf_size, spatial_budget, max_depth);
+        }
+        else if (refit_frames) {
+            benchRefit(name, scene, refit_frames, width, height, num_threads, leaf_size);
+        }
+        else if (instance_copies) {
+            benchInstances(name, scene, instance_copies, width, height, num_threads, leaf_size);
+        }
+        else {
+            benchScene(name, scene, width, height, num_threads, leaf_size, spatial_budget, max_depth);
+        }
+    };
+    if (!max_threads && !stats) {
+        std::cout << "Tracing " << width << "x" << height << " primary rays per scene" << std::endl;
+        if (formats) {
+            printFormatHeader();
+        }
+        else if (layout) {
+            printLayoutHeader();
+        }
+        else if (stackless) {
+            printStacklessHeader();
+        }
+        else if (node_layout) {
+            printNodeLayoutHeader();
+        }
+        else if (refit_frames) {
+            printRefitHeader();
+        }
+        else if (instance_copies) {
+            printInstancesHeader();
+        }
+        else {
+            printHeader();
+        }
+    }
+    for (const std::string &file_name : files) {
+        SceneData scene;
+        if (!loadScene(file_name, scene)) {
+            std::cerr << "Couldn't open file: " << file_name << std::endl;
+            continue;
+        }
+        bench(fs::path(file_name).filename().string(), scene);
+    }
+    if (synthetic_triangles) {
+        SceneData scene;
+        {
+            // free the text before building, it's as big as the tree for large scenes
+            std::string text = makeSyntheticScene(2 * synthetic_triangles);
+            parseScene(text.data(), text.size(), scene);
+        }
+        bench("synthetic", scene);
+    }
+    return 0;
+}
@@ -0,0 +1,309 @@
+/**
+ * ingest_bench - times every stage of getting a scene ready for the GPU: parsing the
+ * scenefile, building the bvh and preparing the buffers which are uploaded. Each stage
+ * reports its wall time, peak resident memory and throughput, and the results are written
+ * as JSON so runs can be compared to catch regressions. No window or OpenGL context is made.
+ * Usage: ingest_bench [--iterations n] [--threads n] [--layout indexed|expanded]
+ *                     [--max-triangles n] [--output file.json] [scene files...]
+ * When no files are given, every .txt scene in the data directory is measured. Synthetic
+ * scenes of 100K, 1M, 10M and 50M triangles follow, up to --max-triangles (0 skips them).
+ * They are streamed to a temporary file first so they are loaded like any other scene.
+ * Wall times are the best of --iterations runs (synthetic scenes over 1M triangles run once).
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bvh.h"
+#include "config.h"
+#include "mesh.h"
+#include "process_stats.h"
+#include "scene.h"
+#include "synthetic_scene.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const size_t kSyntheticTriangles[] = { 100000, 1000000, 10000000, 50000000 };
+
+/**
+ * StageResult - the best wall time of a stage and the most memory the process held
+ * by the end of it
+ */
+struct StageResult {
+    double secs = 1e30;
+    size_t peak_rss = 0;
+
+    void add(double run_secs, size_t run_rss) {
+        secs = std::min(secs, run_secs);
+        peak_rss = std::max(peak_rss, run_rss);
+    }
+};
+
+struct SceneResult {
+    std::string name;
+    std::string source;
+    size_t file_bytes = 0;
+    size_t triangles = 0;
+    size_t vertices = 0;
+    size_t normals = 0;
+    size_t nodes = 0;
+    size_t upload_bytes = 0;
+    StageResult parse;
+    StageResult build;
+    StageResult prep;
+};
+
+double secondsSince(std::chrono::high_resolution_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+/**
+ * Do the CPU side of the upload the way the raytracer does: gather the arrays out of
+ * the bvh (expanding the triangles for the expanded layout) and copy every buffer into
+ * one staging block, standing in for glBufferData copying out of client memory.
+ * Returns the number of bytes which would be uploaded.
+ */
+size_t prepareUpload(bvh &tree, const SceneData &scene, bool indexed_layout) {
+    const TriangleMesh &mesh = tree.getMesh();
+    int num_nodes;
+    const NodeGL *nodes = tree.getCompact(num_nodes);
+    std::vector<TriangleGL> expanded;
+    std::vector<std::pair<const void *, size_t>> buffers;
+    if (indexed_layout) {
+        buffers.emplace_back(data(mesh.triangles), mesh.triangles.size() * sizeof(TriangleIndexGL));
+        buffers.emplace_back(data(mesh.vertices), mesh.vertices.size() * sizeof(VertexGL));
+        buffers.emplace_back(data(mesh.normals), mesh.normals.size() * sizeof(VertexGL));
+    }
+    else {
+        expandTriangles(data(mesh.vertices), data(mesh.normals), data(mesh.triangles), mesh.triangles.size(), expanded);
+        buffers.emplace_back(data(expanded), expanded.size() * sizeof(TriangleGL));
+    }
+    buffers.emplace_back(data(scene.materials), scene.materials.size() * sizeof(MaterialGL));
+    buffers.emplace_back(data(scene.lights), scene.lights.size() * sizeof(LightGL));
+    buffers.emplace_back(nodes, num_nodes * sizeof(NodeGL));
+    size_t total = 0;
+    for (const auto &buffer : buffers) {
+        total += buffer.second;
+    }
+    std::unique_ptr<char[]> staging(new char[total]);
+    size_t offset = 0;
+    for (const auto &buffer : buffers) {
+        if (buffer.second) {
+            memcpy(staging.get() + offset, buffer.first, buffer.second);
+        }
+        offset += buffer.second;
+    }
+    return total;
+}
+
+/**
+ * Load, build and prepare file_name iterations times, keeping the best time of each stage
+ */
+bool benchScene(const std::string &file_name, int num_threads, int iterations, bool indexed_layout, SceneResult &result) {
+    std::error_code err;
+    result.file_bytes = fs::file_size(file_name, err);
+    if (err) {
+        std::cerr << "Couldn't open file: " << file_name << std::endl;
+        return false;
+    }
+    for (int it = 0; it < iterations; ++it) {
+        // every stage's peak includes the stages before it, as it would in the raytracer
+        resetPeakRss();
+        SceneData scene;
+        auto start = std::chrono::high_resolution_clock::now();
+        if (!loadScene(file_name, scene, num_threads)) {
+            std::cerr << "Couldn't open file: " << file_name << std::endl;
+            return false;
+        }
+        result.parse.add(secondsSince(start), peakRssBytes());
+        result.triangles = scene.mesh.triangles.size();
+        result.vertices = scene.mesh.vertices.size();
+        result.normals = scene.mesh.normals.size();
+
+        start = std::chrono::high_resolution_clock::now();
+        bvh tree(scene.mesh, BvhOptions(SPLIT_SAH, num_threads));
+        result.build.add(secondsSince(start), peakRssBytes());
+
+        start = std::chrono::high_resolution_clock::now();
+        result.upload_bytes = prepareUpload(tree, scene, indexed_layout);
+        result.prep.add(secondsSince(start), peakRssBytes());
+        int num_nodes;
+        tree.getCompact(num_nodes);
+        result.nodes = num_nodes;
+    }
+    return true;
+}
+
+/**
+ * Stream a synthetic scene with about num_triangles triangles to file_name
+ */
+bool writeSyntheticScene(const std::string &file_name, size_t num_triangles) {
+    std::ofstream out(file_name, std::ios::binary | std::ios::trunc);
+    if (!out.good()) {
+        return false;
+    }
+    std::string buffer;
+    buffer.reserve(1 << 20);
+    generateSyntheticScene(2 * num_triangles, [&](const char *line, size_t len) {
+        buffer.append(line, len);
+        if (buffer.size() >= (1 << 20) - 512) {
+            out.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    });
+    out.write(buffer.data(), buffer.size());
+    return out.good();
+}
+
+std::string jsonString(const std::string &value) {
+    std::string quoted = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+        }
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+void writeStage(std::ostream &out, const char *name, const StageResult &stage, double megabytes, size_t triangles, bool last) {
+    out << "      \"" << name << "\": { \"wall_ms\": " << stage.secs * 1e3 << ", \"peak_rss_bytes\": " << stage.peak_rss;
+    if (megabytes > 0.0) {
+        out << ", \"mb_per_s\": " << megabytes / stage.secs;
+    }
+    if (triangles) {
+        out << ", \"triangles_per_s\": " << triangles / stage.secs;
+    }
+    out << " }" << (last ? "" : ",") << "\n";
+}
+
+void writeJson(std::ostream &out, const std::vector<SceneResult> &results, int num_threads, int iterations, bool indexed_layout) {
+    out << std::fixed;
+    out.precision(3);
+    out << "{\n"
+        << "  \"benchmark\": \"ingest_bench\",\n"
+        << "  \"threads\": " << num_threads << ",\n"
+        << "  \"iterations\": " << iterations << ",\n"
+        << "  \"layout\": \"" << (indexed_layout ? "indexed" : "expanded") << "\",\n"
+        << "  \"scenes\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const SceneResult &result = results[i];
+        double megabytes = result.file_bytes / (1024.0 * 1024.0);
+        double upload_megabytes = result.upload_bytes / (1024.0 * 1024.0);
+        out << "    {\n"
+            << "      \"name\": " << jsonString(result.name) << ",\n"
+            << "      \"source\": \"" << result.source << "\",\n"
+            << "      \"file_bytes\": " << result.file_bytes << ",\n"
+            << "      \"triangles\": " << result.triangles << ",\n"
+            << "      \"vertices\": " << result.vertices << ",\n"
+            << "      \"normals\": " << result.normals << ",\n"
+            << "      \"bvh_nodes\": " << result.nodes << ",\n"
+            << "      \"upload_bytes\": " << result.upload_bytes << ",\n"
+            << "      \"total_ms\": " << (result.parse.secs + result.build.secs + result.prep.secs) * 1e3 << ",\n";
+        writeStage(out, "parse", result.parse, megabytes, result.triangles, false);
+        writeStage(out, "bvh", result.build, 0.0, result.triangles, false);
+        writeStage(out, "gpu_prep", result.prep, upload_megabytes, 0, true);
+        out << "    }" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    int iterations = 3;
+    int num_threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t max_triangles = 50000000;
+    bool indexed_layout = true;
+    std::string output_file;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--iterations") && i + 1 < argc) {
+            iterations = std::max(1, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            num_threads = std::max(1, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--max-triangles") && i + 1 < argc) {
+            max_triangles = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (!strcmp(argv[i], "--layout") && i + 1 < argc) {
+            indexed_layout = strcmp(argv[++i], "expanded") != 0;
+        }
+        else if (!strcmp(argv[i], "--output") && i + 1 < argc) {
+            output_file = argv[++i];
+        }
+        else {
+            files.push_back(argv[i]);
+        }
+    }
+    if (files.empty()) {
+        std::error_code err;
+        for (const fs::directory_entry &entry : fs::directory_iterator(DEBUG_DIR, err)) {
+            if (entry.path().extension() == ".txt") {
+                files.push_back(entry.path().string());
+            }
+        }
+        std::sort(files.begin(), files.end());
+    }
+
+    // Progress goes to cerr so the JSON on cout can be redirected on its own
+    std::vector<SceneResult> results;
+    for (const std::string &file_name : files) {
+        SceneResult result;
+        result.name = fs::path(file_name).filename().string();
+        result.source = "file";
+        std::cerr << "Benchmarking " << result.name << "..." << std::endl;
+        if (benchScene(file_name, num_threads, iterations, indexed_layout, result)) {
+            results.push_back(result);
+        }
+    }
+    for (size_t num_triangles : kSyntheticTriangles) {
+        if (num_triangles > max_triangles) {
+            break;
+        }
+        SceneResult result;
+        result.name = "synthetic_" + std::to_string(num_triangles);
+        result.source = "synthetic";
+        std::string file_name = (fs::temp_directory_path() / ("ingest_bench_" + std::to_string(num_triangles) + ".txt")).string();
+        std::cerr << "Generating " << result.name << "..." << std::endl;
+        if (!writeSyntheticScene(file_name, num_triangles)) {
+            std::cerr << "Couldn't write " << file_name << std::endl;
+            continue;
+        }
+        std::cerr << "Benchmarking " << result.name << "..." << std::endl;
+        int runs = num_triangles > 1000000 ? 1 : iterations;
+        if (benchScene(file_name, num_threads, runs, indexed_layout, result)) {
+            results.push_back(result);
+        }
+        std::error_code err;
+        fs::remove(file_name, err);
+    }
+    if (results.empty()) {
+        std::cerr << "No scenes were benchmarked" << std::endl;
+        return 1;
+    }
+
+    if (output_file.empty()) {
+        writeJson(std::cout, results, num_threads, iterations, indexed_layout);
+    }
+    else {
+        std::ofstream out(output_file);
+        writeJson(out, results, num_threads, iterations, indexed_layout);
+        if (!out.good()) {
+            std::cerr << "Couldn't write " << output_file << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,243 @@
+/**
+ * load_bench - measures scenefile load throughput in MB/s.
+ * Usage: load_bench [--iterations n] [--threads n] [--synthetic lines] [--pipeline] [--clean] [scene files...]
+ * When no files are given, every .txt scene in the data directory is loaded.
+ * --synthetic generates a scene with the given number of lines in memory and reports
+ * how parsing scales from 1 thread up to --threads (default: every hardware thread).
+ * --pipeline compares parsing and then building the bvh against the pipelined load,
+ * where triangles are bounded by the bvh builder while the file is still being parsed.
+ * --clean reports how much cleanMesh shrinks each scene's buffers and bvh.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bvh.h"
+#include "config.h"
+#include "mapped_file.h"
+#include "scene.h"
+#include "synthetic_scene.h"
+
+namespace fs = std::filesystem;
+
+/**
+ * Parse text iterations times and return the best time in seconds
+ */
+static double timeParse(const char *text, size_t size, int num_threads, int iterations, size_t &num_tris) {
+    double best = 1e30;
+    for (int it = 0; it < iterations; ++it) {
+        SceneData scene;
+        auto start = std::chrono::high_resolution_clock::now();
+        parseScene(text, size, scene, num_threads);
+        auto end = std::chrono::high_resolution_clock::now();
+        best = std::min(best, std::chrono::duration<double>(end - start).count());
+        num_tris = scene.mesh.triangles.size();
+    }
+    return best;
+}
+
+/**
+ * Time parse + bvh build both one after the other and as a pipeline, keeping the best
+ * of iterations runs. Returns the times in seconds through serial and pipelined.
+ */
+static void timeLoadAndBuild(const char *text, size_t size, int num_threads, int iterations, double &serial, double &pipelined) {
+    serial = pipelined = 1e30;
+    for (int it = 0; it < iterations; ++it) {
+        auto start = std::chrono::high_resolution_clock::now();
+        {
+            SceneData scene;
+            parseScene(text, size, scene, num_threads);
+            bvh tree(scene.mesh);
+        }
+        auto middle = std::chrono::high_resolution_clock::now();
+        {
+            SceneData scene;
+            bvh_builder builder;
+            parseScene(text, size, scene, num_threads, builder.sink());
+            bvh tree = builder.finish(scene.mesh);
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        serial = std::min(serial, std::chrono::duration<double>(middle - start).count());
+        pipelined = std::min(pipelined, std::chrono::duration<double>(end - middle).count());
+    }
+}
+
+static void printLoadAndBuild(const std::string &name, const char *text, size_t size, int num_threads, int iterations) {
+    double serial, pipelined;
+    timeLoadAndBuild(text, size, num_threads, iterations, serial, pipelined);
+    std::cout << std::left << std::setw(28) << name << std::right << std::fixed << std::setprecision(1)
+              << std::setw(14) << serial * 1e3 << std::setw(14) << pipelined * 1e3
+              << std::setprecision(2) << std::setw(10) << serial / pipelined << std::endl;
+}
+
+static void benchSynthetic(size_t num_lines, int max_threads, int iterations) {
+    std::cout << "Generating a synthetic scene with " << num_lines << " lines..." << std::endl;
+    std::string text = makeSyntheticScene(num_lines);
+    double megabytes = text.size() / (1024.0 * 1024.0);
+    std::cout << std::fixed << std::setprecision(1) << megabytes << " MB" << std::endl;
+    std::cout << std::setw(8) << "threads" << std::setw(12) << "triangles" << std::setw(12) << "best ms"
+              << std::setw(12) << "MB/s" << std::setw(10) << "speedup" << std::endl;
+    double single = 0.0;
+    for (int threads = 1; ; threads = std::min(threads * 2, max_threads)) {
+        size_t num_tris = 0;
+        double secs = timeParse(text.data(), text.size(), threads, iterations, num_tris);
+        if (threads == 1) {
+            single = secs;
+        }
+        std::cout << std::setw(8) << threads << std::setw(12) << num_tris << std::setprecision(1)
+                  << std::setw(12) << secs * 1e3 << std::setw(12) << megabytes / secs
+                  << std::setprecision(2) << std::setw(10) << single / secs << std::endl;
+        if (threads == max_threads) {
+            break;
+        }
+    }
+}
+
+/**
+ * Load a scene and print its buffer sizes and bvh node count before and after cleanMesh
+ */
+static void printClean(const std::string &file_name) {
+    SceneData scene;
+    if (!loadScene(file_name, scene)) {
+        std::cerr << "Couldn't open file: " << file_name << std::endl;
+        return;
+    }
+    // the bvh takes over the mesh it is built from, so build the "before" tree from a copy
+    TriangleMesh mesh = scene.mesh;
+    int nodes_before, nodes_after;
+    bvh(mesh).getCompact(nodes_before);
+    mesh = scene.mesh;
+    auto start = std::chrono::high_resolution_clock::now();
+    MeshCleanStats stats = cleanMesh(scene.mesh);
+    auto end = std::chrono::high_resolution_clock::now();
+    TriangleMesh cleaned = scene.mesh;
+    bvh(scene.mesh).getCompact(nodes_after);
+    auto column = [](size_t before, size_t after) {
+        return std::to_string(before) + " -> " + std::to_string(after);
+    };
+    std::cout << std::left << std::setw(28) << fs::path(file_name).filename().string() << std::right
+              << std::setw(20) << column(mesh.vertices.size(), cleaned.vertices.size())
+              << std::setw(20) << column(mesh.normals.size(), cleaned.normals.size())
+              << std::setw(20) << column(mesh.triangles.size(), cleaned.triangles.size())
+              << std::setw(20) << column(nodes_before, nodes_after)
+              << std::fixed << std::setprecision(2) << std::setw(10)
+              << std::chrono::duration<double>(end - start).count() * 1e3 << std::endl;
+    std::cout << "    welded " << stats.welded_vertices << " vertices, " << stats.welded_normals << " normals; removed "
+              << stats.degenerate_triangles << " degenerate, " << stats.duplicate_triangles << " duplicate triangles, "
+              << stats.unused_vertices << " unused vertices, " << stats.unused_normals << " unused normals" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = 20;
+    int max_threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t synthetic_lines = 0;
+    bool pipeline = false;
+    bool clean = false;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--iterations") && i + 1 < argc) {
+            iterations = std::max(1, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            max_threads = std::max(1, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--synthetic") && i + 1 < argc) {
+            synthetic_lines = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (!strcmp(argv[i], "--pipeline")) {
+            pipeline = true;
+        }
+        else if (!strcmp(argv[i], "--clean")) {
+            clean = true;
+        }
+        else {
+            files.push_back(argv[i]);
+        }
+    }
+    if (synthetic_lines && pipeline) {
+        std::string text = makeSyntheticScene(synthetic_lines);
+        std::cout << std::left << std::setw(28) << "scene" << std::right << std::setw(14) << "serial ms"
+                  << std::setw(14) << "pipelined ms" << std::setw(10) << "speedup" << std::endl;
+        printLoadAndBuild("synthetic", text.data(), text.size(), max_threads, std::min(iterations, 3));
+        return 0;
+    }
+    if (synthetic_lines) {
+        benchSynthetic(synthetic_lines, max_threads, std::min(iterations, 3));
+        return 0;
+    }
+    if (files.empty()) {
+        std::error_code err;
+        for (const fs::directory_entry &entry : fs::directory_iterator(DEBUG_DIR, err)) {
+            if (entry.path().extension() == ".txt") {
+                files.push_back(entry.path().string());
+            }
+        }
+        std::sort(files.begin(), files.end());
+    }
+    if (files.empty()) {
+        std::cerr << "No scene files found in " << DEBUG_DIR << std::endl;
+        return 1;
+    }
+
+    if (clean) {
+        std::cout << std::left << std::setw(28) << "scene" << std::right << std::setw(20) << "vertices"
+                  << std::setw(20) << "normals" << std::setw(20) << "triangles" << std::setw(20) << "bvh nodes"
+                  << std::setw(10) << "clean ms" << std::endl;
+        for (const std::string &file_name : files) {
+            printClean(file_name);
+        }
+        return 0;
+    }
+
+    if (pipeline) {
+        std::cout << std::left << std::setw(28) << "scene" << std::right << std::setw(14) << "serial ms"
+                  << std::setw(14) << "pipelined ms" << std::setw(10) << "speedup" << std::endl;
+        for (const std::string &file_name : files) {
+            MappedFile file;
+            if (!file.open(file_name)) {
+                std::cerr << "Couldn't open file: " << file_name << std::endl;
+                continue;
+            }
+            printLoadAndBuild(fs::path(file_name).filename().string(), file.data(), file.size(), max_threads, iterations);
+        }
+        return 0;
+    }
+
+    std::cout << std::left << std::setw(28) << "scene" << std::right
+              << std::setw(12) << "MB" << std::setw(12) << "triangles"
+              << std::setw(12) << "best ms" << std::setw(12) << "mean ms" << std::setw(12) << "MB/s" << std::endl;
+    for (const std::string &file_name : files) {
+        MappedFile file;
+        if (!file.open(file_name)) {
+            std::cerr << "Couldn't open file: " << file_name << std::endl;
+            continue;
+        }
+        double megabytes = file.size() / (1024.0 * 1024.0);
+        file.close();
+
+        double best = 1e30, total = 0.0;
+        size_t num_tris = 0;
+        for (int it = 0; it < iterations; ++it) {
+            SceneData scene;
+            auto start = std::chrono::high_resolution_clock::now();
+            loadScene(file_name, scene, max_threads);
+            auto end = std::chrono::high_resolution_clock::now();
+            double secs = std::chrono::duration<double>(end - start).count();
+            best = std::min(best, secs);
+            total += secs;
+            num_tris = scene.mesh.triangles.size();
+        }
+        std::cout << std::left << std::setw(28) << fs::path(file_name).filename().string() << std::right << std::fixed
+                  << std::setprecision(2) << std::setw(12) << megabytes << std::setw(12) << num_tris
+                  << std::setprecision(3) << std::setw(12) << best * 1e3 << std::setw(12) << total / iterations * 1e3
+                  << std::setprecision(1) << std::setw(12) << megabytes / best << std::endl;
+    }
+    return 0;
+}
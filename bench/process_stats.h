@@ -0,0 +1,75 @@
+#ifndef PROCESS_STATS_H
+#define PROCESS_STATS_H
+
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+/**
+ * The largest resident set size the process has had so far, in bytes (since the last
+ * successful resetPeakRss). Returns 0 if the platform can't tell.
+ */
+inline size_t peakRssBytes() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.PeakWorkingSetSize;
+    }
+    return 0;
+#else
+#ifdef __linux__
+    // VmHWM follows resets through clear_refs, ru_maxrss does not
+    if (FILE *status = fopen("/proc/self/status", "r")) {
+        char line[256];
+        size_t kb = 0;
+        while (fgets(line, sizeof(line), status)) {
+            if (!strncmp(line, "VmHWM:", 6)) {
+                kb = strtoull(line + 6, nullptr, 10);
+                break;
+            }
+        }
+        fclose(status);
+        if (kb) {
+            return kb * 1024;
+        }
+    }
+#endif
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage)) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return static_cast<size_t>(usage.ru_maxrss);
+#else
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+/**
+ * Reset the peak resident set size to the current one, so each measurement only sees
+ * its own high water mark. Only Linux supports this; elsewhere it returns false and
+ * peakRssBytes keeps reporting the peak of the whole process.
+ */
+inline bool resetPeakRss() {
+#ifdef __linux__
+    if (FILE *clear_refs = fopen("/proc/self/clear_refs", "w")) {
+        bool ok = fputs("5", clear_refs) >= 0;
+        return fclose(clear_refs) == 0 && ok;
+    }
+#endif
+    return false;
+}
+
+#endif  // PROCESS_STATS_H
@@ -0,0 +1,70 @@
+#ifndef SYNTHETIC_SCENE_H
+#define SYNTHETIC_SCENE_H
+
+#include <cmath>
+#include <cstdio>
+#include <string>
+
+/**
+ * Generate a scenefile with roughly num_lines lines. The scene is a rippled height field
+ * with one vertex and one normal per grid point and two triangles per grid cell. Every
+ * other row uses normal_triangle: so both triangle paths of the parser are exercised,
+ * and a new material starts every 100,000 triangles. The scene has about num_lines / 2
+ * triangles. The text is handed to append(const char *text, size_t len) a line or two at
+ * a time, so very large scenes can be streamed straight to a file.
+ */
+template<typename Append>
+void generateSyntheticScene(size_t num_lines, Append append) {
+    // s*s vertices, s*s normals and 2*(s-1)^2 triangles
+    size_t side = static_cast<size_t>(std::sqrt(num_lines / 4.0)) + 2;
+    char line[512];
+    int len = snprintf(line, sizeof(line),
+                       "# synthetic height field %zux%zu\ncamera_pos: 0 2 4\ncamera_fwd: 0 .5 1\ncamera_up: 0 1 0\ncamera_fov_ha: 35\n"
+                       "max_vertices: %zu\nmax_normals: %zu\npoint_light: 10 10 10 0 5 0\n",
+                       side, side, side * side, side * side);
+    append(line, len);
+    float scale = 2.0f / (side - 1);
+    for (size_t y = 0; y < side; ++y) {
+        for (size_t x = 0; x < side; ++x) {
+            float px = x * scale - 1.0f, pz = y * scale - 1.0f;
+            float py = 0.1f * std::sin(8.0f * px) * std::cos(8.0f * pz);
+            len = snprintf(line, sizeof(line), "vertex: %.5f %.5f %.5f\nnormal: %.4f %.4f %.4f\n",
+                           px, py, pz, -0.8f * std::cos(8.0f * px) * std::cos(8.0f * pz), 1.0f,
+                           0.8f * std::sin(8.0f * px) * std::sin(8.0f * pz));
+            append(line, len);
+        }
+    }
+    size_t num_tris = 0;
+    for (size_t y = 0; y + 1 < side; ++y) {
+        for (size_t x = 0; x + 1 < side; ++x) {
+            size_t a = y * side + x, b = a + 1, c = a + side, d = c + 1;
+            if (num_tris % 100000 == 0) {
+                float shade = 0.3f + 0.1f * ((num_tris / 100000) % 7);
+                len = snprintf(line, sizeof(line), "material: %.2f %.2f %.2f %.2f %.2f %.2f .2 .2 .2 10 0 0 0 1\n",
+                               shade, shade, 1 - shade, shade, shade, 1 - shade);
+                append(line, len);
+            }
+            if (y % 2) {
+                len = snprintf(line, sizeof(line), "normal_triangle: %zu %zu %zu %zu %zu %zu\nnormal_triangle: %zu %zu %zu %zu %zu %zu\n",
+                               a, c, b, a, c, b, b, c, d, b, c, d);
+            }
+            else {
+                len = snprintf(line, sizeof(line), "triangle: %zu %zu %zu\ntriangle: %zu %zu %zu\n", a, c, b, b, c, d);
+            }
+            append(line, len);
+            num_tris += 2;
+        }
+    }
+}
+
+/**
+ * Generate a synthetic scene of roughly num_lines lines in memory
+ */
+inline std::string makeSyntheticScene(size_t num_lines) {
+    std::string text;
+    text.reserve(num_lines * 40);
+    generateSyntheticScene(num_lines, [&text](const char *line, size_t len) { text.append(line, len); });
+    return text;
+}
+
+#endif  // SYNTHETIC_SCENE_H
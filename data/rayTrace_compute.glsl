@@ -3,6 +3,12 @@
 
 layout(local_size_x = 10, local_size_y = 10) in;
 
+// The host defines STACK_SIZE, the most entries sceneIntersect's stack can need for the
+// bvh it loaded, so small trees don't pay for a big stack
+#ifndef STACK_SIZE
+#define STACK_SIZE 64
+#endif
+
 // Structs defined for easy organization of data
 // For more info, see the companion ___GL structs in
 // structs.h
@@ -19,7 +25,7 @@ struct HitInfo {
     vec3 pos;
     vec3 norm;
     float time;
-    Material mat;
+    int mat; // offset in the material buffer
     bool hit;
 };
 
@@ -30,7 +36,14 @@ struct Triangle {
     vec3 n1;
     vec3 n2;
     vec3 n3;
-    Material mat;
+    int mat; // offset in the material buffer
+};
+
+// Indexed layout: offsets into the vertex, normal and material buffers.
+// v.w is the material, and n.x is -1 for flat shaded triangles
+struct TriangleIndex {
+    ivec4 v;
+    ivec4 n;
 };
 
 struct Light {
@@ -45,12 +58,70 @@ struct Dimension {
   vec3 max_pt;
 };
 
+#ifdef STACKLESS
+// A node threaded with a skip link. The nodes are in depth first order, so a ray which
+// hits an inner node's box goes on to the next node, and one which misses it (or has
+// tested a leaf's triangles) goes to skip, or stops at -1
+struct Node {
+  Dimension dim;
+  int skip;
+  int padding;
+  // leaves hold the triangles [tri_offset, tri_offset + tri_count)
+  int tri_offset;
+  int tri_count;
+};
+#else
 struct Node {
   Dimension dim;
   int l_child;
   int r_child;
+  // leaves hold the triangles [tri_offset, tri_offset + tri_count)
   int tri_offset;
+  int tri_count;
 };
+#endif
+
+#ifdef BVH_WIDTH
+// A node of the BVH_WIDTH wide bvh, holding the bounds of all its children. The host
+// also defines QUANTIZED_BITS when the child bounds are quantized
+#ifdef QUANTIZED_BITS
+struct WideNode {
+  // the min corner of the node's box, and the size of one quantization step
+  float origin[3];
+  float scale[3];
+  // the children's min x, y, z and then max x, y, z in steps from the origin,
+  // QUANTIZED_BITS each, packed from the low bits of every word up
+  uint bounds[(6 * BVH_WIDTH * QUANTIZED_BITS + 31) / 32];
+  // an inner child's node, a leaf child's first triangle, or -1 for an empty slot
+  int child[BVH_WIDTH];
+  // a leaf child's number of triangles, 0 for inner children, 8 bits each
+  uint tri_count[(BVH_WIDTH + 3) / 4];
+};
+#else
+struct WideNode {
+  float min_x[BVH_WIDTH];
+  float min_y[BVH_WIDTH];
+  float min_z[BVH_WIDTH];
+  float max_x[BVH_WIDTH];
+  float max_y[BVH_WIDTH];
+  float max_z[BVH_WIDTH];
+  // an inner child's node, a leaf child's first triangle, or -1 for an empty slot
+  int child[BVH_WIDTH];
+  // a leaf child's number of triangles, 0 for inner children
+  int tri_count[BVH_WIDTH];
+};
+#endif
+#endif
+
+#ifdef TWO_LEVEL
+// One placed copy of a mesh: the rotation half (s, yz, zx, xy) and the translation
+// half (wx, wy, wz, wxyz) of its motor, and the root of the mesh's bvh in root.x
+struct Instance {
+  vec4 rotation;
+  vec4 translation;
+  ivec4 root;
+};
+#endif
 
 struct Ray {
   vec3 pos;
@@ -61,17 +132,43 @@ struct Ray {
 // Output raytraced image
 layout(binding = 0, rgba32f) uniform writeonly image2D result;
 // Scene triangles
+#ifdef INDEXED_TRIANGLES
+layout(binding = 1, std430) buffer triangles {
+    TriangleIndex tris[];
+};
+layout(binding = 4, std430) buffer vertex_buf {
+    vec4 verts[];
+};
+layout(binding = 5, std430) buffer normal_buf {
+    vec4 norms[];
+};
+#else
 layout(binding = 1, std430) buffer triangles {
     Triangle tris[];
 };
+#endif
+// Scene materials, referenced by offset from the triangles
+layout(binding = 6, std430) buffer material_buf {
+    Material mats[];
+};
 // Scene lights
 layout(binding = 2, std430) buffer light_buf {
     Light lights[];
 };
 // BVH
 layout(binding = 3, std430) buffer bvh_scene {
+#ifdef BVH_WIDTH
+    WideNode nodes[];
+#else
     Node nodes[];
+#endif
+};
+#ifdef TWO_LEVEL
+// Instances, indexed by the leaves of the bvh's top level
+layout(binding = 7, std430) buffer instance_buf {
+    Instance instances[];
 };
+#endif
 
 // these are for the camera
 uniform vec3 eye;
@@ -98,7 +195,7 @@ void rayRecurse4(in Ray incoming, in int depth, out vec4 color);
 
 // Ray intersection functions
 void sceneIntersect(in Ray incoming, inout HitInfo hit);
-void triangleIntersect(in Ray incoming, in Triangle tri, inout HitInfo hit);
+void triangleIntersect(in Ray incoming, in int tri_idx, inout HitInfo hit);
 void AABBIntersect(in Ray incoming, in Dimension dim, inout HitInfo hit);
 // Apply Phong-Blinn lighting model at the point
 void lightPoint(in vec3 pos, in vec3 reflect_dir, in vec3 norm, in Material mat, out vec4 color);
@@ -129,9 +226,10 @@ void rayRecurse(in Ray incoming, in int depth, out vec4 color) {
   sceneIntersect(incoming, hit);
   vec4 clr = vec4(background_clr, 1.0);
   if (hit.hit) {
+    Material mat = mats[hit.mat];
     vec3 r = reflect(incoming.dir, hit.norm);
-    lightPoint(hit.pos, r, hit.norm, hit.mat, clr);
-    if(hit.mat.ks.r + hit.mat.ks.g + hit.mat.ks.b > 0.0) {
+    lightPoint(hit.pos, r, hit.norm, mat, clr);
+    if(mat.ks.r + mat.ks.g + mat.ks.b > 0.0) {
       HitInfo reflect_hit;
       reflect_hit.hit = false;
       reflect_hit.time = 1.0 / 0.0;
@@ -139,7 +237,7 @@ void rayRecurse(in Ray incoming, in int depth, out vec4 color) {
       vec3 wiggle = hit.pos + .00001 * (r);
       Ray reflect_ray = Ray(wiggle, 1000 * r, .001 / r);
       rayRecurse2(reflect_ray, 2, reflect_clr);
-      clr = vec4(clr.rgb + hit.mat.ks * reflect_clr.rgb, 1);
+      clr = vec4(clr.rgb + mat.ks * reflect_clr.rgb, 1);
     }
   }
   color = clr;
@@ -152,9 +250,10 @@ void rayRecurse2(in Ray incoming, in int depth, out vec4 color) {
   sceneIntersect(incoming, hit);
   vec4 clr = vec4(0, 0, 0, 1.0);
   if (hit.hit) {
+    Material mat = mats[hit.mat];
     vec3 r = reflect(incoming.dir, hit.norm);
-    lightPoint(hit.pos, r, hit.norm, hit.mat, clr);
-    if(hit.mat.ks.x + hit.mat.ks.y + hit.mat.ks.z > 0.0) {
+    lightPoint(hit.pos, r, hit.norm, mat, clr);
+    if(mat.ks.x + mat.ks.y + mat.ks.z > 0.0) {
       HitInfo reflect_hit;
       reflect_hit.hit = false;
       reflect_hit.time = 1.0 / 0.0;
@@ -163,7 +262,7 @@ void rayRecurse2(in Ray incoming, in int depth, out vec4 color) {
       vec3 wiggle = hit.pos + .00001 * (r);
       Ray reflect_ray = Ray(wiggle, 1000 * r, .001 / r);
       rayRecurse3(reflect_ray, 2, reflect_clr);
-      clr = vec4(clr.rgb + hit.mat.ks * reflect_clr.rgb, 1);
+      clr = vec4(clr.rgb + mat.ks * reflect_clr.rgb, 1);
     }
   }
   color = clr;
@@ -176,9 +275,10 @@ void rayRecurse3(in Ray incoming, in int depth, out vec4 color) {
   sceneIntersect(incoming, hit);
   vec4 clr = vec4(0, 0, 0, 1.0);
   if (hit.hit) {
+    Material mat = mats[hit.mat];
     vec3 r = reflect(incoming.dir, hit.norm);
-    lightPoint(hit.pos, r, hit.norm, hit.mat, clr);
-    if(hit.mat.ks.x + hit.mat.ks.y + hit.mat.ks.z > 0.0) {
+    lightPoint(hit.pos, r, hit.norm, mat, clr);
+    if(mat.ks.x + mat.ks.y + mat.ks.z > 0.0) {
       HitInfo reflect_hit;
       reflect_hit.hit = false;
       reflect_hit.time = 1.0 / 0.0;
@@ -187,7 +287,7 @@ void rayRecurse3(in Ray incoming, in int depth, out vec4 color) {
       vec3 wiggle = hit.pos + .00001 * (r);
       Ray reflect_ray = Ray(wiggle, r, 1.0 / r);
       rayRecurse4(reflect_ray, 2, reflect_clr);
-      clr = vec4(clr.rgb + hit.mat.ks * reflect_clr.rgb, 1);
+      clr = vec4(clr.rgb + mat.ks * reflect_clr.rgb, 1);
     }
   }
   color = clr;
@@ -200,23 +300,230 @@ void rayRecurse4(in Ray incoming, in int depth, out vec4 color) {
   sceneIntersect(incoming, hit);
   vec4 clr = vec4(0, 0, 0, 1.0);
   if (hit.hit) {
+    Material mat = mats[hit.mat];
     vec3 r = reflect(incoming.dir, hit.norm);
-    lightPoint(hit.pos, r, hit.norm, hit.mat, clr);
+    lightPoint(hit.pos, r, hit.norm, mat, clr);
   }
   color = clr;
 }
 
+#ifdef BVH_WIDTH
+#ifdef QUANTIZED_BITS
+/**
+ * Decode bound side (0 to 2 for min x, y, z, 3 to 5 for max) of a child of node. The
+ * steps are powers of two, so this gives exactly the bound the host rounded outwards.
+ */
+float quantizedBound(int node, int side, int child) {
+  int bit = (side * BVH_WIDTH + child) * QUANTIZED_BITS;
+  uint steps = (nodes[node].bounds[bit >> 5] >> uint(bit & 31)) & ((1u << QUANTIZED_BITS) - 1u);
+  int axis = side % 3;
+  return float(steps) * nodes[node].scale[axis] + nodes[node].origin[axis];
+}
+
+Dimension wideChildBox(int node, int child) {
+  Dimension dim;
+  dim.min_pt = vec3(quantizedBound(node, 0, child), quantizedBound(node, 1, child), quantizedBound(node, 2, child));
+  dim.max_pt = vec3(quantizedBound(node, 3, child), quantizedBound(node, 4, child), quantizedBound(node, 5, child));
+  return dim;
+}
+
+int wideChildTriangles(int node, int child) {
+  return int((nodes[node].tri_count[child >> 2] >> uint((child & 3) * 8)) & 0xffu);
+}
+#else
+Dimension wideChildBox(int node, int child) {
+  Dimension dim;
+  dim.min_pt = vec3(nodes[node].min_x[child], nodes[node].min_y[child], nodes[node].min_z[child]);
+  dim.max_pt = vec3(nodes[node].max_x[child], nodes[node].max_y[child], nodes[node].max_z[child]);
+  return dim;
+}
+
+int wideChildTriangles(int node, int child) {
+  return nodes[node].tri_count[child];
+}
+#endif
+
+/**
+ * Traverse the wide BVH. One node holds the boxes of all its children, so each loop
+ * fetches a single node and tests BVH_WIDTH boxes. Leaf children are tested right away
+ * and only the inner children whose boxes were hit go on the stack.
+ */
+void sceneIntersect(in Ray incoming, inout HitInfo hit) {
+    int index = 0;
+    int stack[STACK_SIZE];
+    stack[0] = 0;
+    while(index >= 0) {
+      // pop off the "top" node
+      int cur_node_idx = stack[index];
+      index = index - 1;
+      for(int i = 0; i < BVH_WIDTH; ++i) {
+        int child = nodes[cur_node_idx].child[i];
+        if(child == -1) {
+          // the empty slots come last
+          break;
+        }
+        HitInfo box_hit;
+        box_hit.hit = false;
+        box_hit.time = 1.0 / 0.0;
+        AABBIntersect(incoming, wideChildBox(cur_node_idx, i), box_hit);
+        if(!box_hit.hit) {
+          continue;
+        }
+        int tri_count = wideChildTriangles(cur_node_idx, i);
+        if(tri_count > 0) {
+          // a leaf, so check if the ray intersects its triangles
+          for(int tri = child; tri < child + tri_count; ++tri) {
+            HitInfo tri_hit;
+            tri_hit.time = 1.0/0.0;
+            tri_hit.hit = false;
+            triangleIntersect(incoming, tri, tri_hit);
+            if(tri_hit.hit && tri_hit.time < hit.time) {
+              // this triangle is closest, so keep track of it
+              hit = tri_hit;
+            }
+          }
+        }
+        else {
+          index = index + 1;
+          stack[index] = child;
+        }
+      }
+    }
+}
+#elif defined(TWO_LEVEL)
+/**
+ * Turn dir by the rotation half (s, yz, zx, xy) of a motor
+ */
+vec3 motorDirection(in vec4 rotation, in vec3 dir) {
+  return dir + 2.0 * cross(rotation.yzw, cross(rotation.yzw, dir) + rotation.x * dir);
+}
+
+/**
+ * The offset a motor moves the origin by
+ */
+vec3 motorOffset(in vec4 rotation, in vec4 translation) {
+  return 2.0 * (rotation.x * translation.xyz + translation.w * rotation.yzw - cross(translation.xyz, rotation.yzw));
+}
+
+/**
+ * Traverse the two level BVH. Each leaf of the top level holds one instance: the ray
+ * is moved into the instance's space by the inverse of its motor and the root of its
+ * mesh's bvh is pushed. Once the stack is back down to where it was, the mesh is done
+ * and the world ray is used again. The motors are rigid, so a hit time is the same in
+ * both spaces and only the hit's position and normal have to be moved back.
+ */
+void sceneIntersect(in Ray incoming, inout HitInfo hit) {
+    int index = 0;
+    // room for the deepest top level path followed by the deepest mesh path
+    int stack[STACK_SIZE];
+    stack[0] = 0;
+    Ray ray = incoming;
+    // the instance being visited, and the top of the stack when its root was pushed
+    int instance = -1;
+    int instance_index = 0;
+    vec4 rotation = vec4(1, 0, 0, 0);
+    while(index >= 0) {
+      if(instance != -1 && index == instance_index) {
+        ray = incoming;
+        instance = -1;
+      }
+      // pop off the "top" node
+      int cur_node_idx = stack[index];
+      index = index - 1;
+      Node cur_node = nodes[cur_node_idx];
+      HitInfo box_hit;
+      box_hit.hit = false;
+      box_hit.time = 1.0 / 0.0;
+      AABBIntersect(ray, cur_node.dim, box_hit);
+      if(!box_hit.hit) {
+        continue;
+      }
+      if(cur_node.l_child != -1 || cur_node.r_child != -1) {
+        // add the child nodes to the stack (right child first then left)
+        index = index + 1;
+        stack[index] = cur_node.r_child;
+        index = index + 1;
+        stack[index] = cur_node.l_child;
+      }
+      else if(instance == -1) {
+        // a top level leaf, so move into the instance's space
+        instance = cur_node.tri_offset;
+        rotation = instances[instance].rotation;
+        vec4 inverse = vec4(rotation.x, -rotation.yzw);
+        vec3 offset = motorOffset(rotation, instances[instance].translation);
+        ray.pos = motorDirection(inverse, incoming.pos - offset);
+        ray.dir = motorDirection(inverse, incoming.dir);
+        ray.inv_dir = 1.0 / ray.dir;
+        instance_index = index;
+        index = index + 1;
+        stack[index] = instances[instance].root.x;
+      }
+      else {
+        for(int i = cur_node.tri_offset; i < cur_node.tri_offset + cur_node.tri_count; ++i) {
+          HitInfo tri_hit;
+          tri_hit.time = 1.0/0.0;
+          tri_hit.hit = false;
+          triangleIntersect(ray, i, tri_hit);
+          if(tri_hit.hit && tri_hit.time < hit.time) {
+            // this triangle is closest, so keep track of it in world space
+            hit = tri_hit;
+            hit.pos = incoming.pos + incoming.dir * tri_hit.time;
+            hit.norm = motorDirection(rotation, tri_hit.norm);
+          }
+        }
+      }
+    }
+}
+#elif defined(STACKLESS)
+/**
+ * Traverse the BVH without a stack by following the skip links. The nodes are visited in
+ * the same order as the stack based traversal visits them, but the only state is the
+ * index of the next node, which frees the registers and local memory of the stack.
+ */
+void sceneIntersect(in Ray incoming, inout HitInfo hit) {
+    int cur_node_idx = 0;
+    while(cur_node_idx != -1) {
+      Node cur_node = nodes[cur_node_idx];
+      HitInfo box_hit;
+      box_hit.hit = false;
+      box_hit.time = 1.0 / 0.0;
+      AABBIntersect(incoming, cur_node.dim, box_hit);
+      if(!box_hit.hit) {
+        cur_node_idx = cur_node.skip;
+        continue;
+      }
+      if(cur_node.tri_count > 0) {
+        // This is a leaf node, so check if the ray intersects its triangles
+        for(int i = cur_node.tri_offset; i < cur_node.tri_offset + cur_node.tri_count; ++i) {
+          HitInfo tri_hit;
+          tri_hit.time = 1.0/0.0;
+          tri_hit.hit = false;
+          triangleIntersect(incoming, i, tri_hit);
+          if(tri_hit.hit && tri_hit.time < hit.time) {
+            // this triangle is closest, so keep track of it
+            hit = tri_hit;
+          }
+        }
+        cur_node_idx = cur_node.skip;
+      }
+      else {
+        // the left child comes next in depth first order
+        cur_node_idx = cur_node_idx + 1;
+      }
+    }
+}
+#else
 /**
  * Iteratively traverse the BVH using DFS to find a triangle collision.
  * Since we don't have any fancy data structures in GLSL, we
  * shall represent a stack using a finite array. This may seem
  * like a troublesome idea at first, but recall that DFS has a space complexity
- * of O(d). Therefore even if we limit the stack to a finite size of 20, we can
- * support up to 1,048,576 triangles!
+ * of O(d). The host measures the deepest the stack gets for its tree and sizes
+ * the array to match.
  */    
 void sceneIntersect(in Ray incoming, inout HitInfo hit) {
     int index = 0;
-    int stack[20];
+    int stack[STACK_SIZE];
     stack[0] = 0;
     HitInfo cur_hit;
     cur_hit.hit = false;
@@ -239,14 +546,16 @@ void sceneIntersect(in Ray incoming, inout HitInfo hit) {
         continue;
       }
       if(cur_node.l_child == -1 && cur_node.r_child == -1) {
-        // This is a leaf node, so check if the ray intersects the triangle
-        HitInfo tri_hit;
-        tri_hit.time = 1.0/0.0;
-        tri_hit.hit = false;
-        triangleIntersect(incoming, tris[cur_node.tri_offset], tri_hit);
-        if(tri_hit.hit && tri_hit.time < hit.time) {
-          // this triangle is closest, so keep track of it
-          hit = tri_hit;
+        // This is a leaf node, so check if the ray intersects its triangles
+        for(int i = cur_node.tri_offset; i < cur_node.tri_offset + cur_node.tri_count; ++i) {
+          HitInfo tri_hit;
+          tri_hit.time = 1.0/0.0;
+          tri_hit.hit = false;
+          triangleIntersect(incoming, i, tri_hit);
+          if(tri_hit.hit && tri_hit.time < hit.time) {
+            // this triangle is closest, so keep track of it
+            hit = tri_hit;
+          }
         }
       }
       else {
@@ -258,6 +567,7 @@ void sceneIntersect(in Ray incoming, inout HitInfo hit) {
       }
     }
 }
+#endif
 
 /**
  * Check if the ray (pos, dir) intersects the AABB dim, and store the results in hit
@@ -294,7 +604,54 @@ void AABBIntersect(in Ray incoming, in Dimension dim, inout HitInfo hit) {
   return;
 }
 
-void triangleIntersect(in Ray incoming, in Triangle tri, inout HitInfo hit) {
+/**
+ * Fetch the points of a triangle. Only the points are needed to test for an intersection,
+ * so the normals and material are fetched separately once the triangle is hit.
+ */
+void triangleVertices(in int tri_idx, out vec3 p1, out vec3 p2, out vec3 p3) {
+#ifdef INDEXED_TRIANGLES
+    ivec4 v = tris[tri_idx].v;
+    p1 = verts[v.x].xyz;
+    p2 = verts[v.y].xyz;
+    p3 = verts[v.z].xyz;
+#else
+    p1 = tris[tri_idx].p1;
+    p2 = tris[tri_idx].p2;
+    p3 = tris[tri_idx].p3;
+#endif
+}
+
+void triangleNormals(in int tri_idx, in vec3 p1, in vec3 p2, in vec3 p3, out vec3 n1, out vec3 n2, out vec3 n3) {
+#ifdef INDEXED_TRIANGLES
+    ivec4 n = tris[tri_idx].n;
+    if (n.x < 0) {
+      // flat shaded, so every point uses the face normal
+      n1 = normalize(cross(p2 - p1, p3 - p1));
+      n2 = n1;
+      n3 = n1;
+      return;
+    }
+    n1 = norms[n.x].xyz;
+    n2 = norms[n.y].xyz;
+    n3 = norms[n.z].xyz;
+#else
+    n1 = tris[tri_idx].n1;
+    n2 = tris[tri_idx].n2;
+    n3 = tris[tri_idx].n3;
+#endif
+}
+
+int triangleMaterial(in int tri_idx) {
+#ifdef INDEXED_TRIANGLES
+    return tris[tri_idx].v.w;
+#else
+    return tris[tri_idx].mat;
+#endif
+}
+
+void triangleIntersect(in Ray incoming, in int tri_idx, inout HitInfo hit) {
+    Triangle tri;
+    triangleVertices(tri_idx, tri.p1, tri.p2, tri.p3);
     // get the plane normal
     vec3 to_plane = tri.p1 - incoming.pos;
     vec3 norm  = cross(tri.p3 - tri.p1, tri.p2 - tri.p1);
@@ -320,13 +677,14 @@ void triangleIntersect(in Ray incoming, in Triangle tri, inout HitInfo hit) {
     float c = length(cross(to_p1, to_p2)) / tri_area;
     if(a <= 1.0001 && b <= 1.0001 && c <= 1.0001 && (a + b + c) <= 1.0001) {
       hit.hit = true;
+      triangleNormals(tri_idx, tri.p1, tri.p2, tri.p3, tri.n1, tri.n2, tri.n3);
       // use barycentric normals to interpolate the normal at the intersection
       hit.norm = normalize(a * tri.n1 + b * tri.n2 + c * tri.n3);
       if(dot(hit.norm, incoming.dir) > 0.0) {
         // Make sure the normal is facing outwards for illumination
         hit.norm = -1.0 * hit.norm;
       }
-      hit.mat = tri.mat;
+      hit.mat = triangleMaterial(tri_idx);
       return;
     }
     else {
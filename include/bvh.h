@@ -1,9 +1,15 @@
 #ifndef bvh_h
 #define bvh_h
 
+#include <thread>
+#include <utility>
 #include <vector>
 
+#include "bvh_stats.h"
+#include "mesh.h"
+#include "scene.h"
 #include "structs.h"
+#include "work_queue.h"
 
 struct triangle_info {
   DimensionGL AABB_;
@@ -12,30 +18,262 @@ struct triangle_info {
 };
 
 /**
- * bvh - A bounding volume heirarchy that uses the midpoint method to split the search space.
- * Midpoint is essential because it ensure the tree is evenly balanced, which allows for particular
- * Maximum memory assumptions in the GPU ray tracer.
+ * How the bvh picks the split of every node
+ */
+enum BvhSplitMethod {
+    // sort on the widest centroid axis and give each child half the triangles
+    SPLIT_MEDIAN,
+    // binned Surface Area Heuristic over all three axes
+    SPLIT_SAH,
+    // linear bvh: sort the centroids along a Morton curve and split where the codes'
+    // highest differing bit flips. Much faster to build, but the boxes are looser
+    SPLIT_MORTON,
+    // spatial split bvh: the SAH also weighs splitting a node's space instead of its
+    // triangles. Triangles crossing the plane are referenced from both sides, each clipped
+    // to its side, which keeps the boxes tight around long, thin triangles. Builds on one
+    // thread, and the duplicated references are extra triangles in the mesh
+    SPLIT_SBVH
+};
+
+// No leaf may sit deeper than this. The shader's traversal stack is sized from the tree
+// it is given (see traversalStackSize), so this only bounds how big that can get.
+// BvhOptions::max_depth caps a build lower, and the builders fall back to median splits
+// where they would otherwise go deeper.
+const int kMaxLeafDepth = 63;
+// number of centroid bins per axis the SAH builder evaluates
+const int kSahBins = 32;
+// relative costs of visiting a node and testing a triangle, for the SAH
+const float kSahTraversalCost = 1.0f;
+const float kSahIntersectCost = 1.0f;
+// the most triangles a leaf may hold
+const int kMaxLeafSize = 8;
+// a refitted tree is rebuilt once its SAH cost grows past this many times its cost when built
+const float kRefitRebuildRatio = 1.5f;
+// the spatial split builder only tries spatial splits where the boxes of a node's best
+// object split overlap by at least this fraction of the root's surface area
+const float kSpatialSplitAlpha = 1e-5f;
+// the spatial split builder adds at most this many references per triangle by default
+const float kSpatialSplitBudget = 0.3f;
+// the nodes per treelet of the treelet node layout: three sibling pairs, which fill the
+// three 128 byte cache lines of one 8 slot block
+const int kTreeletNodes = 6;
+
+/**
+ * BvhOptions - how to build a bvh
+ */
+struct BvhOptions {
+    BvhSplitMethod method;
+    // threads to build on, <= 0 uses every hardware thread
+    int num_threads;
+    // Leaves hold up to this many triangles (1 to kMaxLeafSize). A range which fits is
+    // only made a leaf when the SAH says testing its triangles is cheaper than splitting it
+    int max_leaf_size;
+    // refit() rebuilds the tree once its SAH cost is this many times the cost it was built
+    // with, or never if this is 0
+    float rebuild_ratio;
+    // SPLIT_SBVH may add up to this many duplicate references per triangle, so the
+    // triangle buffer grows by this fraction at most
+    float spatial_budget;
+    // store the mesh's vertices and normals in the order the leaves first use them, so a
+    // leaf's corners share cache lines with its neighbours' instead of being spread over
+    // the file's order
+    bool sort_vertices;
+    // No leaf goes deeper than this (1 to kMaxLeafDepth, the root is 0), as long as there
+    // are few enough triangles for a median split tree with full leaves to fit. See
+    // leafDepthBound for how deep it goes when there aren't
+    int max_depth;
+    // Store the nodes in treelets of this many nodes (rounded down to sibling pairs), each
+    // a subtree grown towards the biggest boxes, with every sibling pair in one 128 byte
+    // cache line. That takes a third more node memory for padding. 0 or 1 keeps the plain
+    // depth first order, which the stackless traversal needs
+    int treelet_nodes;
+    // Spend up to this many seconds after the build moving subtrees to where they lower
+    // the SAH cost, or skip that if this is 0. A refit's rebuild skips it, so a deforming
+    // mesh doesn't stall
+    float optimize_seconds;
+    // ...but stop as soon as the SAH cost is at most this, unless it is 0
+    float optimize_sah_cost;
+
+    BvhOptions(BvhSplitMethod split_method = SPLIT_SAH, int threads = 0, int leaf_size = 4)
+        : method(split_method), num_threads(threads), max_leaf_size(leaf_size), rebuild_ratio(kRefitRebuildRatio),
+          spatial_budget(kSpatialSplitBudget), sort_vertices(true), max_depth(kMaxLeafDepth), treelet_nodes(0),
+          optimize_seconds(0.0f), optimize_sah_cost(0.0f) {}
+};
+
+// the elements [first, last) of a buffer
+typedef std::pair<size_t, size_t> BufferRange;
+
+/**
+ * BvhUpdate - what a refit changed, so only that has to be uploaded again. Ranges close
+ * to each other are merged, so there are only a few uploads even when most things moved.
+ */
+struct BvhUpdate {
+    // the tree got too loose and was rebuilt, so every node and triangle may have changed
+    bool rebuilt = false;
+    std::vector<BufferRange> nodes;
+    std::vector<BufferRange> vertices;
+    std::vector<BufferRange> normals;
+    // the SAH cost of the tree now, and when it was last built
+    float sah_cost = 0.0f;
+    float built_sah_cost = 0.0f;
+};
+
+/**
+ * bvh - A bounding volume heirarchy over the scene triangles, with a few triangles per leaf.
+ * Nodes are split with the binned Surface Area Heuristic by default, which keeps boxes
+ * tight on uneven meshes, or at the median for a perfectly balanced tree. The mesh's
+ * triangles are reordered so every leaf's triangles sit next to each other (a triangle
+ * which spatial splits put in several leaves is copied into each). Unless the options say
+ * otherwise, the vertices and normals are then put in the order the leaves first use them.
 */
 class bvh {
   public:
     bvh() {};
-    bvh(std::vector<TriangleGL> &tris);
+    /**
+     * Build over mesh. The tree is the same for any number of threads.
+     */
+    bvh(TriangleMesh &mesh, const BvhOptions &options = BvhOptions());
+    /**
+     * Build over leaves which were already bounded, one per triangle of mesh
+     */
+    bvh(TriangleMesh &mesh, std::vector<triangle_info> &leaves, const BvhOptions &options = BvhOptions());
+    /**
+     * Build over leaves which bound something other than triangles, like the instances of
+     * a two level bvh. leaves is left in the order the leaves' ranges index, and the bvh
+     * has no mesh.
+     */
+    bvh(std::vector<triangle_info> &leaves, const BvhOptions &options);
     NodeGL * getCompact(int &num_nodes);
-    TriangleGL * getTriangles(int &num_triangles);
+    const TriangleMesh & getMesh() const { return mesh_; }
+    /**
+     * The most entries sceneIntersect's stack holds traversing the tree as it was built.
+     * A refit keeps it, a rebuild may change it up to leafDepthBound + 1.
+     */
+    int stackSize() const { return stack_size_; }
+    /**
+     * The references spatial splits added, which are duplicate triangles in the mesh
+     */
+    size_t spatialReferences() const { return spatial_references_; }
+    /**
+     * The SAH cost of the finished tree: the expected cost of tracing a ray which hits
+     * the root box, using kSahTraversalCost per node and kSahIntersectCost per triangle
+     */
+    float sahCost() const;
+    /**
+     * Measure the tree's quality and size, see measureBvh
+     */
+    BvhStats stats(int num_threads = 0) const;
+    /**
+     * Move the mesh's vertices (and normals, unless normals is empty) for a mesh which
+     * deforms but keeps its triangles. The leaves are bounded again and the boxes are
+     * refitted bottom up on num_threads threads, keeping the tree as it is, which is much
+     * cheaper than building it again. Once the refitted boxes are loose enough that the SAH
+     * cost passes rebuild_ratio times the cost the tree was built with, it is rebuilt
+     * without the options' optimization.
+     * update gets what changed. Returns false if the number of vertices or normals differs.
+     * The vertices and normals are in getMesh()'s order, which a rebuild keeps.
+     */
+    bool refit(const std::vector<VertexGL> &vertices, const std::vector<VertexGL> &normals, BvhUpdate &update,
+               int num_threads = 0);
+    /**
+     * Build the tree again over the mesh as it is now, spending the options' optimization
+     * budget again unless optimize is false
+     */
+    void rebuild(int num_threads = 0, bool optimize = true);
   private:
-    // All the triangles in the scene
-    std::vector<TriangleGL> triangles_;
-    // All the bvh nodes, sorted for depth first traversal
+    // All the triangles in the scene, along with the vertices and normals they index
+    TriangleMesh mesh_;
+    // All the bvh nodes, sorted for depth first traversal or in treelets
     std::vector<NodeGL> bvh_nodes_;
+    BvhSplitMethod method_ = SPLIT_SAH;
+    int max_leaf_size_ = 1;
+    int max_depth_ = kMaxLeafDepth;
+    int stack_size_ = 0;
+    float rebuild_ratio_ = kRefitRebuildRatio;
+    float spatial_budget_ = kSpatialSplitBudget;
+    int treelet_nodes_ = 0;
+    float optimize_seconds_ = 0.0f;
+    float optimize_sah_cost_ = 0.0f;
+    size_t spatial_references_ = 0;
+    // the triangle of the mesh as it was built from which every triangle of a spatial
+    // split tree was copied
+    std::vector<int> reference_sources_;
+    // the SAH cost when the tree was built, or negative until a refit needs it
+    float built_sah_cost_ = -1.0f;
+    // every node's parent, found by the first refit
+    std::vector<int> parents_;
 
     // Helper functions for bounding all scene information
-    DimensionGL getExtent(const vector<triangle_info> &tris);
-    DimensionGL getExtent(const vector<Point3D> &pts);
     std::vector<triangle_info> boundTriangles();
-    
+
     // Functions for constructing the bvh
-    void buildRecurse(int node_offset, std::vector<triangle_info>& tris);
-    bool splitMidpoint(std::vector<triangle_info> &in_tris, std::vector<triangle_info> &bin_1, std::vector<triangle_info> &bin_2);
+    struct BuildTask {
+        int node;  // where the node for the range goes in bvh_nodes_
+        triangle_info *begin;
+        triangle_info *end;
+        int depth;
+    };
+    void build(std::vector<triangle_info> &leaves, int num_threads, float optimize_seconds);
+    void buildSpatialTree(std::vector<triangle_info> &leaves);
+    void dropSpatialReferences();
+    void compactNodes();
+    void finishNodes();
+    void layoutTreelets();
+    void optimizeTree(std::vector<triangle_info> &leaves, int num_threads, float seconds);
+    void sortTriangles(const std::vector<triangle_info> &leaves, int num_threads);
+    void sortVertices();
+    triangle_info * splitNode(const BuildTask &task, const triangle_info *first);
+    void splitTopLevels(const BuildTask &root, int num_threads, std::vector<BuildTask> &subtrees);
+    triangle_info * splitMidpoint(triangle_info *begin, triangle_info *end, const DimensionGL &centroid_box);
+    triangle_info * splitSAH(triangle_info *begin, triangle_info *end, const DimensionGL &centroid_box);
+};
+
+/**
+ * The deepest a leaf can be in a bvh built over count triangles with options: max_depth,
+ * or the depth of a median split tree with full leaves if that doesn't fit under it. The
+ * traversal stack of any such tree needs at most this + 1 entries.
+ */
+int leafDepthBound(size_t count, const BvhOptions &options);
+
+/**
+ * The most entries sceneIntersect's stack holds while traversing the binary bvh nodes.
+ * An inner node pushes both its children on top of the right children its ancestors left
+ * waiting.
+ */
+int traversalStackSize(const NodeGL *nodes, size_t num_nodes);
+
+/**
+ * Bound one triangle, turning it into a bvh leaf
+ */
+triangle_info boundTriangle(const float *p1, const float *p2, const float *p3, int tri_offset);
+
+/**
+ * bvh_builder - the builder stage of a pipelined scene load. Pass sink() to loadScene and
+ * every triangle batch is queued and bounded on the builder's own thread while the
+ * parser keeps reading the file. finish() then builds the tree from the ready leaves.
+ */
+class bvh_builder {
+  public:
+    bvh_builder(const BvhOptions &options = BvhOptions());
+    ~bvh_builder();
+    TriangleSink sink();
+    /**
+     * Wait for the queued batches and build the bvh over mesh, which must be the mesh
+     * the batches came from
+     */
+    bvh finish(TriangleMesh &mesh);
+    /**
+     * Spend seconds optimizing the tree instead of the options' budget, for a scene whose
+     * instanced meshes share the budget
+     */
+    void setOptimizeSeconds(float seconds) { options_.optimize_seconds = seconds; }
+  private:
+    WorkQueue<TriangleBatch> batches_;
+    std::vector<triangle_info> leaves_;
+    std::thread thread_;
+    BvhOptions options_;
+
+    void boundBatches();
 };
 
 #endif  // bvh_h
\ No newline at end of file
@@ -0,0 +1,57 @@
+#ifndef BVH_STATS_H
+#define BVH_STATS_H
+
+#include <cstddef>
+#include <ostream>
+#include <vector>
+
+#include "scene.h"
+
+/**
+ * BvhStats - how good a bvh is, to tell a slow tree from a slow shader
+ */
+struct BvhStats {
+    size_t nodes = 0;
+    size_t inner_nodes = 0;
+    size_t leaves = 0;
+    // triangles the leaves reference, counting every copy spatial splits made. The overlap
+    // measures below count each triangle once
+    size_t triangles = 0;
+    // leaf_sizes[n] is the number of leaves holding n triangles
+    std::vector<size_t> leaf_sizes;
+    // the depth of the deepest leaf (the root is 0) and the average over the leaves
+    int max_depth = 0;
+    double average_depth = 0.0;
+    // the most entries sceneIntersect's traversal stack holds, see traversalStackSize
+    int stack_size = 0;
+    // the SAH cost, as bvh::sahCost
+    double sah_cost = 0.0;
+    // the summed area where inner nodes' two child boxes overlap, over the root's area.
+    // Rays through an overlap have to visit both children
+    double child_overlap = 0.0;
+    // the End Point Overlap: the area of the triangles which lie inside a node's box
+    // without being under it, weighted by the cost of visiting the node and over the area
+    // of all the triangles. Rays hitting that geometry visit the node for nothing
+    double epo = 0.0;
+    // bytes of each buffer on the GPU
+    size_t node_bytes = 0;
+    size_t triangle_bytes = 0;
+    size_t vertex_bytes = 0;
+    size_t normal_bytes = 0;
+
+    size_t totalBytes() const { return node_bytes + triangle_bytes + vertex_bytes + normal_bytes; }
+};
+
+/**
+ * Measure the binary bvh in buffers, whose leaves index buffers' triangles. The EPO clips
+ * every triangle against the boxes it overlaps, which takes about as long as a build, on
+ * num_threads threads (<= 0 uses every hardware thread).
+ */
+BvhStats measureBvh(const SceneBuffers &buffers, int num_threads = 0);
+
+/**
+ * Write stats as one line of JSON
+ */
+void writeJson(std::ostream &out, const BvhStats &stats);
+
+#endif  // BVH_STATS_H
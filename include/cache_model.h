@@ -0,0 +1,67 @@
+#ifndef CACHE_MODEL_H
+#define CACHE_MODEL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * CacheModel - a set associative cache with least recently used eviction, fed the
+ * addresses a traversal reads to estimate the memory traffic of a buffer layout. It only
+ * counts, nothing is stored. The defaults are roughly one GPU core's L1: 32 KB of
+ * 128 byte lines, 4 ways.
+ */
+class CacheModel {
+  public:
+    CacheModel(size_t size_bytes = 32 * 1024, size_t line_bytes = 128, size_t ways = 4)
+        : line_bytes_(line_bytes), ways_(ways), sets_(size_bytes / (line_bytes * ways)),
+          tags_(sets_ * ways, 0), ages_(sets_ * ways, 0) {}
+
+    /**
+     * Read bytes bytes starting at address, touching every line they span
+     */
+    void read(const void *address, size_t bytes) {
+        uintptr_t first = reinterpret_cast<uintptr_t>(address) / line_bytes_;
+        uintptr_t last = (reinterpret_cast<uintptr_t>(address) + bytes - 1) / line_bytes_;
+        for (uintptr_t line = first; line <= last; ++line) {
+            readLine(line);
+        }
+    }
+
+    size_t accesses() const { return accesses_; }
+    size_t misses() const { return misses_; }
+    // the bytes brought in from memory
+    size_t trafficBytes() const { return misses_ * line_bytes_; }
+    double missRate() const { return accesses_ ? static_cast<double>(misses_) / accesses_ : 0.0; }
+
+  private:
+    size_t line_bytes_;
+    size_t ways_;
+    size_t sets_;
+    // the line held by every way of every set (offset by one, so 0 is empty) and when it
+    // was last read
+    std::vector<uintptr_t> tags_;
+    std::vector<size_t> ages_;
+    size_t accesses_ = 0;
+    size_t misses_ = 0;
+
+    void readLine(uintptr_t line) {
+        ++accesses_;
+        size_t set = (line % sets_) * ways_;
+        size_t oldest = set;
+        for (size_t way = set; way < set + ways_; ++way) {
+            if (tags_[way] == line + 1) {
+                ages_[way] = accesses_;
+                return;
+            }
+            if (ages_[way] < ages_[oldest]) {
+                oldest = way;
+            }
+        }
+        ++misses_;
+        tags_[oldest] = line + 1;
+        ages_[oldest] = accesses_;
+    }
+};
+
+#endif  // CACHE_MODEL_H
@@ -0,0 +1,82 @@
+#ifndef INSTANCING_H
+#define INSTANCING_H
+
+#include <cstddef>
+#include <vector>
+
+#include "bvh.h"
+#include "scene.h"
+#include "structs.h"
+
+/**
+ * TwoLevelBvh - a bvh over placed copies of meshes. Every mesh gets one bottom level bvh,
+ * however many instances use it, and a small top level bvh over the instances' world
+ * boxes picks the meshes a ray has to visit. The ray is moved into a mesh's own space by
+ * the inverse of its instance's motor, so memory grows with the unique geometry only, and
+ * moving an instance only rebuilds the top level.
+ *
+ * All the levels share one node buffer. The top level's 2n - 1 nodes (one instance per
+ * leaf) come first, and a top level leaf's triangle_offset is the instance it holds in
+ * gpuInstances(). Every mesh's nodes follow, with their children, triangles, vertices and
+ * normals offset to where the mesh landed in the combined buffers.
+ */
+class TwoLevelBvh {
+  public:
+    TwoLevelBvh() {};
+    /**
+     * scene_bvh is the bvh over scene.mesh, the triangles which aren't instanced. If it has
+     * any nodes it becomes an extra instance which never moves, ahead of scene.instances.
+     * Every mesh of scene.instance_meshes is moved into a bvh of its own, and instances of
+     * meshes with no triangles are dropped. The meshes split the options' optimization
+     * budget by their triangles (scene_bvh should have been built with its share), and the
+     * top level isn't optimized.
+     */
+    TwoLevelBvh(bvh &scene_bvh, SceneData &scene, const BvhOptions &options = BvhOptions());
+    /**
+     * Place scene.instances[instance] with motor instead. It shows once the top level is
+     * built again.
+     */
+    void moveInstance(int instance, const Motor3D &motor);
+    /**
+     * Build the top level again over where the instances are now. Only the top level's
+     * nodes and gpuInstances() change.
+     */
+    void buildTopLevel();
+    /**
+     * The combined buffers, with the top level at the front of the nodes
+     */
+    SceneBuffers buffers() const;
+    const std::vector<InstanceGL> & gpuInstances() const { return gpu_instances_; }
+    size_t topLevelNodes() const { return top_level_nodes_; }
+    /**
+     * The most entries the TWO_LEVEL sceneIntersect's stack can need: the deepest mesh on
+     * top of any top level over this many instances, so moving them never outgrows it
+     */
+    int stackSize() const;
+  private:
+    struct Instance {
+        int mesh;
+        Motor3D motor;
+    };
+    // the placed instances, in the order they were given
+    std::vector<Instance> instances_;
+    // the offset in instances_ of every scene.instances entry, or -1 if it was dropped
+    std::vector<int> scene_instances_;
+    // every mesh's root node and its box
+    std::vector<int> mesh_roots_;
+    std::vector<DimensionGL> mesh_boxes_;
+    size_t top_level_nodes_ = 0;
+    // the most stack any mesh's bvh needs
+    int mesh_stack_size_ = 0;
+    BvhOptions top_level_options_;
+
+    std::vector<VertexGL> vertices_;
+    std::vector<VertexGL> normals_;
+    std::vector<TriangleIndexGL> triangles_;
+    std::vector<NodeGL> nodes_;
+    std::vector<InstanceGL> gpu_instances_;
+
+    void appendMesh(bvh &mesh_bvh);
+};
+
+#endif  // INSTANCING_H
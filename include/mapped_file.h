@@ -0,0 +1,36 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+/**
+ * MappedFile - a read-only memory mapping of an entire file. The scene parser
+ * tokenizes straight out of the mapping, so no bytes are copied into
+ * intermediate buffers or std::strings while loading.
+ */
+class MappedFile {
+  public:
+    MappedFile() {};
+    ~MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool open(const std::string &file_name);
+    void close();
+
+    const char *data() const { return data_; }
+    size_t size() const { return size_; }
+    bool isOpen() const { return data_ != nullptr || is_empty_; }
+  private:
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+    // zero length files cannot be mapped, but they are still valid files
+    bool is_empty_ = false;
+#ifdef _WIN32
+    void *file_handle_ = nullptr;
+    void *mapping_handle_ = nullptr;
+#endif
+};
+
+#endif  // MAPPED_FILE_H
@@ -0,0 +1,53 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <vector>
+
+#include "structs.h"
+
+/**
+ * TriangleMesh - the indexed triangle soup for a scene. Vertices and normals are shared
+ * between triangles, and every triangle refers to them (and to its material) by index.
+ */
+struct TriangleMesh {
+    std::vector<VertexGL> vertices;
+    std::vector<VertexGL> normals;
+    std::vector<TriangleIndexGL> triangles;
+};
+
+/**
+ * MeshCleanStats - what cleanMesh removed from a mesh
+ */
+struct MeshCleanStats {
+    size_t welded_vertices = 0;
+    size_t welded_normals = 0;
+    size_t degenerate_triangles = 0;
+    size_t duplicate_triangles = 0;
+    size_t unused_vertices = 0;
+    size_t unused_normals = 0;
+};
+
+/**
+ * Remove geometry which can never show up in the image. Vertices and normals with
+ * identical coordinates are welded into one, then triangles are dropped if two of their
+ * corners are the same vertex or their edges are exactly parallel (the shader's plane
+ * test rejects them), or if an earlier triangle has the same corners, normals and
+ * material. Vertices and normals no triangle uses any more are removed last. The order
+ * of everything which is kept is unchanged.
+ */
+MeshCleanStats cleanMesh(TriangleMesh &mesh);
+
+/**
+ * Calculate the normalized face normal of the triangle (p1, p2, p3)
+ */
+void faceNormal(const float *p1, const float *p2, const float *p3, float *norm);
+
+/**
+ * Expand indexed triangles into self contained TriangleGL records, which is the layout
+ * the GPU used before triangles were indexed. Flat shaded triangles get their face normal,
+ * and the material offset is kept as is.
+ */
+void expandTriangles(const VertexGL *vertices, const VertexGL *normals, const TriangleIndexGL *triangles,
+                     size_t num_triangles, std::vector<TriangleGL> &expanded);
+
+#endif  // MESH_H
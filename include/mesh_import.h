@@ -0,0 +1,41 @@
+#ifndef MESH_IMPORT_H
+#define MESH_IMPORT_H
+
+#include <string>
+#include <vector>
+
+#include "mesh.h"
+#include "structs.h"
+
+/**
+ * ImportedMesh - the triangles read out of a mesh file, in the same indexed form the
+ * scenefile parser produces. Triangle material offsets index materials, and -1 means
+ * the scenefile material which is active where the mesh is included.
+ */
+struct ImportedMesh {
+    TriangleMesh mesh;
+    std::vector<MaterialGL> materials;
+};
+
+/**
+ * Import a binary little endian PLY file. Vertex positions and normals are read from
+ * the vertex element and polygons in the face element are split into triangle fans.
+ * Returns false and prints the reason if the file can't be read.
+ */
+bool importPly(const std::string &file_name, ImportedMesh &out);
+
+/**
+ * Import a Wavefront OBJ file, together with the materials of any mtllib it names.
+ * Positions, normals, faces (split into triangle fans) and usemtl are understood,
+ * everything else is skipped. The file is parsed in line aligned chunks on up to
+ * num_threads threads (<= 0 uses every hardware thread).
+ * Returns false and prints the reason if the file can't be read.
+ */
+bool importObj(const std::string &file_name, ImportedMesh &out, int num_threads = 0);
+
+/**
+ * Import a .ply or .obj file, chosen by its extension
+ */
+bool importMesh(const std::string &file_name, ImportedMesh &out, int num_threads = 0);
+
+#endif  // MESH_IMPORT_H
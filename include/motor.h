@@ -0,0 +1,66 @@
+#ifndef MOTOR_H
+#define MOTOR_H
+
+#include <cmath>
+
+#include "PGA_3D.h"
+
+/**
+ * Rigid transforms as Motor3Ds. A unit motor is a dual quaternion: s, yz, zx, xy are
+ * the rotation quaternion and wx, wy, wz, wxyz carry the translation. These helpers
+ * work on that form directly, because the MultiVector product drops the terms which
+ * mix the two halves, so composing or applying motors through it goes wrong as soon as
+ * a motor both turns and moves.
+ */
+
+/**
+ * The motor which turns by angle radians about axis (through the origin, right handed)
+ * and then moves by offset
+ */
+inline Motor3D rigidMotor(Dir3D axis, float angle, Dir3D offset) {
+    float length = axis.magnitude();
+    Motor3D motor = length > 0.0f ? Rotator3D(angle, Line3D(axis.x / length, axis.y / length, axis.z / length))
+                                  : Motor3D();
+    // the translation half is offset * rotation / 2, as a quaternion product
+    Dir3D turn(motor.yz, motor.zx, motor.xy);
+    Dir3D moved = 0.5f * (motor.s * offset + cross(offset, turn));
+    motor.wx = moved.x;
+    motor.wy = moved.y;
+    motor.wz = moved.z;
+    motor.wxyz = 0.5f * dot(offset, turn);
+    return motor;
+}
+
+/**
+ * Turn dir by motor's rotation
+ */
+inline Dir3D motorDirection(const Motor3D &motor, Dir3D dir) {
+    Dir3D turn(motor.yz, motor.zx, motor.xy);
+    return dir + 2.0f * cross(turn, cross(turn, dir) + motor.s * dir);
+}
+
+/**
+ * The offset motor moves the origin by
+ */
+inline Dir3D motorOffset(const Motor3D &motor) {
+    Dir3D turn(motor.yz, motor.zx, motor.xy);
+    Dir3D moved(motor.wx, motor.wy, motor.wz);
+    return 2.0f * (motor.s * moved + motor.wxyz * turn - cross(moved, turn));
+}
+
+/**
+ * Move point by motor
+ */
+inline Point3D motorPoint(const Motor3D &motor, Point3D point) {
+    Dir3D turned = motorDirection(motor, Dir3D(point.x, point.y, point.z));
+    return Point3D(0, 0, 0) + turned + motorOffset(motor);
+}
+
+/**
+ * The motor which undoes motor, its reverse
+ */
+inline Motor3D inverseMotor(const Motor3D &motor) {
+    return Motor3D(motor.s, -motor.wx, -motor.wy, -motor.wz, -motor.yz, -motor.zx, -motor.xy, motor.wxyz);
+}
+
+#endif  // MOTOR_H
@@ -0,0 +1,173 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Run fn(i) for every i in [0, count) on up to num_threads threads. Work is handed
+ * out one index at a time, so uneven chunks still balance across the threads.
+ */
+template<typename Fn>
+void parallelFor(size_t count, int num_threads, Fn fn) {
+    size_t workers = std::min(static_cast<size_t>(std::max(num_threads, 1)), count);
+    if (workers <= 1) {
+        for (size_t i = 0; i < count; ++i) {
+            fn(i);
+        }
+        return;
+    }
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t i = next++; i < count; i = next++) {
+            fn(i);
+        }
+    };
+    std::vector<std::thread> threads;
+    threads.reserve(workers - 1);
+    for (size_t t = 1; t < workers; ++t) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+}
+
+/**
+ * Run fn(task, spawn) for every task in tasks, and every task fn hands to spawn, on up
+ * to num_threads threads. Each thread keeps its own deque of tasks: it pushes and pops
+ * at the back, so it works depth first through the tasks it spawned, and a thread with
+ * nothing left steals from the front of another's deque, where the oldest (and for a
+ * divide and conquer, largest) tasks are. Returns once every task has run.
+ */
+template<typename Task, typename Fn>
+void parallelTasks(const std::vector<Task> &tasks, int num_threads, Fn fn) {
+    size_t workers = static_cast<size_t>(std::max(num_threads, 1));
+    if (workers == 1) {
+        std::vector<Task> stack(tasks.rbegin(), tasks.rend());
+        auto spawn = [&](const Task &task) { stack.push_back(task); };
+        while (!stack.empty()) {
+            Task task = stack.back();
+            stack.pop_back();
+            fn(task, spawn);
+        }
+        return;
+    }
+    struct TaskDeque {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+    std::vector<TaskDeque> deques(workers);
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        deques[i % workers].tasks.push_back(tasks[i]);
+    }
+    // tasks which were queued but have not finished yet
+    std::atomic<size_t> pending(tasks.size());
+    auto work = [&](size_t id) {
+        TaskDeque &own = deques[id];
+        auto spawn = [&](const Task &task) {
+            ++pending;
+            std::lock_guard<std::mutex> guard(own.lock);
+            own.tasks.push_back(task);
+        };
+        while (pending > 0) {
+            Task task;
+            bool found = false;
+            {
+                std::lock_guard<std::mutex> guard(own.lock);
+                if (!own.tasks.empty()) {
+                    task = own.tasks.back();
+                    own.tasks.pop_back();
+                    found = true;
+                }
+            }
+            for (size_t i = 1; !found && i < workers; ++i) {
+                TaskDeque &victim = deques[(id + i) % workers];
+                std::lock_guard<std::mutex> guard(victim.lock);
+                if (!victim.tasks.empty()) {
+                    task = victim.tasks.front();
+                    victim.tasks.pop_front();
+                    found = true;
+                }
+            }
+            if (!found) {
+                std::this_thread::yield();
+                continue;
+            }
+            fn(task, spawn);
+            --pending;
+        }
+    };
+    std::vector<std::thread> threads;
+    threads.reserve(workers - 1);
+    for (size_t t = 1; t < workers; ++t) {
+        threads.emplace_back(work, t);
+    }
+    work(0);
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+}
+
+/**
+ * Sort keys, with values moved along with them, by the low key_bits bits of the keys on
+ * up to num_threads threads. This is a stable least significant digit radix sort: each
+ * pass counts the digits of fixed size chunks in parallel, then every chunk scatters its
+ * keys to its own offsets. The result doesn't depend on the number of threads.
+ */
+template<typename Key, typename Value>
+void parallelRadixSort(std::vector<Key> &keys, std::vector<Value> &values, int key_bits, int num_threads) {
+    const int digit_bits = 11;
+    const size_t num_digits = size_t(1) << digit_bits;
+    const size_t chunk_size = 1 << 16;
+    size_t count = keys.size();
+    size_t num_chunks = (count + chunk_size - 1) / chunk_size;
+    std::vector<Key> sorted_keys(count);
+    std::vector<Value> sorted_values(count);
+    // the number of each digit in each chunk, then where the chunk writes them
+    std::vector<size_t> offsets(num_chunks * num_digits);
+    for (int shift = 0; shift < key_bits; shift += digit_bits) {
+        parallelFor(num_chunks, num_threads, [&](size_t chunk) {
+            size_t *digit_count = &offsets[chunk * num_digits];
+            std::fill(digit_count, digit_count + num_digits, 0);
+            size_t end = std::min(count, (chunk + 1) * chunk_size);
+            for (size_t i = chunk * chunk_size; i < end; ++i) {
+                ++digit_count[(keys[i] >> shift) & (num_digits - 1)];
+            }
+        });
+        size_t total = 0;
+        bool sorted = false;
+        for (size_t digit = 0; digit < num_digits; ++digit) {
+            size_t digit_total = 0;
+            for (size_t chunk = 0; chunk < num_chunks; ++chunk) {
+                size_t digit_count = offsets[chunk * num_digits + digit];
+                offsets[chunk * num_digits + digit] = total + digit_total;
+                digit_total += digit_count;
+            }
+            // every key has the same digit, so this pass wouldn't move anything
+            sorted = sorted || digit_total == count;
+            total += digit_total;
+        }
+        if (sorted) {
+            continue;
+        }
+        parallelFor(num_chunks, num_threads, [&](size_t chunk) {
+            size_t *digit_offset = &offsets[chunk * num_digits];
+            size_t end = std::min(count, (chunk + 1) * chunk_size);
+            for (size_t i = chunk * chunk_size; i < end; ++i) {
+                size_t to = digit_offset[(keys[i] >> shift) & (num_digits - 1)]++;
+                sorted_keys[to] = keys[i];
+                sorted_values[to] = values[i];
+            }
+        });
+        keys.swap(sorted_keys);
+        values.swap(sorted_values);
+    }
+}
+
+#endif  // PARALLEL_H
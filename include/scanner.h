@@ -0,0 +1,240 @@
+#ifndef SCANNER_H
+#define SCANNER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * Helpers shared by the text scene and mesh parsers, which tokenize memory mapped
+ * files in place.
+ */
+
+// Powers of ten which are exactly representable as a float
+const float kPow10[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+
+inline bool isSpace(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\v' || c == '\f';
+}
+
+inline bool isDigit(char c) {
+    return static_cast<unsigned char>(c - '0') < 10;
+}
+
+template<size_t N>
+inline bool matches(const char *tok, size_t len, const char (&keyword)[N]) {
+    return len == N - 1 && !memcmp(tok, keyword, N - 1);
+}
+
+/**
+ * Scanner - a cursor over the raw file bytes. Tokens are whitespace separated,
+ * exactly like reading the file with operator>>.
+ */
+struct Scanner {
+    const char *cur;
+    const char *end;
+
+    void skipSpace() {
+        while (cur < end && isSpace(*cur)) {
+            ++cur;
+        }
+    }
+
+    void skipLine() {
+        const char *nl = static_cast<const char *>(memchr(cur, '\n', end - cur));
+        cur = nl ? nl + 1 : end;
+    }
+
+    /**
+     * The rest of the current line with surrounding whitespace trimmed, e.g. a file
+     * name which may contain spaces. Returns false if the line is empty.
+     */
+    bool restOfLine(const char *&tok, size_t &len) {
+        while (cur < end && (*cur == ' ' || *cur == '\t')) {
+            ++cur;
+        }
+        tok = cur;
+        while (cur < end && *cur != '\n') {
+            ++cur;
+        }
+        const char *last = cur;
+        if (cur < end) {
+            ++cur;
+        }
+        while (last > tok && isSpace(last[-1])) {
+            --last;
+        }
+        len = last - tok;
+        return len > 0;
+    }
+
+    bool nextToken(const char *&tok, size_t &len) {
+        skipSpace();
+        if (cur == end) {
+            return false;
+        }
+        tok = cur;
+        while (cur < end && !isSpace(*cur)) {
+            ++cur;
+        }
+        len = cur - tok;
+        return true;
+    }
+
+    bool readInt(int &value) {
+        skipSpace();
+        const char *p = cur;
+        bool neg = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            neg = *p == '-';
+            ++p;
+        }
+        if (p == end || !isDigit(*p)) {
+            return false;
+        }
+        int64_t result = 0;
+        while (p < end && isDigit(*p)) {
+            result = result * 10 + (*p - '0');
+            if (result > INT32_MAX) {
+                return false;
+            }
+            ++p;
+        }
+        value = static_cast<int>(neg ? -result : result);
+        cur = p;
+        return true;
+    }
+
+    /**
+     * Read a decimal float. Short decimals (which is nearly every number in a scenefile)
+     * are converted with a single correctly rounded float operation, so the result is
+     * bit-identical to strtof. Anything longer falls back to strtof itself.
+     */
+    bool readFloat(float &value) {
+        skipSpace();
+        const char *start = cur;
+        const char *p = cur;
+        bool neg = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            neg = *p == '-';
+            ++p;
+        }
+        uint64_t mantissa = 0;
+        int digits = 0;
+        int exp10 = 0;
+        bool any_digits = false;
+        bool exact = true;
+        while (p < end && isDigit(*p)) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa != 0;
+            }
+            else {
+                exact = false;
+            }
+            any_digits = true;
+            ++p;
+        }
+        if (p < end && *p == '.') {
+            ++p;
+            while (p < end && isDigit(*p)) {
+                if (digits < 19) {
+                    mantissa = mantissa * 10 + (*p - '0');
+                    digits += mantissa != 0;
+                    --exp10;
+                }
+                else {
+                    exact = false;
+                }
+                any_digits = true;
+                ++p;
+            }
+        }
+        if (!any_digits) {
+            return false;
+        }
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            const char *q = p + 1;
+            bool exp_neg = false;
+            if (q < end && (*q == '-' || *q == '+')) {
+                exp_neg = *q == '-';
+                ++q;
+            }
+            if (q < end && isDigit(*q)) {
+                int exp_val = 0;
+                while (q < end && isDigit(*q)) {
+                    if (exp_val < 10000) {
+                        exp_val = exp_val * 10 + (*q - '0');
+                    }
+                    ++q;
+                }
+                exp10 += exp_neg ? -exp_val : exp_val;
+                p = q;
+            }
+        }
+        cur = p;
+        if (exact && mantissa <= (1u << 24) && exp10 >= -10 && exp10 <= 10) {
+            float f = static_cast<float>(mantissa);
+            f = exp10 < 0 ? f / kPow10[-exp10] : f * kPow10[exp10];
+            value = neg ? -f : f;
+            return true;
+        }
+        // slow path for long or huge numbers
+        char buffer[64];
+        size_t len = p - start;
+        if (len < sizeof(buffer)) {
+            memcpy(buffer, start, len);
+            buffer[len] = '\0';
+            value = strtof(buffer, nullptr);
+        }
+        else {
+            value = strtof(std::string(start, len).c_str(), nullptr);
+        }
+        return true;
+    }
+
+    bool readFloats(float *values, int count) {
+        for (int i = 0; i < count; ++i) {
+            if (!readFloat(values[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool readInts(int *values, int count) {
+        for (int i = 0; i < count; ++i) {
+            if (!readInt(values[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+/**
+ * Cut text into line aligned chunks which can be parsed independently. There are
+ * several chunks per thread so a chunk full of cheap comments does not leave a thread
+ * idle, but no chunk is smaller than 1MB. Chunk i is [bounds[i], bounds[i + 1]).
+ */
+inline std::vector<const char *> lineChunks(const char *text, size_t size, int num_threads) {
+    const size_t min_chunk = 1 << 20;
+    size_t num_chunks = std::min(static_cast<size_t>(num_threads) * 4, std::max<size_t>(1, size / min_chunk));
+    std::vector<const char *> bounds(1, text);
+    const char *end = text + size;
+    for (size_t i = 1; i < num_chunks; ++i) {
+        const char *cut = std::max(text + size / num_chunks * i, bounds.back());
+        const char *nl = static_cast<const char *>(memchr(cut, '\n', end - cut));
+        if (!nl) {
+            break;
+        }
+        bounds.push_back(nl + 1);
+    }
+    bounds.push_back(end);
+    return bounds;
+}
+
+#endif  // SCANNER_H
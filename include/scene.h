@@ -0,0 +1,92 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "mesh.h"
+#include "structs.h"
+
+/**
+ * SceneInstance - one copy of an instanced mesh, placed in the world by a rigid motor
+ */
+struct SceneInstance {
+    int mesh;  // offset in SceneData::instance_meshes
+    Motor3D motor;
+};
+
+/**
+ * SceneData - everything read out of a scenefile. The triangles are indexed and ready
+ * to be handed to the bvh, while the camera values are stored exactly as they appear
+ * in the file (the basis is orthogonalized by the caller).
+ */
+struct SceneData {
+    TriangleMesh mesh;
+    // the first material is always the default matte white
+    std::vector<MaterialGL> materials;
+    std::vector<LightGL> lights;
+    // mesh files pulled in by include_mesh:, in file order
+    std::vector<std::string> includes;
+    // Meshes placed by instance:, each stored once however many copies there are. Their
+    // materials are in materials like everything else
+    std::vector<TriangleMesh> instance_meshes;
+    std::vector<SceneInstance> instances;
+
+    float eye[3] = { 0.0f, 0.0f, 0.0f };
+    float fwd[3] = { 0.0f, 0.0f, -1.0f };
+    float up[3] = { 0.0f, 1.0f, 0.0f };
+    float half_fov = 45.0f;
+    float background[3] = { 0.0f, 0.0f, 0.0f };
+};
+
+/**
+ * SceneBuffers - views of the GPU ready arrays which are uploaded into the shader storage
+ * buffers. They either point into a bvh or into a memory mapped scene cache.
+ */
+struct SceneBuffers {
+    const VertexGL *vertices = nullptr;
+    size_t num_vertices = 0;
+    const VertexGL *normals = nullptr;
+    size_t num_normals = 0;
+    const TriangleIndexGL *triangles = nullptr;
+    size_t num_triangles = 0;
+    const NodeGL *nodes = nullptr;
+    size_t num_nodes = 0;
+};
+
+/**
+ * TriangleBatch - a run of triangles which has just been appended to the scene mesh,
+ * handed on while the rest of the file is still being parsed. The points are copied
+ * out so the batch can be used on another thread while the mesh keeps growing.
+ */
+struct TriangleBatch {
+    // offset of the first triangle of the batch in scene.mesh.triangles
+    size_t first = 0;
+    // the three points of every triangle in the batch
+    std::vector<VertexGL> points;
+};
+
+/**
+ * Receives every TriangleBatch in file order. It is called on the parsing thread.
+ */
+typedef std::function<void(TriangleBatch &&batch)> TriangleSink;
+
+/**
+ * Parse a scenefile into scene. The file is memory mapped and tokenized in place.
+ * num_threads <= 0 uses every hardware thread. Returns false if the file could not be opened.
+ */
+bool loadScene(const std::string &file_name, SceneData &scene, int num_threads = 0, const TriangleSink &sink = nullptr);
+
+/**
+ * Parse an in-memory scenefile of length size. This is the workhorse behind loadScene.
+ * The text is split into line aligned chunks which are parsed in parallel, while the
+ * calling thread resolves indices and material state chunk by chunk in file order and
+ * passes each chunk's triangles to sink. A command and its arguments must therefore
+ * sit on one line, and triangles may only index vertices and normals defined above them.
+ * Relative include_mesh: paths are resolved against base_dir.
+ */
+void parseScene(const char *text, size_t size, SceneData &scene, int num_threads = 0, const TriangleSink &sink = nullptr,
+                const std::string &base_dir = "");
+
+#endif  // SCENE_H
@@ -0,0 +1,60 @@
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+#include <cstdint>
+#include <string>
+
+#include "mapped_file.h"
+#include "scene.h"
+
+/**
+ * Options which change the compiled arrays. A cache is only used by a run with the same
+ * flags as the one which wrote it.
+ */
+enum SceneCacheFlags : uint32_t {
+    CACHE_CLEANED_MESH = 1,  // the mesh went through cleanMesh before the bvh was built
+    CACHE_MEDIAN_BVH = 2,  // the bvh was split at the median instead of with the SAH
+    CACHE_MORTON_BVH = 4,  // the bvh was built by sorting along a Morton curve
+    CACHE_SPATIAL_BVH = 8,  // the bvh was built with spatial splits
+    CACHE_TREELET_BVH = 16,  // the bvh's nodes are stored in treelets instead of depth first
+    CACHE_LEAF_SIZE_SHIFT = 8,  // the bvh's largest leaf size is stored from this bit up
+    CACHE_SPATIAL_BUDGET_SHIFT = 16,  // and a spatial split bvh's budget, in percent, from this bit up
+    CACHE_MAX_DEPTH_SHIFT = 26  // and the bvh's depth cap from this bit up
+};
+
+/**
+ * SceneCache - a compiled .rtscene file which sits next to a text scenefile. It holds the
+ * final GPU ready arrays (vertices, normals, triangle indices and bvh nodes) plus the
+ * materials, lights and camera, so later runs skip parsing and bvh construction entirely.
+ * The cache is memory mapped and the array views point straight into the mapping, ready
+ * for glBufferData.
+ *
+ * A cache is only used if its format version and struct sizes match this build and the
+ * size and modification time of the source scenefile and of every mesh it includes have
+ * not changed. The arrays are stored in native byte order.
+ */
+class SceneCache {
+  public:
+    /**
+     * The cache file used for scene_file: the same path with an .rtscene extension
+     */
+    static std::string cachePath(const std::string &scene_file);
+
+    /**
+     * Map and validate the cache for scene_file. On success the camera, materials and
+     * lights are copied into scene and buffers points into the mapping, which stays valid
+     * until close() is called or the cache is destroyed.
+     */
+    bool open(const std::string &scene_file, SceneData &scene, SceneBuffers &buffers, uint32_t flags = 0);
+    void close();
+
+    /**
+     * Write the cache for scene_file. The file is written to a temporary name and renamed
+     * into place, so a crash never leaves a truncated cache behind.
+     */
+    static bool write(const std::string &scene_file, const SceneData &scene, const SceneBuffers &buffers, uint32_t flags = 0);
+  private:
+    MappedFile file_;
+};
+
+#endif  // SCENE_CACHE_H
@@ -0,0 +1,16 @@
+#ifndef SKIP_BVH_H
+#define SKIP_BVH_H
+
+#include <cstddef>
+#include <vector>
+
+#include "structs.h"
+
+/**
+ * Thread the binary bvh nodes with skip links for stackless traversal. The nodes keep
+ * their depth first order and boxes, so threaded[i] is nodes[i] with its children
+ * replaced by the node to go to when its box is missed.
+ */
+void threadBvh(const NodeGL *nodes, size_t num_nodes, std::vector<SkipNodeGL> &threaded);
+
+#endif  // SKIP_BVH_H
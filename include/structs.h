@@ -1,6 +1,7 @@
 #ifndef STRUCTS_H
 #define STRUCTS_H
 
+#include <cstdint>
 #include <vector>
 #include <algorithm>
 #include <utility>
@@ -28,10 +29,9 @@ struct MaterialGL {
     float ks[3];
     float padding3;
     float kt[3];
-    float padding4;
-    float ns;
+    float ns; // packed into the last vec3, as std430 does
     float ior;
-    float padding[2];
+    float padding[3];
     MaterialGL() {
         ka[0] = 1.0f;
         ka[1] = 1.0f;
@@ -66,11 +66,34 @@ struct TriangleGL {
     float n2[3]; // 1 vec3
     float padding5;
     float n3[3]; // 1 vec3
-    float padding6;
-    // right now every triangle has a material, I would like to change this
-    // to an offset in a material array, but I'm experiencing alignment issues
-    // when I replace this with an int
-    MaterialGL mat;
+    // offset in the material array. std430 packs a scalar straight after a vec3, so the
+    // int fills the slot which would otherwise be padding and the struct stays 96 bytes
+    int mat;
+};
+
+/**
+ * VertexGL - this struct represents one entry of the shared vertex or normal buffers
+ * used by the indexed triangle layout
+*/
+struct VertexGL {
+    float pos[3]; // 1 vec3
+    float padding;
+};
+
+/**
+ * TriangleIndexGL - this struct represents a triangle in the indexed layout. Instead of
+ * copies of its points and normals, it stores their offsets in the vertex and normal buffers.
+ * Flat shaded triangles have n1 = n2 = n3 = -1 and use the face normal instead
+*/
+struct TriangleIndexGL {
+    int v1; // 1 ivec4
+    int v2;
+    int v3;
+    int mat; // offset in the material array
+    int n1; // 1 ivec4
+    int n2;
+    int n3;
+    int padding;
 };
 
 /**
@@ -103,8 +126,85 @@ struct NodeGL {
     DimensionGL AABB;
     int l_child_offset;
     int r_child_offset;
+    // a leaf (both children -1) holds the triangles [triangle_offset, triangle_offset + triangle_count)
+    int triangle_offset;
+    int triangle_count; // 0 for inner nodes
+};
+
+/**
+ * SkipNodeGL - a node of a BVH threaded for stackless traversal. The nodes are stored
+ * depth first, so a ray which hits an inner node's box goes on to the next node, and one
+ * which misses it (or has tested a leaf's triangles) jumps to skip_offset: the first node
+ * after the subtree, or -1 after the last one.
+ */
+struct SkipNodeGL {
+    DimensionGL AABB;
+    int skip_offset;
+    int padding;
+    // a leaf holds the triangles [triangle_offset, triangle_offset + triangle_count)
     int triangle_offset;
-    float padding2; // this pads the 3 integer members
+    int triangle_count; // 0 for inner nodes
+};
+
+/**
+ * WideNodeGL - a node of a Width wide BVH on the GPU. It holds the bounds of all its
+ * children side by side, so one fetch is enough to test every child. The arrays are
+ * tightly packed in the 430 layout.
+ */
+template<int Width>
+struct WideNodeGL {
+    float min_x[Width];
+    float min_y[Width];
+    float min_z[Width];
+    float max_x[Width];
+    float max_y[Width];
+    float max_z[Width];
+    // an inner child's node, a leaf child's first triangle, or -1 for an empty slot
+    int child[Width];
+    // a leaf child's number of triangles, 0 for inner children
+    int triangle_count[Width];
+
+    WideNodeGL() {
+        for (int i = 0; i < Width; ++i) {
+            min_x[i] = min_y[i] = min_z[i] = INFINITY;
+            max_x[i] = max_y[i] = max_z[i] = -INFINITY;
+            child[i] = -1;
+            triangle_count[i] = 0;
+        }
+    }
+};
+
+/**
+ * QuantizedNodeGL - a WideNodeGL whose child bounds are stored in Bits (8 or 16) bits each,
+ * as a number of steps from the min corner of the node's box. The steps are powers of two
+ * so a bound decodes exactly to origin + steps * scale, and bounds are rounded outwards
+ * so a decoded box always holds the real one.
+ */
+template<int Width, int Bits>
+struct QuantizedNodeGL {
+    // the min corner of the node's box
+    float origin[3];
+    // the size of one step along each axis
+    float scale[3];
+    // the children's min x, y, z and then max x, y, z, Width values each, packed from the
+    // low bits of every word up
+    uint32_t bounds[(6 * Width * Bits + 31) / 32];
+    // an inner child's node, a leaf child's first triangle, or -1 for an empty slot
+    int child[Width];
+    // a leaf child's number of triangles (0 for inner children), 8 bits each
+    uint32_t triangle_count[(Width + 3) / 4];
+};
+
+/**
+ * InstanceGL - one placed copy of a mesh in a two level BVH. The mesh is placed with a
+ * rigid Motor3D, stored as its rotation half (s, yz, zx, xy), which is a unit quaternion,
+ * and its translation half (wx, wy, wz, wxyz)
+ */
+struct InstanceGL {
+    float rotation[4];  // 1 vec4
+    float translation[4];  // 1 vec4
+    int root;  // the root of the mesh's bvh in the node buffer
+    int padding[3];
 };
 
 /**
@@ -0,0 +1,111 @@
+#ifndef TRAVERSAL_H
+#define TRAVERSAL_H
+
+#include <cstddef>
+
+#include "cache_model.h"
+#include "scene.h"
+
+/**
+ * TraversalStats - how much work tracing a set of rays took
+ */
+struct TraversalStats {
+    size_t rays = 0;
+    size_t hits = 0;
+    // nodes fetched: for a binary bvh every node whose box was tested, for a wide one
+    // every node whose children's boxes were tested
+    size_t nodes_visited = 0;
+    size_t boxes_tested = 0;
+    size_t triangles_tested = 0;
+    // the most entries the traversal stack ever held, and how many were pushed (each a
+    // write and a later read of the shader's stack)
+    size_t max_stack = 0;
+    size_t stack_pushes = 0;
+    // if set, every node, instance, triangle and vertex the rays read goes through it
+    CacheModel *cache = nullptr;
+
+    double nodesPerRay() const { return rays ? static_cast<double>(nodes_visited) / rays : 0.0; }
+    double boxesPerRay() const { return rays ? static_cast<double>(boxes_tested) / rays : 0.0; }
+    double trianglesPerRay() const { return rays ? static_cast<double>(triangles_tested) / rays : 0.0; }
+    double pushesPerRay() const { return rays ? static_cast<double>(stack_pushes) / rays : 0.0; }
+};
+
+/**
+ * RayHit - the closest triangle a ray hit
+ */
+struct RayHit {
+    bool hit = false;
+    float time = 0.0f;
+    int triangle = -1;
+    // the instance the triangle belongs to, for a two level bvh
+    int instance = -1;
+};
+
+/**
+ * Trace a ray through the indexed scene buffers on the CPU. This mirrors sceneIntersect
+ * in the compute shader step for step (same visiting order, box test and triangle test),
+ * so the counts in stats are what the GPU does for the same ray.
+ */
+bool traceRay(const SceneBuffers &buffers, const float *origin, const float *dir, RayHit &hit, TraversalStats &stats);
+
+/**
+ * Trace a ray through a wide bvh instead of buffers' nodes, mirroring the BVH_WIDTH version
+ * of sceneIntersect. WideNode is a WideNodeGL from collapseBvh, or a QuantizedNodeGL from
+ * quantizeBvh.
+ */
+template<typename WideNode>
+bool traceRay(const SceneBuffers &buffers, const WideNode *nodes, size_t num_nodes, const float *origin,
+              const float *dir, RayHit &hit, TraversalStats &stats);
+
+/**
+ * Trace a ray through a bvh threaded with skip links instead of buffers' nodes, mirroring
+ * the STACKLESS version of sceneIntersect. It visits the same nodes in the same order as
+ * the stack does, without one.
+ */
+bool traceRay(const SceneBuffers &buffers, const SkipNodeGL *nodes, size_t num_nodes, const float *origin,
+              const float *dir, RayHit &hit, TraversalStats &stats);
+
+/**
+ * Trace a ray through a two level bvh, mirroring the TWO_LEVEL version of sceneIntersect.
+ * buffers' nodes start with the top level, whose leaves index instances, as built by
+ * TwoLevelBvh.
+ */
+bool traceRay(const SceneBuffers &buffers, const InstanceGL *instances, const float *origin, const float *dir,
+              RayHit &hit, TraversalStats &stats);
+
+/**
+ * Trace the primary ray of every pixel of a width x height image, using the camera of
+ * scene the way the raytracer sets it up. Returns the combined stats. If cache is set,
+ * the rays' reads are fed through it.
+ */
+TraversalStats traceCameraRays(const SceneBuffers &buffers, const SceneData &scene, int width, int height,
+                               CacheModel *cache = nullptr);
+
+/**
+ * Trace the primary ray of every pixel like traceCameraRays, and from every point they hit
+ * one bounce in a random direction over the hit triangle, like the shader's reflection and
+ * refraction rays. Only the bounces are counted, which are as incoherent as rays get.
+ */
+TraversalStats traceBounceRays(const SceneBuffers &buffers, const SceneData &scene, int width, int height,
+                               CacheModel *cache = nullptr);
+
+/**
+ * traceCameraRays through a two level bvh
+ */
+TraversalStats traceCameraRays(const SceneBuffers &buffers, const InstanceGL *instances, const SceneData &scene,
+                               int width, int height, CacheModel *cache = nullptr);
+
+/**
+ * traceCameraRays through a bvh threaded with skip links
+ */
+TraversalStats traceCameraRays(const SceneBuffers &buffers, const SkipNodeGL *nodes, size_t num_nodes,
+                               const SceneData &scene, int width, int height, CacheModel *cache = nullptr);
+
+/**
+ * traceCameraRays through a wide bvh
+ */
+template<typename WideNode>
+TraversalStats traceCameraRays(const SceneBuffers &buffers, const WideNode *nodes, size_t num_nodes,
+                               const SceneData &scene, int width, int height, CacheModel *cache = nullptr);
+
+#endif  // TRAVERSAL_H
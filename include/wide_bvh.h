@@ -0,0 +1,68 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include <cstddef>
+#include <vector>
+
+#include "bvh.h"
+#include "structs.h"
+
+/**
+ * The number of binary levels a node of a width wide bvh covers, log2(width)
+ */
+constexpr int wideLevels(int width) {
+    return width <= 2 ? 1 : 1 + wideLevels(width / 2);
+}
+
+/**
+ * The most entries sceneIntersect's stack can need for a width wide bvh collapsed from
+ * any tree with no leaf deeper than max_depth: every wide node on the way down may leave
+ * width - 1 hit children waiting, and the last one pushes all of its children.
+ */
+constexpr int wideStackSize(int width, int max_depth = kMaxLeafDepth) {
+    return width + (width - 1) * ((max_depth - 1) / wideLevels(width));
+}
+
+/**
+ * Collapse the binary bvh nodes into a Width wide bvh (Width is 2, 4 or 8). Every wide node
+ * takes the place of log2(Width) levels of the binary tree, so its children are the
+ * binary nodes that many levels down (or the leaves above them), and leaves keep their
+ * triangle ranges. The nodes are stored depth first like the binary ones, and each node's
+ * inner children are ordered so the ones needing the most stack are pushed first.
+ * Returns the most stack entries the traversal can need for the collapsed tree.
+ */
+template<int Width>
+int collapseBvh(const NodeGL *nodes, size_t num_nodes, std::vector<WideNodeGL<Width>> &wide);
+
+/**
+ * Quantize the child bounds of a wide bvh to Bits (8 or 16) bits. The nodes keep their
+ * order and children.
+ */
+template<int Width, int Bits>
+void quantizeBvh(const std::vector<WideNodeGL<Width>> &wide, std::vector<QuantizedNodeGL<Width, Bits>> &quantized);
+
+/**
+ * The steps from node's origin of bound side (0 to 2 for min x, y, z, 3 to 5 for max) of
+ * child
+ */
+template<int Width, int Bits>
+inline uint32_t quantizedSteps(const QuantizedNodeGL<Width, Bits> &node, int side, int child) {
+    int bit = (side * Width + child) * Bits;
+    return (node.bounds[bit >> 5] >> (bit & 31)) & ((1u << Bits) - 1);
+}
+
+/**
+ * Decode bound side of child, the way the shader does
+ */
+template<int Width, int Bits>
+inline float quantizedBound(const QuantizedNodeGL<Width, Bits> &node, int side, int child) {
+    int axis = side % 3;
+    return static_cast<float>(quantizedSteps(node, side, child)) * node.scale[axis] + node.origin[axis];
+}
+
+template<int Width, int Bits>
+inline int quantizedTriangles(const QuantizedNodeGL<Width, Bits> &node, int child) {
+    return (node.triangle_count[child >> 2] >> ((child & 3) * 8)) & 0xff;
+}
+
+#endif  // WIDE_BVH_H
@@ -0,0 +1,56 @@
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+/**
+ * WorkQueue - a blocking first in, first out queue which hands work from one pipeline
+ * stage to the next. Producers push items and close the queue once they are done;
+ * the consumer pops until the queue is closed and drained.
+ */
+template<typename T>
+class WorkQueue {
+  public:
+    void push(T &&item) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            items_.push_back(std::move(item));
+        }
+        ready_.notify_one();
+    }
+
+    /**
+     * No more items will be pushed. Wakes the consumer once the queue drains.
+     */
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        ready_.notify_all();
+    }
+
+    /**
+     * Wait for the next item. Returns false once the queue is closed and empty.
+     */
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_.wait(lock, [this]() { return !items_.empty() || closed_; });
+        if (items_.empty()) {
+            return false;
+        }
+        item = std::move(items_.front());
+        items_.pop_front();
+        return true;
+    }
+  private:
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<T> items_;
+    bool closed_ = false;
+};
+
+#endif  // WORK_QUEUE_H
@@ -2,18 +2,729 @@
 
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <queue>
+#include <tuple>
+
+#include "parallel.h"
+
+namespace {
+
+// Ranges of at least this many triangles are split by every thread together, a level
+// of the tree at a time
+const size_t kParallelSplitMin = 1 << 17;
+// ...working on chunks of this many triangles. The chunks don't depend on the number of
+// threads, so neither does the tree
+const size_t kSplitChunk = 1 << 14;
+// Smaller subtrees are built by the thread which split their parent instead of being
+// queued where other threads can steal them
+const size_t kStealMin = 1 << 12;
+// bins the parallel median split counts centroids in to find the median
+const int kMedianBins = 1024;
+// Meshes with at least this many triangles get 63 bit Morton codes instead of 30 bit ones,
+// since so many triangles would share the 2^30 cells
+const size_t kMorton64Min = 1 << 20;
+// triangles per chunk when the Morton builder works through every leaf or node in parallel
+const size_t kMortonChunk = 1 << 16;
+// changed elements closer together than this are uploaded as one range, since every
+// upload has a fixed cost
+const size_t kUploadGap = 256;
+// the optimizer stops once a pass over every node takes less than this share off the
+// summed area of the inner nodes
+const double kReinsertConvergence = 1e-3;
+
+float surfaceArea(const DimensionGL &box) {
+    float dx = box.max_x - box.min_x;
+    float dy = box.max_y - box.min_y;
+    float dz = box.max_z - box.min_z;
+    if (dx < 0 || dy < 0 || dz < 0) {
+        // an empty box
+        return 0.0f;
+    }
+    return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+void growBox(DimensionGL &box, const DimensionGL &other) {
+    box.min_x = std::min(box.min_x, other.min_x);
+    box.min_y = std::min(box.min_y, other.min_y);
+    box.min_z = std::min(box.min_z, other.min_z);
+    box.max_x = std::max(box.max_x, other.max_x);
+    box.max_y = std::max(box.max_y, other.max_y);
+    box.max_z = std::max(box.max_z, other.max_z);
+}
+
+void growBox(DimensionGL &box, const Point3D &point) {
+    box.min_x = std::min(box.min_x, point.x);
+    box.min_y = std::min(box.min_y, point.y);
+    box.min_z = std::min(box.min_z, point.z);
+    box.max_x = std::max(box.max_x, point.x);
+    box.max_y = std::max(box.max_y, point.y);
+    box.max_z = std::max(box.max_z, point.z);
+}
+
+bool sameBox(const DimensionGL &box, const DimensionGL &other) {
+    return box.min_x == other.min_x && box.min_y == other.min_y && box.min_z == other.min_z
+           && box.max_x == other.max_x && box.max_y == other.max_y && box.max_z == other.max_z;
+}
+
+float boxMin(const DimensionGL &box, int axis) {
+    return axis == 0 ? box.min_x : (axis == 1 ? box.min_y : box.min_z);
+}
+
+float boxMax(const DimensionGL &box, int axis) {
+    return axis == 0 ? box.max_x : (axis == 1 ? box.max_y : box.max_z);
+}
+
+float centroidAxis(const triangle_info &tri, int axis) {
+    return axis == 0 ? tri.centroid_.x : (axis == 1 ? tri.centroid_.y : tri.centroid_.z);
+}
+
+/**
+ * The widest axis of box
+ */
+int widestAxis(const DimensionGL &box) {
+    int axis = 0;
+    float widest = box.max_x - box.min_x;
+    for (int i = 1; i < 3; ++i) {
+        float width = boxMax(box, i) - boxMin(box, i);
+        if (width > widest) {
+            axis = i;
+            widest = width;
+        }
+    }
+    return axis;
+}
+
+/**
+ * AxisBins - num_bins equal bins along one axis, spanning the centroid bounds of a range.
+ * If the centroids are flat on the axis everything goes in bin 0.
+ */
+struct AxisBins {
+    int axis;
+    float axis_min;
+    float scale;
+    int last_bin;
+
+    AxisBins(const DimensionGL &centroid_box, int bin_axis, int num_bins) : axis(bin_axis), last_bin(num_bins - 1) {
+        axis_min = boxMin(centroid_box, axis);
+        float extent = boxMax(centroid_box, axis) - axis_min;
+        scale = extent > 0.0f ? num_bins / extent : 0.0f;
+    }
+
+    bool flat() const { return scale == 0.0f; }
+
+    int bin(const triangle_info &tri) const {
+        return std::min(static_cast<int>((centroidAxis(tri, axis) - axis_min) * scale), last_bin);
+    }
+};
+
+/**
+ * SahBins - the bounds and number of the triangles in each SAH bin of every axis
+ */
+struct SahBins {
+    DimensionGL box[3][kSahBins];
+    int count[3][kSahBins] = {};
+    // whether the centroids were spread along each axis, so it was binned
+    bool binned[3] = { false, false, false };
+
+    /**
+     * Add the triangles in [begin, end) of a range with the given centroid bounds. An axis
+     * the centroids are flat on can't be split, so it is left empty.
+     */
+    void add(const triangle_info *begin, const triangle_info *end, const DimensionGL &centroid_box) {
+        for (int axis = 0; axis < 3; ++axis) {
+            const AxisBins bins(centroid_box, axis, kSahBins);
+            if (bins.flat()) {
+                continue;
+            }
+            binned[axis] = true;
+            for (const triangle_info *tri = begin; tri != end; ++tri) {
+                int bin = bins.bin(*tri);
+                growBox(box[axis][bin], tri->AABB_);
+                ++count[axis][bin];
+            }
+        }
+    }
+
+    void merge(const SahBins &other) {
+        for (int axis = 0; axis < 3; ++axis) {
+            binned[axis] = binned[axis] || other.binned[axis];
+            for (int bin = 0; bin < kSahBins; ++bin) {
+                growBox(box[axis][bin], other.box[axis][bin]);
+                count[axis][bin] += other.count[axis][bin];
+            }
+        }
+    }
+};
+
+/**
+ * Find the boundary between bins with the lowest area * triangle count over both sides,
+ * and that cost if cost is given. Returns false if no boundary has triangles on both sides.
+ */
+bool bestSahSplit(const SahBins &bins, int count, int &best_axis, int &best_split, float *cost_out = nullptr) {
+    float best_cost = INFINITY;
+    best_axis = -1;
+    for (int axis = 0; axis < 3; ++axis) {
+        if (!bins.binned[axis]) {
+            continue;
+        }
+        // sweep from the right to get the cost of everything right of each boundary
+        float right_cost[kSahBins];
+        DimensionGL right_box;
+        int right_count = 0;
+        for (int bin = kSahBins - 1; bin > 0; --bin) {
+            growBox(right_box, bins.box[axis][bin]);
+            right_count += bins.count[axis][bin];
+            right_cost[bin] = surfaceArea(right_box) * right_count;
+        }
+        // then sweep from the left, splitting between bin - 1 and bin
+        DimensionGL left_box;
+        int left_count = 0;
+        for (int bin = 1; bin < kSahBins; ++bin) {
+            growBox(left_box, bins.box[axis][bin - 1]);
+            left_count += bins.count[axis][bin - 1];
+            if (left_count == 0 || left_count == count) {
+                continue;
+            }
+            float cost = surfaceArea(left_box) * left_count + right_cost[bin];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = bin;
+            }
+        }
+    }
+    if (cost_out) {
+        *cost_out = best_cost;
+    }
+    return best_axis >= 0;
+}
+
+/**
+ * Which side of a split a triangle in bin goes: 0 for left, 2 for right, or 1 for the bins
+ * in between
+ */
+int splitSide(int bin, int left_end, int right_begin) {
+    return bin < left_end ? 0 : (bin < right_begin ? 1 : 2);
+}
 
 /**
- * Create a new bvh and store the triangles internally
+ * The depth of a median split tree over count triangles with leaves of up to leaf_size,
+ * ceil(log2(ceil(count / leaf_size)))
+ */
+int balancedDepth(size_t count, int leaf_size) {
+    size_t leaves = (count + leaf_size - 1) / leaf_size;
+    int depth = 0;
+    while ((size_t(1) << depth) < leaves) {
+        ++depth;
+    }
+    return depth;
+}
+
+/**
+ * Whether the SAH says testing the count triangles of a range bounded by box costs less
+ * than splitting it at middle. The range is small, so the children are just bounded here.
+ */
+bool leafIsCheaper(const triangle_info *begin, const triangle_info *middle, const triangle_info *end, const DimensionGL &box) {
+    DimensionGL left_box, right_box;
+    for (const triangle_info *leaf = begin; leaf != middle; ++leaf) {
+        growBox(left_box, leaf->AABB_);
+    }
+    for (const triangle_info *leaf = middle; leaf != end; ++leaf) {
+        growBox(right_box, leaf->AABB_);
+    }
+    // both costs are scaled by the area of box
+    float area = surfaceArea(box);
+    float leaf_cost = area * (end - begin) * kSahIntersectCost;
+    float split_cost = area * kSahTraversalCost
+                       + (surfaceArea(left_box) * (middle - begin) + surfaceArea(right_box) * (end - middle)) * kSahIntersectCost;
+    return leaf_cost <= split_cost;
+}
+
+/**
+ * Fill in node as a leaf over the leaves [first, first + count) of the final order
+ */
+void makeLeaf(NodeGL &node, size_t first, size_t count) {
+    node.l_child_offset = -1;
+    node.r_child_offset = -1;
+    node.triangle_offset = static_cast<int>(first);
+    node.triangle_count = static_cast<int>(count);
+}
+
+float pointAxis(const Point3D &point, int axis) {
+    return axis == 0 ? point.x : (axis == 1 ? point.y : point.z);
+}
+
+/**
+ * The overlap of box and other, which is empty (min above max) if they don't touch
+ */
+DimensionGL boxOverlap(const DimensionGL &box, const DimensionGL &other) {
+    DimensionGL overlap;
+    overlap.min_x = std::max(box.min_x, other.min_x);
+    overlap.min_y = std::max(box.min_y, other.min_y);
+    overlap.min_z = std::max(box.min_z, other.min_z);
+    overlap.max_x = std::min(box.max_x, other.max_x);
+    overlap.max_y = std::min(box.max_y, other.max_y);
+    overlap.max_z = std::min(box.max_z, other.max_z);
+    return overlap;
+}
+
+bool emptyBox(const DimensionGL &box) {
+    return !(box.min_x <= box.max_x && box.min_y <= box.max_y && box.min_z <= box.max_z);
+}
+
+/**
+ * The box of the part of the triangle p between low and high on axis, clipped to bounds
+ * (the box of the reference being split, which may have been clipped before). It holds
+ * the corners inside the slab and the points where the edges cross its planes. Returns
+ * an empty DimensionGL if nothing is left.
+ */
+DimensionGL clipTriangle(const Point3D *p, int axis, float low, float high, const DimensionGL &bounds) {
+    DimensionGL box;
+    for (int i = 0; i < 3; ++i) {
+        const Point3D &a = p[i];
+        const Point3D &b = p[(i + 1) % 3];
+        float va = pointAxis(a, axis);
+        float vb = pointAxis(b, axis);
+        if (va >= low && va <= high) {
+            growBox(box, a);
+        }
+        for (float plane : { low, high }) {
+            if ((va < plane && vb > plane) || (va > plane && vb < plane)) {
+                float t = (plane - va) / (vb - va);
+                Point3D crossing(a.x + t * (b.x - a.x), a.y + t * (b.y - a.y), a.z + t * (b.z - a.z));
+                // put the point exactly on the plane, so the sides meet without a gap
+                (axis == 0 ? crossing.x : (axis == 1 ? crossing.y : crossing.z)) = plane;
+                growBox(box, crossing);
+            }
+        }
+    }
+    DimensionGL clipped = boxOverlap(box, bounds);
+    return emptyBox(clipped) ? DimensionGL() : clipped;
+}
+
+/**
+ * A reference to the triangle of leaf which only covers box
+ */
+triangle_info clippedReference(const triangle_info &leaf, const DimensionGL &box) {
+    triangle_info clipped = leaf;
+    clipped.AABB_ = box;
+    clipped.centroid_ = Point3D(.5f * (box.min_x + box.max_x), .5f * (box.min_y + box.max_y), .5f * (box.min_z + box.max_z));
+    return clipped;
+}
+
+/**
+ * SpatialSplit - the best place to cut a node's space in two, and what it costs
+ */
+struct SpatialSplit {
+    int axis = -1;
+    float plane = 0.0f;
+    // area * references over both sides, like bestSahSplit's cost
+    float cost = INFINITY;
+};
+
+/**
+ * Find the best spatial split of the references in [begin, end), which are bounded by
+ * box. Every axis is cut into kSahBins equal slabs, and each reference is clipped into
+ * the slabs it crosses, counting once where it enters and once where it leaves. Splitting
+ * between two slabs then costs the area of everything left of it times the references
+ * entering there, plus the same for the right side.
+ */
+template<typename Points>
+SpatialSplit bestSpatialSplit(const triangle_info *begin, const triangle_info *end, const DimensionGL &box,
+                              Points points) {
+    SpatialSplit best;
+    const int count = static_cast<int>(end - begin);
+    for (int axis = 0; axis < 3; ++axis) {
+        const float low = boxMin(box, axis);
+        const float extent = boxMax(box, axis) - low;
+        if (!(extent > 0.0f)) {
+            continue;
+        }
+        const float slab = extent / kSahBins;
+        DimensionGL slab_box[kSahBins];
+        int entries[kSahBins] = {};
+        int exits[kSahBins] = {};
+        for (const triangle_info *ref = begin; ref != end; ++ref) {
+            int first = std::min(std::max(static_cast<int>((boxMin(ref->AABB_, axis) - low) / slab), 0), kSahBins - 1);
+            int last = std::min(std::max(static_cast<int>((boxMax(ref->AABB_, axis) - low) / slab), first), kSahBins - 1);
+            ++entries[first];
+            ++exits[last];
+            if (first == last) {
+                growBox(slab_box[first], ref->AABB_);
+                continue;
+            }
+            Point3D p[3];
+            points(ref->tri_offset_, p);
+            for (int bin = first; bin <= last; ++bin) {
+                float slab_low = bin == first ? -INFINITY : low + bin * slab;
+                float slab_high = bin == last ? INFINITY : low + (bin + 1) * slab;
+                growBox(slab_box[bin], clipTriangle(p, axis, slab_low, slab_high, ref->AABB_));
+            }
+        }
+        float right_cost[kSahBins];
+        int right_count[kSahBins];
+        DimensionGL right_box;
+        int right = 0;
+        for (int bin = kSahBins - 1; bin > 0; --bin) {
+            growBox(right_box, slab_box[bin]);
+            right += exits[bin];
+            right_cost[bin] = surfaceArea(right_box) * right;
+            right_count[bin] = right;
+        }
+        DimensionGL left_box;
+        int left = 0;
+        for (int bin = 1; bin < kSahBins; ++bin) {
+            growBox(left_box, slab_box[bin - 1]);
+            left += entries[bin - 1];
+            // both sides have to shrink, or the tree may never end
+            if (!left || !right_count[bin] || left == count || right_count[bin] == count) {
+                continue;
+            }
+            float cost = surfaceArea(left_box) * left + right_cost[bin];
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.plane = low + bin * slab;
+            }
+        }
+    }
+    return best;
+}
+
+/**
+ * Bound the ancestors of node, whose box is done, for as long as their other child is done
+ * too. At each parent the first child to arrive stops while the second bounds the parent
+ * and goes on, so every parent is bounded once, after both its children, however many
+ * threads are climbing. If changed is given, it records whether each parent's box moved.
+ */
+void boundAncestors(std::vector<NodeGL> &nodes, const std::vector<int> &parents, std::vector<std::atomic<int>> &arrived,
+                    int node, std::vector<char> *changed) {
+    int parent = parents[node];
+    while (parent != -1 && arrived[parent].fetch_add(1, std::memory_order_acq_rel) == 1) {
+        NodeGL &inner = nodes[parent];
+        DimensionGL box = nodes[inner.l_child_offset].AABB;
+        growBox(box, nodes[inner.r_child_offset].AABB);
+        if (changed) {
+            (*changed)[parent] = !sameBox(box, inner.AABB);
+        }
+        inner.AABB = box;
+        parent = parents[parent];
+    }
+}
+
+/**
+ * Add range to the end of ranges, joining it to the last one if the gap between them is
+ * small
+ */
+void mergeRange(std::vector<BufferRange> &ranges, const BufferRange &range) {
+    if (!ranges.empty() && range.first <= ranges.back().second + kUploadGap) {
+        ranges.back().second = std::max(ranges.back().second, range.second);
+    }
+    else {
+        ranges.push_back(range);
+    }
+}
+
+/**
+ * The ranges of [0, count) holding every i for which changed(i) is true, checked on
+ * num_threads threads
+ */
+template<typename Changed>
+std::vector<BufferRange> changedRanges(size_t count, int num_threads, Changed changed) {
+    size_t num_chunks = (count + kSplitChunk - 1) / kSplitChunk;
+    std::vector<std::vector<BufferRange>> chunk_ranges(num_chunks);
+    parallelFor(num_chunks, num_threads, [&](size_t chunk) {
+        size_t end = std::min(count, (chunk + 1) * kSplitChunk);
+        for (size_t i = chunk * kSplitChunk; i < end; ++i) {
+            if (changed(i)) {
+                mergeRange(chunk_ranges[chunk], BufferRange(i, i + 1));
+            }
+        }
+    });
+    std::vector<BufferRange> ranges;
+    for (const std::vector<BufferRange> &chunk : chunk_ranges) {
+        for (const BufferRange &range : chunk) {
+            mergeRange(ranges, range);
+        }
+    }
+    return ranges;
+}
+
+bool samePoint(const VertexGL &point, const VertexGL &other) {
+    return point.pos[0] == other.pos[0] && point.pos[1] == other.pos[1] && point.pos[2] == other.pos[2];
+}
+
+/**
+ * Spread the low 10 bits of v out to every third bit
+ */
+uint32_t spreadBits(uint32_t v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+/**
+ * Spread the low 21 bits of v out to every third bit
+ */
+uint64_t spreadBits(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | (v << 32)) & 0x001f00000000ffffull;
+    v = (v | (v << 16)) & 0x001f0000ff0000ffull;
+    v = (v | (v << 8)) & 0x100f00f00f00f00full;
+    v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+    v = (v | (v << 2)) & 0x1249249249249249ull;
+    return v;
+}
+
+/**
+ * Where to split the run [first, last) of sorted Morton codes of a node at depth. Ideally
+ * that's where the highest bit which differs across the run flips, which splits the node's
+ * grid cell in half. But neither side may be too big to fit under max_depth in leaves of
+ * max_leaf_size (or, when the run can't fit anyway, to be shallower than the run is now),
+ * so the split is taken where the highest bit flips within the window of splits which
+ * satisfy that. That is the boundary between the largest aligned cells in the window.
+ */
+template<typename Code>
+size_t mortonSplit(const Code *codes, size_t first, size_t last, int depth, int max_depth, int max_leaf_size) {
+    size_t run = last - first;
+    int side_depth = std::max(0, std::max(max_depth, depth + balancedDepth(run, max_leaf_size)) - depth - 1);
+    size_t largest_side = side_depth < 40 ? std::min(run - 1, static_cast<size_t>(max_leaf_size) << side_depth) : run - 1;
+    // the window of splits which leave no more than largest_side on either side
+    size_t low = last - largest_side;
+    size_t high = first + largest_side;
+    Code diff = codes[low - 1] ^ codes[high];
+    if (!diff) {
+        return std::min(std::max(first + run / 2, low), high);
+    }
+    Code bit = diff;
+    while (bit & (bit - 1)) {
+        bit &= bit - 1;
+    }
+    return std::partition_point(codes + low, codes + high + 1, [bit](Code code) { return !(code & bit); }) - codes;
+}
+
+/**
+ * MortonTask - a run [first, last) of the sorted Morton codes which becomes the subtree
+ * at node
+ */
+struct MortonTask {
+    int node;
+    size_t first;
+    size_t last;
+    int depth;
+};
+
+/**
+ * Build a linear bvh over leaves into nodes with Code sized Morton codes (10 or 21 bits
+ * per axis). The centroids are quantized to a grid over their bounds, the codes are radix
+ * sorted (leaves is reordered to match), and every run of codes is split where the highest
+ * bit which differs across it flips, until the SAH prefers a leaf of up to max_leaf_size
+ * triangles. Each node's children follow the same depth first layout as the other
+ * builders, and the boxes are filled in bottom up afterwards.
+ */
+template<typename Code>
+void buildMortonTree(std::vector<triangle_info> &leaves, std::vector<NodeGL> &nodes, int max_leaf_size, int max_depth,
+                     int num_threads) {
+    const int axis_bits = sizeof(Code) == 4 ? 10 : 21;
+    size_t count = leaves.size();
+    size_t num_chunks = (count + kMortonChunk - 1) / kMortonChunk;
+
+    // quantize the centroids to a grid spanning their bounds
+    std::vector<DimensionGL> chunk_boxes(num_chunks);
+    parallelFor(num_chunks, num_threads, [&](size_t chunk) {
+        size_t end = std::min(count, (chunk + 1) * kMortonChunk);
+        for (size_t i = chunk * kMortonChunk; i < end; ++i) {
+            growBox(chunk_boxes[chunk], leaves[i].centroid_);
+        }
+    });
+    DimensionGL centroid_box;
+    for (const DimensionGL &box : chunk_boxes) {
+        growBox(centroid_box, box);
+    }
+    // The grid cells are cubes sized by the widest axis, so a flat mesh isn't split along its
+    // thin axis as often as along the others
+    float cells = static_cast<float>((1 << axis_bits) - 1);
+    int widest = widestAxis(centroid_box);
+    float extent = boxMax(centroid_box, widest) - boxMin(centroid_box, widest);
+    float scale = extent > 0.0f ? cells / extent : 0.0f;
+    float axis_min[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        axis_min[axis] = boxMin(centroid_box, axis);
+    }
+    std::vector<Code> codes(count);
+    std::vector<uint32_t> order(count);
+    parallelFor(num_chunks, num_threads, [&](size_t chunk) {
+        size_t end = std::min(count, (chunk + 1) * kMortonChunk);
+        for (size_t i = chunk * kMortonChunk; i < end; ++i) {
+            Code code = 0;
+            for (int axis = 0; axis < 3; ++axis) {
+                float cell = std::min((centroidAxis(leaves[i], axis) - axis_min[axis]) * scale, cells);
+                code |= spreadBits(static_cast<Code>(std::max(cell, 0.0f))) << (2 - axis);
+            }
+            codes[i] = code;
+            order[i] = static_cast<uint32_t>(i);
+        }
+    });
+    parallelRadixSort(codes, order, 3 * axis_bits, num_threads);
+    {
+        std::vector<triangle_info> sorted(count);
+        parallelFor(num_chunks, num_threads, [&](size_t chunk) {
+            size_t end = std::min(count, (chunk + 1) * kMortonChunk);
+            for (size_t i = chunk * kMortonChunk; i < end; ++i) {
+                sorted[i] = leaves[order[i]];
+            }
+        });
+        leaves.swap(sorted);
+    }
+
+    // split the sorted codes top down, remembering every node's parent
+    nodes.resize(2 * count - 1);
+    std::vector<int> parents(nodes.size());
+    parents[0] = -1;
+    parallelTasks(std::vector<MortonTask>(1, { 0, 0, count, 0 }), num_threads, [&](const MortonTask &subtree, auto &spawn) {
+        std::vector<MortonTask> tasks;
+        tasks.reserve(2 * (kMaxLeafDepth + 1));
+        tasks.push_back(subtree);
+        while (!tasks.empty()) {
+            MortonTask task = tasks.back();
+            tasks.pop_back();
+            NodeGL &node = nodes[task.node];
+            size_t run = task.last - task.first;
+            size_t middle = run > 1 ? mortonSplit(data(codes), task.first, task.last, task.depth, max_depth, max_leaf_size)
+                                     : task.last;
+            if (run <= static_cast<size_t>(max_leaf_size)) {
+                const triangle_info *first = data(leaves) + task.first;
+                DimensionGL box;
+                for (const triangle_info *leaf = first; leaf != first + run; ++leaf) {
+                    growBox(box, leaf->AABB_);
+                }
+                // a run which fits in a leaf at the depth cap has to be one
+                if (run == 1 || task.depth >= max_depth || leafIsCheaper(first, data(leaves) + middle, first + run, box)) {
+                    node.AABB = box;
+                    makeLeaf(node, task.first, run);
+                    continue;
+                }
+            }
+            int left_count = static_cast<int>(middle - task.first);
+            node.triangle_offset = -1;
+            node.triangle_count = 0;
+            node.l_child_offset = task.node + 1;
+            node.r_child_offset = task.node + 2 * left_count;
+            parents[node.l_child_offset] = task.node;
+            parents[node.r_child_offset] = task.node;
+            // push the right run first so the left one is built next
+            for (const MortonTask &child : { MortonTask{ node.r_child_offset, middle, task.last, task.depth + 1 },
+                                             MortonTask{ node.l_child_offset, task.first, middle, task.depth + 1 } }) {
+                if (child.last - child.first >= kStealMin) {
+                    spawn(child);
+                }
+                else {
+                    tasks.push_back(child);
+                }
+            }
+        }
+    });
+
+    // Bound the nodes bottom up, every leaf climbing towards the root. Slots left over
+    // below multi triangle leaves were value initialized, so they have no triangles and
+    // are skipped like inner nodes.
+    std::vector<std::atomic<int>> arrived(nodes.size());
+    size_t node_chunks = (nodes.size() + kMortonChunk - 1) / kMortonChunk;
+    parallelFor(node_chunks, num_threads, [&](size_t chunk) {
+        size_t end = std::min(nodes.size(), (chunk + 1) * kMortonChunk);
+        for (size_t i = chunk * kMortonChunk; i < end; ++i) {
+            if (nodes[i].triangle_count) {
+                boundAncestors(nodes, parents, arrived, static_cast<int>(i), nullptr);
+            }
+        }
+    });
+}
+
+/**
+ * The place of each of count vertices (or normals) when they are stored in the order
+ * triangles first use them. Unused ones keep their order after the rest.
+ */
+std::vector<int> firstUseOrder(size_t count, const std::vector<TriangleIndexGL> &triangles, bool normals) {
+    std::vector<int> order(count, -1);
+    int next = 0;
+    for (const TriangleIndexGL &tri : triangles) {
+        for (int corner : { normals ? tri.n1 : tri.v1, normals ? tri.n2 : tri.v2, normals ? tri.n3 : tri.v3 }) {
+            if (corner >= 0 && order[corner] == -1) {
+                order[corner] = next++;
+            }
+        }
+    }
+    for (int &place : order) {
+        if (place == -1) {
+            place = next++;
+        }
+    }
+    return order;
+}
+
+/**
+ * Move every items[i] to items[order[i]]
+ */
+void reorderCorners(std::vector<VertexGL> &items, const std::vector<int> &order) {
+    std::vector<VertexGL> sorted(items.size());
+    for (size_t i = 0; i < items.size(); ++i) {
+        sorted[order[i]] = items[i];
+    }
+    items.swap(sorted);
+}
+
+}  // namespace
+
+/**
+ * Create a new bvh and move the triangle mesh into it
  */ 
-bvh::bvh(vector<TriangleGL> &tris) {
+bvh::bvh(TriangleMesh &mesh, const BvhOptions &options)
+    : method_(options.method), max_leaf_size_(std::min(std::max(options.max_leaf_size, 1), kMaxLeafSize)),
+      max_depth_(std::min(std::max(options.max_depth, 1), kMaxLeafDepth)), rebuild_ratio_(options.rebuild_ratio),
+      spatial_budget_(options.spatial_budget), treelet_nodes_(options.treelet_nodes),
+      optimize_seconds_(options.optimize_seconds), optimize_sah_cost_(options.optimize_sah_cost) {
     // start by making the bvh leaves
-    triangles_.insert(triangles_.end(), make_move_iterator(tris.begin()), make_move_iterator(tris.end()));
+    mesh_ = std::move(mesh);
     std::vector<triangle_info> leaves = boundTriangles();
     // now construct the bvh
-    NodeGL root;
-    bvh_nodes_.push_back(root);
-    buildRecurse(0, leaves);
+    build(leaves, options.num_threads, optimize_seconds_);
+    if (options.sort_vertices) {
+        sortVertices();
+    }
+}
+
+/**
+ * Create a new bvh from leaves which were bounded ahead of time
+ */
+bvh::bvh(TriangleMesh &mesh, std::vector<triangle_info> &leaves, const BvhOptions &options)
+    : method_(options.method), max_leaf_size_(std::min(std::max(options.max_leaf_size, 1), kMaxLeafSize)),
+      max_depth_(std::min(std::max(options.max_depth, 1), kMaxLeafDepth)), rebuild_ratio_(options.rebuild_ratio),
+      spatial_budget_(options.spatial_budget), treelet_nodes_(options.treelet_nodes),
+      optimize_seconds_(options.optimize_seconds), optimize_sah_cost_(options.optimize_sah_cost) {
+    mesh_ = std::move(mesh);
+    build(leaves, options.num_threads, optimize_seconds_);
+    if (options.sort_vertices) {
+        sortVertices();
+    }
+}
+
+/**
+ * Create a new bvh over leaves which aren't triangles of a mesh
+ */
+bvh::bvh(std::vector<triangle_info> &leaves, const BvhOptions &options)
+    : method_(options.method), max_leaf_size_(std::min(std::max(options.max_leaf_size, 1), kMaxLeafSize)),
+      max_depth_(std::min(std::max(options.max_depth, 1), kMaxLeafDepth)), rebuild_ratio_(options.rebuild_ratio),
+      spatial_budget_(options.spatial_budget), treelet_nodes_(options.treelet_nodes),
+      optimize_seconds_(options.optimize_seconds), optimize_sah_cost_(options.optimize_sah_cost) {
+    build(leaves, options.num_threads, optimize_seconds_);
 }
 
 /**
@@ -26,185 +737,1189 @@ NodeGL * bvh::getCompact(int &num_nodes) {
 }
 
 /**
- * Get all the triangles stored in the bvh. Return a pointer
- * because OpenGL buffers need pointers to data, and this
- * method is used to populate the triangle buffer.
- */ 
-TriangleGL* bvh::getTriangles(int &num_triangles) {
-    num_triangles = triangles_.size();
-    return data(triangles_);
-}
-
-/**
- * Construct a leaf nodes containing 1 singular triangle.
+ * Bound every triangle of the mesh, ready to be sorted into the leaves.
  * This is trivially done by calculating the extent of the triangle.
  */ 
 vector<triangle_info> bvh::boundTriangles() {
-    size_t num_tri = triangles_.size();
+    size_t num_tri = mesh_.triangles.size();
     vector<triangle_info> tri_nodes(num_tri);
     for(size_t i = 0; i < num_tri; ++i) {
-        tri_nodes[i].tri_offset_ = i;
-        
-        Dimension tri_bnd;
-        std::pair<float, float> x_bnds = std::minmax({triangles_[i].p1[0], triangles_[i].p2[0], triangles_[i].p3[0]});
-        std::pair<float, float> y_bnds = std::minmax({triangles_[i].p1[1], triangles_[i].p2[1], triangles_[i].p3[1]});
-        std::pair<float, float> z_bnds = std::minmax({triangles_[i].p1[2], triangles_[i].p2[2], triangles_[i].p3[2]});
-        
-        tri_nodes[i].AABB_.min_x = x_bnds.first;
-        tri_nodes[i].AABB_.max_x = x_bnds.second;
-        
-        tri_nodes[i].AABB_.min_y = y_bnds.first;
-        tri_nodes[i].AABB_.max_y = y_bnds.second;
-        
-        tri_nodes[i].AABB_.min_z = z_bnds.first;
-        tri_nodes[i].AABB_.max_z = z_bnds.second;
-
-        tri_nodes[i].centroid_ = Point3D(.5*x_bnds.second+.5*x_bnds.first, .5*y_bnds.second+.5*y_bnds.first, .5*z_bnds.second+.5*z_bnds.first);
+        const TriangleIndexGL &tri = mesh_.triangles[i];
+        tri_nodes[i] = boundTriangle(mesh_.vertices[tri.v1].pos, mesh_.vertices[tri.v2].pos, mesh_.vertices[tri.v3].pos, i);
     }
     return tri_nodes;
 }
 
+triangle_info boundTriangle(const float *p1, const float *p2, const float *p3, int tri_offset) {
+    triangle_info leaf;
+    leaf.tri_offset_ = tri_offset;
+
+    std::pair<float, float> x_bnds = std::minmax({p1[0], p2[0], p3[0]});
+    std::pair<float, float> y_bnds = std::minmax({p1[1], p2[1], p3[1]});
+    std::pair<float, float> z_bnds = std::minmax({p1[2], p2[2], p3[2]});
+
+    leaf.AABB_.min_x = x_bnds.first;
+    leaf.AABB_.max_x = x_bnds.second;
+
+    leaf.AABB_.min_y = y_bnds.first;
+    leaf.AABB_.max_y = y_bnds.second;
+
+    leaf.AABB_.min_z = z_bnds.first;
+    leaf.AABB_.max_z = z_bnds.second;
+
+    leaf.centroid_ = Point3D(.5*x_bnds.second+.5*x_bnds.first, .5*y_bnds.second+.5*y_bnds.first, .5*z_bnds.second+.5*z_bnds.first);
+    return leaf;
+}
+
 /**
- * Determine the smallest boundary that encapsulates all the
- * triangles
- */ 
-DimensionGL bvh::getExtent(const std::vector<triangle_info> &tris) {
-    DimensionGL extent;
-    size_t num_tris = tris.size();
-    for(size_t i = 0; i < num_tris; ++i) {
-        extent.max_x = std::max(extent.max_x, tris[i].AABB_.max_x);
-        extent.max_y = std::max(extent.max_y, tris[i].AABB_.max_y);
-        extent.max_z = std::max(extent.max_z, tris[i].AABB_.max_z);
+ * Start the builder thread. It waits for batches until finish() is called
+ */
+bvh_builder::bvh_builder(const BvhOptions &options) : options_(options) {
+    thread_ = std::thread(&bvh_builder::boundBatches, this);
+}
 
-        extent.min_x = std::min(extent.min_x, tris[i].AABB_.min_x);
-        extent.min_y = std::min(extent.min_y, tris[i].AABB_.min_y);
-        extent.min_z = std::min(extent.min_z, tris[i].AABB_.min_z);
+bvh_builder::~bvh_builder() {
+    if (thread_.joinable()) {
+        batches_.close();
+        thread_.join();
     }
-    return extent;
 }
 
 /**
- * Determine the smallest boundary that encapsulates all the
- * points
- */ 
-DimensionGL bvh::getExtent(const std::vector<Point3D> &pts) {
-    DimensionGL extent;
-    for(size_t i = 0; i < pts.size(); ++i) {
-        extent.max_x = std::max(extent.max_x, pts[i].x);
-        extent.max_y = std::max(extent.max_y, pts[i].y);
-        extent.max_z = std::max(extent.max_z, pts[i].z);
+ * The callback which feeds the parser's triangle batches into the builder's queue
+ */
+TriangleSink bvh_builder::sink() {
+    return [this](TriangleBatch &&batch) { batches_.push(std::move(batch)); };
+}
 
-        extent.min_x = std::min(extent.min_x, pts[i].x);
-        extent.min_y = std::min(extent.min_y, pts[i].y);
-        extent.min_z = std::min(extent.min_z, pts[i].z);
+/**
+ * Turn every queued batch into leaves as it arrives. Batches come in file order, so
+ * the leaves line up with the triangles of the final mesh.
+ */
+void bvh_builder::boundBatches() {
+    TriangleBatch batch;
+    while (batches_.pop(batch)) {
+        size_t num_tri = batch.points.size() / 3;
+        leaves_.resize(batch.first + num_tri);
+        for (size_t i = 0; i < num_tri; ++i) {
+            const VertexGL *pts = &batch.points[3 * i];
+            leaves_[batch.first + i] = boundTriangle(pts[0].pos, pts[1].pos, pts[2].pos, batch.first + i);
+        }
     }
-    return extent;
+}
+
+bvh bvh_builder::finish(TriangleMesh &mesh) {
+    batches_.close();
+    thread_.join();
+    if (leaves_.size() != mesh.triangles.size()) {
+        // the batches did not cover the mesh, so bound it from scratch
+        return bvh(mesh, options_);
+    }
+    return bvh(mesh, leaves_, options_);
 }
 
 /**
- * Construct a bvh by using the Surface Area Heuristic to subdivide
- * the leaf nodes provided 
+ * Build the tree over leaves, which are reordered in place. Every node covers a
+ * contiguous range of leaves and is split by partitioning that range, so nothing is
+ * copied or allocated per node. A subtree over n leaves has at most 2n - 1 nodes, so the
+ * nodes are allocated once up front and every child's slot is known before it is
+ * built: the left child follows its parent and the right child follows the room kept for
+ * the left subtree, which is the depth first order the shader expects. Because of that
+ * the subtrees can be built in any order, on any thread, and still land in the same place.
+ * Leaves holding several triangles leave some of that room unused, so the nodes are
+ * compacted afterwards, and the mesh's triangles (if there is a mesh) are put in the
+ * final order of the leaves. Up to optimize_seconds are spent improving the tree before
+ * that, see optimizeTree.
  */
-void bvh::buildRecurse(int node_offset, std::vector<triangle_info> &tris) {
-    if(tris.size() == 2) {
-        NodeGL l_child, r_child;
-        l_child.l_child_offset = -1;
-        l_child.r_child_offset = -1;
-        l_child.AABB = tris[0].AABB_;
-        l_child.triangle_offset = tris[0].tri_offset_;
+void bvh::build(std::vector<triangle_info> &leaves, int num_threads, float optimize_seconds) {
+    bvh_nodes_.clear();
+    parents_.clear();
+    built_sah_cost_ = -1.0f;
+    spatial_references_ = 0;
+    stack_size_ = 0;
+    if (leaves.empty()) {
+        return;
+    }
+    if (num_threads <= 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (method_ == SPLIT_SBVH && !mesh_.triangles.empty()) {
+        buildSpatialTree(leaves);
+        optimizeTree(leaves, num_threads, optimize_seconds);
+        sortTriangles(leaves, num_threads);
+        // note which triangle every reference copies, so a rebuild can drop the copies
+        reference_sources_.resize(leaves.size());
+        for (size_t i = 0; i < leaves.size(); ++i) {
+            reference_sources_[i] = leaves[i].tri_offset_;
+        }
+        finishNodes();
+        return;
+    }
+    if (method_ == SPLIT_MORTON) {
+        if (leaves.size() >= kMorton64Min) {
+            buildMortonTree<uint64_t>(leaves, bvh_nodes_, max_leaf_size_, max_depth_, num_threads);
+        }
+        else {
+            buildMortonTree<uint32_t>(leaves, bvh_nodes_, max_leaf_size_, max_depth_, num_threads);
+        }
+        compactNodes();
+        optimizeTree(leaves, num_threads, optimize_seconds);
+        if (!mesh_.triangles.empty()) {
+            sortTriangles(leaves, num_threads);
+        }
+        finishNodes();
+        return;
+    }
+    bvh_nodes_.resize(2 * leaves.size() - 1);
+    BuildTask root = { 0, data(leaves), data(leaves) + leaves.size(), 0 };
+    std::vector<BuildTask> subtrees;
+    if (leaves.size() >= kParallelSplitMin) {
+        splitTopLevels(root, num_threads, subtrees);
+    }
+    else {
+        subtrees.push_back(root);
+    }
+    triangle_info *first = data(leaves);
+    parallelTasks(subtrees, num_threads, [this, first](const BuildTask &subtree, auto &spawn) {
+        // The stack of ranges waiting to be built never holds more than one range per
+        // level, so reserving it once covers any tree the shader can use
+        std::vector<BuildTask> tasks;
+        tasks.reserve(2 * (kMaxLeafDepth + 1));
+        tasks.push_back(subtree);
+        while (!tasks.empty()) {
+            BuildTask task = tasks.back();
+            tasks.pop_back();
+            triangle_info *middle = splitNode(task, first);
+            if (!middle) {
+                continue;
+            }
+            const NodeGL &node = bvh_nodes_[task.node];
+            // push the right range first so the left one is built next
+            for (const BuildTask &child : { BuildTask{ node.r_child_offset, middle, task.end, task.depth + 1 },
+                                            BuildTask{ node.l_child_offset, task.begin, middle, task.depth + 1 } }) {
+                if (static_cast<size_t>(child.end - child.begin) >= kStealMin) {
+                    spawn(child);
+                }
+                else {
+                    tasks.push_back(child);
+                }
+            }
+        }
+    });
+    compactNodes();
+    optimizeTree(leaves, num_threads, optimize_seconds);
+    if (!mesh_.triangles.empty()) {
+        sortTriangles(leaves, num_threads);
+    }
+    finishNodes();
+}
 
-        r_child.l_child_offset = -1;
-        r_child.r_child_offset = -1;
-        r_child.AABB = tris[1].AABB_;
-        r_child.triangle_offset = tris[1].tri_offset_;
+/**
+ * Lay the finished nodes out in treelets if the options asked for it, and note the stack
+ * the tree needs
+ */
+void bvh::finishNodes() {
+    if (treelet_nodes_ > 1) {
+        layoutTreelets();
+    }
+    stack_size_ = traversalStackSize(data(bvh_nodes_), bvh_nodes_.size());
+}
 
-        bvh_nodes_.push_back(l_child);
-        bvh_nodes_.push_back(r_child);
+/**
+ * Store the nodes in treelets of up to treelet_nodes_ nodes instead of depth first. A ray
+ * which hits an inner node always reads both its children, so the nodes are placed in
+ * sibling pairs which each sit inside one 128 byte cache line. A 48 byte NodeGL doesn't
+ * divide a line, but 8 of them fill exactly 3 lines, and within those slots 0-1, 3-4 and
+ * 6-7 each fit in a line. So every 8 slots hold 3 pairs, and slots 2 and 5 (which cross
+ * a line) are padding that nothing points at. The root, which has no sibling, takes slot
+ * 0 with padding beside it.
+ * A treelet grows from its root by adding the children of whichever node in it has the
+ * largest box, which is the node a ray through the treelet's root most likely hits next.
+ * The nodes left over below a full treelet root the next ones, which are stored right
+ * after it, left side first.
+ */
+void bvh::layoutTreelets() {
+    const size_t num_nodes = bvh_nodes_.size();
+    if (num_nodes < 3) {
+        return;
+    }
+    auto isInner = [this](int index) {
+        const NodeGL &node = bvh_nodes_[index];
+        return node.l_child_offset != -1 || node.r_child_offset != -1;
+    };
+    // the first slot of the k-th pair, counting the root's slot as pair 0
+    auto pairSlot = [](size_t pair) { return 8 * (pair / 3) + 3 * (pair % 3); };
+    const int pairs_per_treelet = std::max(treelet_nodes_ / 2, 1);
+    std::vector<int> new_index(num_nodes, -1);
+    new_index[0] = 0;
+    size_t num_pairs = 1;
+    // inner nodes whose children still have to be placed
+    std::vector<int> roots(1, 0);
+    std::vector<int> candidates;
+    while (!roots.empty()) {
+        candidates.assign(1, roots.back());
+        roots.pop_back();
+        for (int added = 0; added < pairs_per_treelet && !candidates.empty(); ++added) {
+            size_t best = 0;
+            for (size_t i = 1; i < candidates.size(); ++i) {
+                if (surfaceArea(bvh_nodes_[candidates[i]].AABB) > surfaceArea(bvh_nodes_[candidates[best]].AABB)) {
+                    best = i;
+                }
+            }
+            const NodeGL &node = bvh_nodes_[candidates[best]];
+            candidates.erase(candidates.begin() + best);
+            size_t slot = pairSlot(num_pairs++);
+            new_index[node.l_child_offset] = static_cast<int>(slot);
+            new_index[node.r_child_offset] = static_cast<int>(slot + 1);
+            for (int child : { node.l_child_offset, node.r_child_offset }) {
+                if (isInner(child)) {
+                    candidates.push_back(child);
+                }
+            }
+        }
+        // the nodes are still depth first, so sorting the left over roots by index and
+        // pushing them backwards lays out the leftmost treelet first
+        std::sort(candidates.begin(), candidates.end());
+        roots.insert(roots.end(), candidates.rbegin(), candidates.rend());
+    }
+    // the padding has an empty box and no triangles, so it adds nothing to the SAH cost
+    NodeGL padding;
+    padding.AABB.min_x = padding.AABB.min_y = padding.AABB.min_z = padding.AABB.min_pad = 0.0f;
+    padding.AABB.max_x = padding.AABB.max_y = padding.AABB.max_z = padding.AABB.max_pad = 0.0f;
+    padding.l_child_offset = -1;
+    padding.r_child_offset = -1;
+    padding.triangle_offset = 0;
+    padding.triangle_count = 0;
+    std::vector<NodeGL> nodes(pairSlot(num_pairs - 1) + 2, padding);
+    for (size_t i = 0; i < num_nodes; ++i) {
+        NodeGL node = bvh_nodes_[i];
+        if (isInner(static_cast<int>(i))) {
+            node.l_child_offset = new_index[node.l_child_offset];
+            node.r_child_offset = new_index[node.r_child_offset];
+        }
+        nodes[new_index[i]] = node;
+    }
+    bvh_nodes_.swap(nodes);
+}
 
-        bvh_nodes_[node_offset].AABB = getExtent(tris);
-        bvh_nodes_[node_offset].triangle_offset = -1;
-        bvh_nodes_[node_offset].l_child_offset = node_offset + 1;
-        bvh_nodes_[node_offset].r_child_offset = node_offset + 2;
+/**
+ * Spend up to seconds improving the finished tree's SAH cost, by taking
+ * subtrees out and inserting them again wherever they make the boxes above them grow
+ * least (the insertion based optimization of Bittner et al., moving whole subtrees).
+ * Every pass reinserts every node, the worst placed first: those with big boxes over much
+ * smaller children. The search for a subtree's new place goes down from the root, best first,
+ * and stops once no place below can beat the best found, so it never does worse than
+ * putting the subtree back. No leaf is moved deeper than max_depth_.
+ * It stops once the time is up, the SAH cost reaches the options' target, or a whole
+ * pass barely helped. The nodes are then laid out depth first again, and
+ * leaves in the order the new leaves index it.
+ */
+void bvh::optimizeTree(std::vector<triangle_info> &leaves, int num_threads, float seconds) {
+    const int num_nodes = static_cast<int>(bvh_nodes_.size());
+    if (seconds <= 0.0f || num_nodes < 5) {
         return;
     }
-    if(tris.size() == 1) {
-        NodeGL l_child;
-        l_child.l_child_offset = -1;
-        l_child.r_child_offset = -1;
-        l_child.AABB = tris[0].AABB_;
-        l_child.triangle_offset = tris[0].tri_offset_;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<NodeGL> &nodes = bvh_nodes_;
+    auto inner = [&nodes](int node) { return !nodes[node].triangle_count; };
+    // The nodes are depth first, so every child comes after its parent. Only the inner
+    // nodes' areas change as subtrees move, so their sum tracks the SAH cost
+    std::vector<int> parents(num_nodes, -1);
+    std::vector<int> heights(num_nodes, 0);
+    double inner_area = 0.0;
+    double leaf_cost = 0.0;
+    for (int i = num_nodes - 1; i >= 0; --i) {
+        const NodeGL &node = nodes[i];
+        if (inner(i)) {
+            parents[node.l_child_offset] = i;
+            parents[node.r_child_offset] = i;
+            heights[i] = 1 + std::max(heights[node.l_child_offset], heights[node.r_child_offset]);
+            inner_area += surfaceArea(node.AABB);
+        }
+        else {
+            leaf_cost += surfaceArea(node.AABB) * node.triangle_count * kSahIntersectCost;
+        }
+    }
+    const double root_area = surfaceArea(nodes[0].AABB);
+    auto treeCost = [&]() {
+        return (root_area * kSahTraversalCost + inner_area * 2 * kSahTraversalCost + leaf_cost) / root_area;
+    };
+    auto finished = [&]() {
+        if (optimize_sah_cost_ > 0.0f && root_area > 0.0 && treeCost() <= optimize_sah_cost_) {
+            return true;
+        }
+        return std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count() >= seconds;
+    };
+    auto replaceChild = [&nodes](int parent, int child, int with) {
+        NodeGL &node = nodes[parent];
+        (node.l_child_offset == child ? node.l_child_offset : node.r_child_offset) = with;
+    };
+    // bound node again from its children, and its ancestors until one doesn't change
+    auto refitUp = [&](int node) {
+        for (; node != -1; node = parents[node]) {
+            NodeGL &n = nodes[node];
+            DimensionGL box = nodes[n.l_child_offset].AABB;
+            growBox(box, nodes[n.r_child_offset].AABB);
+            int height = 1 + std::max(heights[n.l_child_offset], heights[n.r_child_offset]);
+            if (sameBox(box, n.AABB) && height == heights[node]) {
+                break;
+            }
+            inner_area += surfaceArea(box) - surfaceArea(n.AABB);
+            n.AABB = box;
+            heights[node] = height;
+        }
+    };
 
-        bvh_nodes_.push_back(l_child);
+    struct Place {
+        float induced;  // how much the boxes above the place grow to take the subtree
+        int node;
+        int depth;
+        bool operator<(const Place &other) const { return induced > other.induced; }
+    };
+    std::priority_queue<Place> places;
+    int root = 0;
+    // take the subtree at node out, freeing its parent, and insert it again under the
+    // parent's slot at the best place
+    auto reinsert = [&](int node) {
+        int parent = parents[node];
+        int grandparent = parents[parent];
+        int sibling = nodes[parent].l_child_offset == node ? nodes[parent].r_child_offset : nodes[parent].l_child_offset;
+        replaceChild(grandparent, parent, sibling);
+        parents[sibling] = grandparent;
+        inner_area -= surfaceArea(nodes[parent].AABB);
+        refitUp(grandparent);
 
-        bvh_nodes_[node_offset].AABB = getExtent(tris);
-        bvh_nodes_[node_offset].triangle_offset = -1;
-        bvh_nodes_[node_offset].l_child_offset = node_offset + 1;
-        bvh_nodes_[node_offset].r_child_offset = -1;
-        return;
+        const DimensionGL &box = nodes[node].AABB;
+        float area = surfaceArea(box);
+        float best_cost = std::numeric_limits<float>::infinity();
+        int best = sibling;
+        places = std::priority_queue<Place>();
+        places.push({ 0.0f, root, 0 });
+        while (!places.empty()) {
+            Place place = places.top();
+            places.pop();
+            if (place.induced + area >= best_cost) {
+                break;
+            }
+            if (place.depth + 1 + heights[node] > max_depth_) {
+                // every place below is deeper still
+                continue;
+            }
+            DimensionGL merged = nodes[place.node].AABB;
+            growBox(merged, box);
+            float cost = place.induced + surfaceArea(merged);
+            if (cost < best_cost && place.depth + 1 + heights[place.node] <= max_depth_) {
+                best_cost = cost;
+                best = place.node;
+            }
+            float induced = cost - surfaceArea(nodes[place.node].AABB);
+            if (inner(place.node) && induced + area < best_cost) {
+                places.push({ induced, nodes[place.node].l_child_offset, place.depth + 1 });
+                places.push({ induced, nodes[place.node].r_child_offset, place.depth + 1 });
+            }
+        }
+
+        int above = parents[best];
+        NodeGL &joined = nodes[parent];
+        joined.l_child_offset = best;
+        joined.r_child_offset = node;
+        joined.AABB = nodes[best].AABB;
+        growBox(joined.AABB, box);
+        heights[parent] = 1 + std::max(heights[best], heights[node]);
+        inner_area += surfaceArea(joined.AABB);
+        parents[parent] = above;
+        parents[best] = parent;
+        parents[node] = parent;
+        if (above == -1) {
+            root = parent;
+        }
+        else {
+            replaceChild(above, best, parent);
+            refitUp(above);
+        }
+    };
+
+    std::vector<float> badness(num_nodes);
+    std::vector<int> order(num_nodes);
+    size_t num_chunks = (num_nodes + kSplitChunk - 1) / kSplitChunk;
+    bool done = finished();
+    bool converged = false;
+    while (!done && !converged) {
+        double pass_area = inner_area;
+        // A node is badly placed when its box is big and much bigger than its children's
+        parallelFor(num_chunks, num_threads, [&](size_t chunk) {
+            int end = static_cast<int>(std::min<size_t>(num_nodes, (chunk + 1) * kSplitChunk));
+            for (int i = static_cast<int>(chunk * kSplitChunk); i < end; ++i) {
+                float area = surfaceArea(nodes[i].AABB);
+                badness[i] = area;
+                if (inner(i)) {
+                    float left = surfaceArea(nodes[nodes[i].l_child_offset].AABB);
+                    float right = surfaceArea(nodes[nodes[i].r_child_offset].AABB);
+                    float smallest = std::max(std::min(left, right), 1e-20f);
+                    badness[i] = area * (area / smallest) * (area / std::max(left + right, 1e-20f));
+                }
+                order[i] = i;
+            }
+        });
+        std::sort(order.begin(), order.end(),
+                  [&badness](int a, int b) { return badness[a] > badness[b] || (badness[a] == badness[b] && a < b); });
+        for (size_t i = 0; i < order.size() && !done; ++i) {
+            int node = order[i];
+            // the root and its children have nowhere better to go
+            if (node != root && parents[node] != root) {
+                reinsert(node);
+            }
+            done = finished();
+        }
+        converged = inner_area > pass_area * (1.0 - kReinsertConvergence);
+    }
+
+    // lay the nodes out depth first again, and the leaves in the order they are reached
+    std::vector<NodeGL> sorted;
+    sorted.reserve(num_nodes);
+    std::vector<triangle_info> sorted_leaves;
+    sorted_leaves.reserve(leaves.size());
+    // nodes still to be placed, and the node whose right child each one is (or -1)
+    std::vector<std::pair<int, int>> stack;
+    stack.reserve(2 * (kMaxLeafDepth + 1));
+    stack.emplace_back(root, -1);
+    while (!stack.empty()) {
+        std::pair<int, int> entry = stack.back();
+        stack.pop_back();
+        NodeGL node = nodes[entry.first];
+        int index = static_cast<int>(sorted.size());
+        if (entry.second != -1) {
+            sorted[entry.second].r_child_offset = index;
+        }
+        if (inner(entry.first)) {
+            stack.emplace_back(node.r_child_offset, index);
+            stack.emplace_back(node.l_child_offset, -1);
+            node.l_child_offset = index + 1;
+        }
+        else {
+            const triangle_info *first = &leaves[node.triangle_offset];
+            node.triangle_offset = static_cast<int>(sorted_leaves.size());
+            sorted_leaves.insert(sorted_leaves.end(), first, first + node.triangle_count);
+        }
+        sorted.push_back(node);
+    }
+    nodes.swap(sorted);
+    leaves.swap(sorted_leaves);
+}
+
+/**
+ * Close the gaps the multi triangle leaves left in the nodes. Walking the tree depth
+ * first visits the nodes in the order they are stored, so each one can be moved down to
+ * its final place without overwriting a node which hasn't been visited yet.
+ */
+void bvh::compactNodes() {
+    // nodes still to be moved, and the node whose right child each one is (or -1)
+    std::vector<std::pair<int, int>> stack;
+    stack.reserve(2 * (kMaxLeafDepth + 1));
+    stack.emplace_back(0, -1);
+    int next = 0;
+    while (!stack.empty()) {
+        std::pair<int, int> entry = stack.back();
+        stack.pop_back();
+        NodeGL node = bvh_nodes_[entry.first];
+        int index = next++;
+        if (entry.second != -1) {
+            bvh_nodes_[entry.second].r_child_offset = index;
+        }
+        if (!node.triangle_count) {
+            stack.emplace_back(node.r_child_offset, index);
+            stack.emplace_back(node.l_child_offset, -1);
+            node.l_child_offset = index + 1;
+        }
+        bvh_nodes_[index] = node;
+    }
+    bvh_nodes_.resize(next);
+    bvh_nodes_.shrink_to_fit();
+}
+
+/**
+ * Reorder the mesh's triangles to match leaves, so the leaves' triangle ranges index it
+ */
+void bvh::sortTriangles(const std::vector<triangle_info> &leaves, int num_threads) {
+    std::vector<TriangleIndexGL> sorted(leaves.size());
+    size_t num_chunks = (leaves.size() + kSplitChunk - 1) / kSplitChunk;
+    parallelFor(num_chunks, num_threads, [&](size_t chunk) {
+        size_t end = std::min(leaves.size(), (chunk + 1) * kSplitChunk);
+        for (size_t i = chunk * kSplitChunk; i < end; ++i) {
+            sorted[i] = mesh_.triangles[leaves[i].tri_offset_];
+        }
+    });
+    mesh_.triangles.swap(sorted);
+}
+
+/**
+ * Move the vertices and normals into the order the sorted triangles first use them, so
+ * the leaves next to each other in the tree read their corners from the same few cache
+ * lines. Vertices no triangle uses keep their order after the rest. Only done once the
+ * tree is first built, because refit() takes the vertices in the order they are stored.
+ */
+void bvh::sortVertices() {
+    std::vector<int> vertex_order = firstUseOrder(mesh_.vertices.size(), mesh_.triangles, false);
+    std::vector<int> normal_order = firstUseOrder(mesh_.normals.size(), mesh_.triangles, true);
+    reorderCorners(mesh_.vertices, vertex_order);
+    reorderCorners(mesh_.normals, normal_order);
+    for (TriangleIndexGL &tri : mesh_.triangles) {
+        tri.v1 = vertex_order[tri.v1];
+        tri.v2 = vertex_order[tri.v2];
+        tri.v3 = vertex_order[tri.v3];
+        if (tri.n1 >= 0) {
+            tri.n1 = normal_order[tri.n1];
+            tri.n2 = normal_order[tri.n2];
+            tri.n3 = normal_order[tri.n3];
+        }
     }
-    bvh_nodes_[node_offset].AABB = getExtent(tris);
-    bvh_nodes_[node_offset].triangle_offset = -1;
-    int split_index;
-    std::vector<triangle_info> bin_1, bin_2;
-    splitMidpoint(tris, bin_1, bin_2);
-    // create left child
-    NodeGL new_node;
-    bvh_nodes_.push_back(new_node);
-    int l_offset = node_offset + 1;
-    bvh_nodes_[node_offset].l_child_offset = l_offset;
-    buildRecurse(l_offset, bin_1);
-    // create right child
-    bvh_nodes_.push_back(new_node);
-    int r_offset = bvh_nodes_.size() - 1;
-    bvh_nodes_[node_offset].r_child_offset = r_offset;
-    buildRecurse(r_offset, bin_2);
-}
-
-/**
- * Recursively build the bvh using the midpoint method.
-*/
-bool bvh::splitMidpoint(std::vector<triangle_info> &in_tris, std::vector<triangle_info> &bin_1, std::vector<triangle_info> &bin_2) {
-    std::vector<Point3D> centroids;
-    for (size_t i = 0; i < in_tris.size(); ++i) {
-        centroids.push_back(in_tris[i].centroid_);
-    }
-    DimensionGL d = getExtent(centroids); 
-    float thresh;
-    float arr[3];
-    arr[0] = std::abs(d.max_x - d.min_x);
-    arr[1] = std::abs(d.max_y - d.min_y);
-    arr[2] = std::abs(d.max_z - d.min_z);
-    int index = 0;
-    float max = arr[0];
-    for(int i = 1; i < 3; ++i) {
-        if(arr[i] > max) {
-            index = i;
-            max = arr[i];
-        }
-    }
-    // now split
-    if(index == 0) {
-        // split on x
-        std::sort(in_tris.begin(), in_tris.end(), [](const triangle_info& tri_1, const triangle_info &tri_2) {
-            return tri_1.centroid_.x < tri_2.centroid_.x;
+}
+
+/**
+ * Bound and split the range of one node on the calling thread, and fill in the node.
+ * first is the start of all the leaves. Returns the start of the right child's range,
+ * or nullptr if the node is a leaf.
+ */
+triangle_info * bvh::splitNode(const BuildTask &task, const triangle_info *first) {
+    NodeGL &node = bvh_nodes_[task.node];
+    // bound the range and the centroids in it in one pass
+    DimensionGL centroid_box;
+    node.AABB = DimensionGL();
+    for (triangle_info *leaf = task.begin; leaf != task.end; ++leaf) {
+        growBox(node.AABB, leaf->AABB_);
+        growBox(centroid_box, leaf->centroid_);
+    }
+    size_t count = task.end - task.begin;
+    if (count == 1) {
+        makeLeaf(node, task.begin - first, count);
+        return nullptr;
+    }
+    // Median splits keep the subtree ceil(log2(n / max_leaf_size)) deep, as long as ranges
+    // which fit in a leaf at the depth cap are made leaves. Only use the SAH while there
+    // is still enough depth left for that, so the shader's stack can't overflow
+    triangle_info *middle = nullptr;
+    if ((method_ == SPLIT_SAH || method_ == SPLIT_SBVH) && task.depth + balancedDepth(count, max_leaf_size_) < max_depth_) {
+        middle = splitSAH(task.begin, task.end, centroid_box);
+    }
+    if (!middle) {
+        middle = splitMidpoint(task.begin, task.end, centroid_box);
+    }
+    if (count <= static_cast<size_t>(max_leaf_size_)
+        && (task.depth >= max_depth_ || leafIsCheaper(task.begin, middle, task.end, node.AABB))) {
+        makeLeaf(node, task.begin - first, count);
+        return nullptr;
+    }
+    node.triangle_offset = -1;
+    node.triangle_count = 0;
+    node.l_child_offset = task.node + 1;
+    node.r_child_offset = task.node + 2 * static_cast<int>(middle - task.begin);
+    return middle;
+}
+
+/**
+ * Split the ranges of at least kParallelSplitMin triangles at the top of the tree, where a
+ * single split already touches most of the scene. The ranges are split a level at a time,
+ * with every thread working through fixed size chunks of all the ranges on the level:
+ * bounding, SAH binning and the median search are reduced over the chunks in order, and
+ * the ranges are split with a stable partition through a scratch copy of the leaves. So
+ * the splits are exactly the same however many threads there are. The ranges which are
+ * too small to split this way are added to subtrees.
+ */
+void bvh::splitTopLevels(const BuildTask &root, int num_threads, std::vector<BuildTask> &subtrees) {
+    // what is known about the split of one range on the level
+    struct RangeSplit {
+        DimensionGL centroid_box;
+        bool sah = false;
+        bool fell_back = false;
+        // leaves in bins before left_end go left, from right_begin on go right, and any
+        // in between (in the bin holding the median) are ordered afterwards
+        int left_end = 0;
+        int right_begin = 0;
+        size_t side_count[3] = { 0, 0, 0 };
+    };
+    struct Chunk {
+        size_t range;
+        triangle_info *begin;
+        triangle_info *end;
+        DimensionGL box;
+        DimensionGL centroid_box;
+        SahBins bins;
+        int median_count[kMedianBins];
+        // triangles going left, into the median's bin and right, then where they go
+        size_t side_count[3];
+        size_t side_offset[3];
+    };
+    std::vector<BuildTask> level(1, root);
+    std::vector<BuildTask> next_level;
+    std::vector<RangeSplit> splits;
+    std::vector<Chunk> chunks;
+    // the bins each range is split along
+    std::vector<AxisBins> axis_bins;
+    std::vector<triangle_info> scratch(root.end - root.begin);
+    auto scratchOf = [&](const triangle_info *leaf) { return data(scratch) + (leaf - root.begin); };
+
+    while (!level.empty()) {
+        splits.assign(level.size(), RangeSplit());
+        chunks.clear();
+        for (size_t range = 0; range < level.size(); ++range) {
+            for (triangle_info *begin = level[range].begin; begin != level[range].end; begin = chunks.back().end) {
+                Chunk chunk;
+                chunk.range = range;
+                chunk.begin = begin;
+                chunk.end = begin + std::min<size_t>(kSplitChunk, level[range].end - begin);
+                chunks.push_back(chunk);
+            }
+        }
+
+        // bound every range and its centroids
+        parallelFor(chunks.size(), num_threads, [&](size_t i) {
+            Chunk &chunk = chunks[i];
+            for (const triangle_info *leaf = chunk.begin; leaf != chunk.end; ++leaf) {
+                growBox(chunk.box, leaf->AABB_);
+                growBox(chunk.centroid_box, leaf->centroid_);
+            }
         });
+        for (const Chunk &chunk : chunks) {
+            growBox(bvh_nodes_[level[chunk.range].node].AABB, chunk.box);
+            growBox(splits[chunk.range].centroid_box, chunk.centroid_box);
+        }
+
+        // bin the centroids for the SAH, or count them along the widest axis to find the median
+        axis_bins.clear();
+        for (size_t range = 0; range < level.size(); ++range) {
+            RangeSplit &split = splits[range];
+            size_t count = level[range].end - level[range].begin;
+            split.sah = (method_ == SPLIT_SAH || method_ == SPLIT_SBVH)
+                        && level[range].depth + balancedDepth(count, max_leaf_size_) < max_depth_;
+            axis_bins.emplace_back(split.centroid_box, widestAxis(split.centroid_box), kMedianBins);
+        }
+        auto binChunk = [&](size_t i) {
+            Chunk &chunk = chunks[i];
+            if (splits[chunk.range].sah) {
+                chunk.bins.add(chunk.begin, chunk.end, splits[chunk.range].centroid_box);
+                return;
+            }
+            const AxisBins bins = axis_bins[chunk.range];
+            std::fill(chunk.median_count, chunk.median_count + kMedianBins, 0);
+            for (const triangle_info *leaf = chunk.begin; leaf != chunk.end; ++leaf) {
+                ++chunk.median_count[bins.bin(*leaf)];
+            }
+        };
+        parallelFor(chunks.size(), num_threads, binChunk);
+        std::vector<size_t> range_chunks(level.size() + 1, 0);
+        for (const Chunk &chunk : chunks) {
+            ++range_chunks[chunk.range + 1];
+        }
+        for (size_t range = 0; range < level.size(); ++range) {
+            range_chunks[range + 1] += range_chunks[range];
+        }
+        bool fell_back = false;
+        for (size_t range = 0; range < level.size(); ++range) {
+            RangeSplit &split = splits[range];
+            if (!split.sah) {
+                continue;
+            }
+            SahBins bins;
+            for (size_t i = range_chunks[range]; i < range_chunks[range + 1]; ++i) {
+                bins.merge(chunks[i].bins);
+            }
+            int count = static_cast<int>(level[range].end - level[range].begin);
+            int axis;
+            if (bestSahSplit(bins, count, axis, split.left_end)) {
+                split.right_begin = split.left_end;
+                axis_bins[range] = AxisBins(split.centroid_box, axis, kSahBins);
+            }
+            else {
+                // the SAH can't separate the centroids, so count them for the median after all
+                split.sah = false;
+                split.fell_back = true;
+                fell_back = true;
+            }
+        }
+        if (fell_back) {
+            parallelFor(chunks.size(), num_threads, [&](size_t i) {
+                if (splits[chunks[i].range].fell_back) {
+                    binChunk(i);
+                }
+            });
+        }
+        for (size_t range = 0; range < level.size(); ++range) {
+            RangeSplit &split = splits[range];
+            if (split.sah) {
+                continue;
+            }
+            // find the bin holding the median
+            int count = static_cast<int>(level[range].end - level[range].begin);
+            int below = 0;
+            for (split.left_end = 0; split.left_end < kMedianBins - 1; ++split.left_end) {
+                int in_bin = 0;
+                for (size_t i = range_chunks[range]; i < range_chunks[range + 1]; ++i) {
+                    in_bin += chunks[i].median_count[split.left_end];
+                }
+                if (below + in_bin > count / 2) {
+                    break;
+                }
+                below += in_bin;
+            }
+            split.right_begin = split.left_end + 1;
+        }
+
+        // stable partition every range through the scratch leaves
+        parallelFor(chunks.size(), num_threads, [&](size_t i) {
+            Chunk &chunk = chunks[i];
+            std::fill(chunk.side_count, chunk.side_count + 3, 0);
+            const AxisBins bins = axis_bins[chunk.range];
+            const int left_end = splits[chunk.range].left_end;
+            const int right_begin = splits[chunk.range].right_begin;
+            for (const triangle_info *leaf = chunk.begin; leaf != chunk.end; ++leaf) {
+                ++chunk.side_count[splitSide(bins.bin(*leaf), left_end, right_begin)];
+            }
+        });
+        for (Chunk &chunk : chunks) {
+            for (int side = 0; side < 3; ++side) {
+                chunk.side_offset[side] = splits[chunk.range].side_count[side];
+                splits[chunk.range].side_count[side] += chunk.side_count[side];
+            }
+        }
+        parallelFor(chunks.size(), num_threads, [&](size_t i) {
+            Chunk &chunk = chunks[i];
+            const RangeSplit &split = splits[chunk.range];
+            triangle_info *side_start[3];
+            side_start[0] = scratchOf(level[chunk.range].begin) + chunk.side_offset[0];
+            side_start[1] = scratchOf(level[chunk.range].begin) + split.side_count[0] + chunk.side_offset[1];
+            side_start[2] = scratchOf(level[chunk.range].begin) + split.side_count[0] + split.side_count[1] + chunk.side_offset[2];
+            const AxisBins bins = axis_bins[chunk.range];
+            const int left_end = split.left_end;
+            const int right_begin = split.right_begin;
+            for (const triangle_info *leaf = chunk.begin; leaf != chunk.end; ++leaf) {
+                *side_start[splitSide(bins.bin(*leaf), left_end, right_begin)]++ = *leaf;
+            }
+        });
+        parallelFor(chunks.size(), num_threads, [&](size_t i) {
+            Chunk &chunk = chunks[i];
+            std::copy(scratchOf(chunk.begin), scratchOf(chunk.end), chunk.begin);
+        });
+        // the median is somewhere in its bin, so only that bin still has to be ordered
+        parallelFor(level.size(), num_threads, [&](size_t range) {
+            const RangeSplit &split = splits[range];
+            if (split.sah) {
+                return;
+            }
+            triangle_info *bin_begin = level[range].begin + split.side_count[0];
+            triangle_info *bin_end = bin_begin + split.side_count[1];
+            triangle_info *middle = level[range].begin + (level[range].end - level[range].begin) / 2;
+            int axis = axis_bins[range].axis;
+            std::nth_element(bin_begin, middle, bin_end, [axis](const triangle_info &tri_1, const triangle_info &tri_2) {
+                return centroidAxis(tri_1, axis) < centroidAxis(tri_2, axis);
+            });
+        });
+
+        next_level.clear();
+        for (size_t range = 0; range < level.size(); ++range) {
+            const BuildTask &task = level[range];
+            triangle_info *middle = splits[range].sah ? task.begin + splits[range].side_count[0]
+                                                      : task.begin + (task.end - task.begin) / 2;
+            NodeGL &node = bvh_nodes_[task.node];
+            node.triangle_offset = -1;
+            node.triangle_count = 0;
+            node.l_child_offset = task.node + 1;
+            node.r_child_offset = task.node + 2 * static_cast<int>(middle - task.begin);
+            for (const BuildTask &child : { BuildTask{ node.l_child_offset, task.begin, middle, task.depth + 1 },
+                                            BuildTask{ node.r_child_offset, middle, task.end, task.depth + 1 } }) {
+                if (static_cast<size_t>(child.end - child.begin) >= kParallelSplitMin) {
+                    next_level.push_back(child);
+                }
+                else {
+                    subtrees.push_back(child);
+                }
+            }
+        }
+        level.swap(next_level);
+    }
+}
+
+/**
+ * Split [begin, end) at the median centroid along the widest axis of the centroids.
+ * Only the median is put in place (everything before it is no greater, everything
+ * after no smaller), which is all the split needs and takes linear time.
+ * Returns the start of the right half.
+ */
+triangle_info * bvh::splitMidpoint(triangle_info *begin, triangle_info *end, const DimensionGL &centroid_box) {
+    int axis = widestAxis(centroid_box);
+    triangle_info *middle = begin + (end - begin) / 2;
+    std::nth_element(begin, middle, end, [axis](const triangle_info &tri_1, const triangle_info &tri_2) {
+        return centroidAxis(tri_1, axis) < centroidAxis(tri_2, axis);
+    });
+    return middle;
+}
+
+/**
+ * Split [begin, end) with the binned Surface Area Heuristic. The centroids are dropped
+ * into kSahBins equal bins along each axis and the boundary between bins with the lowest
+ * area * triangle count over both sides wins; the range is then partitioned in place.
+ * Returns the start of the right half, or nullptr if the centroids can't be separated
+ * so the caller can fall back to the median.
+ */
+triangle_info * bvh::splitSAH(triangle_info *begin, triangle_info *end, const DimensionGL &centroid_box) {
+    SahBins bins;
+    bins.add(begin, end, centroid_box);
+    int axis;
+    int split;
+    if (!bestSahSplit(bins, static_cast<int>(end - begin), axis, split)) {
+        return nullptr;
     }
-    else if (index == 1) {
-        // split on y
-        std::sort(in_tris.begin(), in_tris.end(), [](const triangle_info& tri_1, const triangle_info &tri_2) {
-            return tri_1.centroid_.y < tri_2.centroid_.y;
+    const AxisBins split_bins(centroid_box, axis, kSahBins);
+    return std::partition(begin, end, [split_bins, split](const triangle_info &tri) {
+        return split_bins.bin(tri) < split;
+    });
+}
+
+/**
+ * Build the spatial split tree over leaves, on this thread. Every node weighs the best
+ * binned SAH object split against the best spatial split, which is only looked for where
+ * the object split's children overlap by more than kSpatialSplitAlpha of the root's area
+ * and the budget of extra references isn't used up. A spatial split sends the references
+ * on either side of its plane to that side. A reference crossing the plane goes to the
+ * side where it costs least whole, or is clipped into one reference per side when that is
+ * cheaper. The nodes are made in depth first order as they are built, and leaves ends up
+ * holding the references in the order of the leaves, duplicates and all.
+ */
+void bvh::buildSpatialTree(std::vector<triangle_info> &leaves) {
+    auto points = [this](int tri, Point3D *p) {
+        const TriangleIndexGL &indices = mesh_.triangles[tri];
+        for (int corner = 0; corner < 3; ++corner) {
+            const float *pos = mesh_.vertices[corner == 0 ? indices.v1 : (corner == 1 ? indices.v2 : indices.v3)].pos;
+            p[corner] = Point3D(pos[0], pos[1], pos[2]);
+        }
+    };
+    DimensionGL root_box;
+    for (const triangle_info &leaf : leaves) {
+        growBox(root_box, leaf.AABB_);
+    }
+    const float min_overlap = kSpatialSplitAlpha * surfaceArea(root_box);
+    const size_t budget = static_cast<size_t>(std::max(spatial_budget_, 0.0f) * leaves.size());
+    // a range of references still to be built, and the node it is the right child of
+    struct SpatialTask {
+        std::vector<triangle_info> refs;
+        int parent;
+        int depth;
+    };
+    std::vector<triangle_info> ordered;
+    ordered.reserve(leaves.size() + budget);
+    std::vector<SpatialTask> tasks;
+    tasks.push_back({ std::move(leaves), -1, 0 });
+    std::vector<triangle_info> left, right;
+    while (!tasks.empty()) {
+        SpatialTask task = std::move(tasks.back());
+        tasks.pop_back();
+        std::vector<triangle_info> &refs = task.refs;
+        int index = static_cast<int>(bvh_nodes_.size());
+        if (task.parent != -1) {
+            bvh_nodes_[task.parent].r_child_offset = index;
+        }
+        NodeGL node;
+        DimensionGL centroid_box;
+        for (const triangle_info &ref : refs) {
+            growBox(node.AABB, ref.AABB_);
+            growBox(centroid_box, ref.centroid_);
+        }
+        const size_t count = refs.size();
+        triangle_info *begin = data(refs);
+        triangle_info *end = begin + count;
+        left.clear();
+        right.clear();
+        bool leaf = count == 1;
+        bool split = false;
+        if (!leaf && task.depth + balancedDepth(count, max_leaf_size_) < max_depth_) {
+            SahBins bins;
+            bins.add(begin, end, centroid_box);
+            int axis, bin;
+            float object_cost = INFINITY;
+            DimensionGL left_box, right_box;
+            bool object = bestSahSplit(bins, static_cast<int>(count), axis, bin, &object_cost);
+            if (object) {
+                for (int i = 0; i < kSahBins; ++i) {
+                    growBox(i < bin ? left_box : right_box, bins.box[axis][i]);
+                }
+            }
+            // the spatial split can only pay off where the object split's children overlap
+            SpatialSplit spatial;
+            DimensionGL overlap = boxOverlap(left_box, right_box);
+            if (spatial_references_ < budget && (!object || (!emptyBox(overlap) && surfaceArea(overlap) > min_overlap))) {
+                spatial = bestSpatialSplit(begin, end, node.AABB, points);
+            }
+            float split_cost = std::min(object_cost, spatial.cost);
+            if (split_cost < INFINITY) {
+                float area = surfaceArea(node.AABB);
+                leaf = count <= static_cast<size_t>(max_leaf_size_)
+                       && area * count * kSahIntersectCost <= area * kSahTraversalCost + split_cost * kSahIntersectCost;
+                if (!leaf && spatial.cost < object_cost) {
+                    // the references entirely on one side stay there, the rest are decided one by one
+                    DimensionGL side_box[2];
+                    std::vector<const triangle_info *> crossing;
+                    for (const triangle_info &ref : refs) {
+                        if (boxMax(ref.AABB_, spatial.axis) <= spatial.plane) {
+                            left.push_back(ref);
+                            growBox(side_box[0], ref.AABB_);
+                        }
+                        else if (boxMin(ref.AABB_, spatial.axis) >= spatial.plane) {
+                            right.push_back(ref);
+                            growBox(side_box[1], ref.AABB_);
+                        }
+                        else {
+                            crossing.push_back(&ref);
+                        }
+                    }
+                    size_t left_count = left.size() + crossing.size();
+                    size_t right_count = right.size() + crossing.size();
+                    for (const triangle_info *ref : crossing) {
+                        Point3D p[3];
+                        points(ref->tri_offset_, p);
+                        DimensionGL below = clipTriangle(p, spatial.axis, -INFINITY, spatial.plane, ref->AABB_);
+                        DimensionGL above = clipTriangle(p, spatial.axis, spatial.plane, INFINITY, ref->AABB_);
+                        DimensionGL split_left = side_box[0], split_right = side_box[1];
+                        growBox(split_left, below);
+                        growBox(split_right, above);
+                        DimensionGL whole_left = side_box[0], whole_right = side_box[1];
+                        growBox(whole_left, ref->AABB_);
+                        growBox(whole_right, ref->AABB_);
+                        float cost_split = surfaceArea(split_left) * left_count + surfaceArea(split_right) * right_count;
+                        float cost_left = surfaceArea(whole_left) * left_count + surfaceArea(side_box[1]) * (right_count - 1);
+                        float cost_right = surfaceArea(side_box[0]) * (left_count - 1) + surfaceArea(whole_right) * right_count;
+                        bool can_split = !emptyBox(below) && !emptyBox(above) && spatial_references_ < budget;
+                        if (can_split && cost_split < cost_left && cost_split < cost_right) {
+                            left.push_back(clippedReference(*ref, below));
+                            right.push_back(clippedReference(*ref, above));
+                            side_box[0] = split_left;
+                            side_box[1] = split_right;
+                            ++spatial_references_;
+                        }
+                        else if (cost_left <= cost_right) {
+                            left.push_back(*ref);
+                            side_box[0] = whole_left;
+                            --right_count;
+                        }
+                        else {
+                            right.push_back(*ref);
+                            side_box[1] = whole_right;
+                            --left_count;
+                        }
+                    }
+                    split = !left.empty() && !right.empty() && left.size() < count && right.size() < count;
+                    if (!split) {
+                        // the crossing references all went one way, so undo the duplicates
+                        spatial_references_ -= left.size() + right.size() - count;
+                        left.clear();
+                        right.clear();
+                    }
+                }
+                if (!leaf && !split && object) {
+                    const AxisBins split_bins(centroid_box, axis, kSahBins);
+                    for (const triangle_info &ref : refs) {
+                        (split_bins.bin(ref) < bin ? left : right).push_back(ref);
+                    }
+                    split = true;
+                }
+            }
+        }
+        if (!leaf && !split) {
+            // fall back to the median, which keeps the subtree shallow enough for the shader
+            triangle_info *middle = splitMidpoint(begin, end, centroid_box);
+            leaf = count <= static_cast<size_t>(max_leaf_size_)
+                   && (task.depth >= max_depth_ || leafIsCheaper(begin, middle, end, node.AABB));
+            if (!leaf) {
+                left.assign(begin, middle);
+                right.assign(middle, end);
+            }
+        }
+        if (leaf) {
+            makeLeaf(node, ordered.size(), count);
+            ordered.insert(ordered.end(), refs.begin(), refs.end());
+            bvh_nodes_.push_back(node);
+            continue;
+        }
+        node.triangle_offset = -1;
+        node.triangle_count = 0;
+        node.l_child_offset = index + 1;
+        bvh_nodes_.push_back(node);
+        refs = std::vector<triangle_info>();
+        // push the right range first so the left one is built next
+        tasks.push_back({ std::move(right), index, task.depth + 1 });
+        tasks.push_back({ std::move(left), -1, task.depth + 1 });
+        left = std::vector<triangle_info>();
+        right = std::vector<triangle_info>();
+    }
+    leaves.swap(ordered);
+}
+
+/**
+ * Remove the duplicate triangles spatial splits added, putting the mesh's triangles back
+ * in the order they were before the build. Triangles which were the same in the mesh
+ * stay, since only copies of the same triangle are dropped.
+ */
+void bvh::dropSpatialReferences() {
+    std::vector<TriangleIndexGL> triangles(mesh_.triangles.size() - spatial_references_);
+    for (size_t i = 0; i < reference_sources_.size(); ++i) {
+        triangles[reference_sources_[i]] = mesh_.triangles[i];
+    }
+    mesh_.triangles.swap(triangles);
+    reference_sources_.clear();
+    spatial_references_ = 0;
+}
+
+float bvh::sahCost() const {
+    if (bvh_nodes_.empty()) {
+        return 0.0f;
+    }
+    float root_area = surfaceArea(bvh_nodes_[0].AABB);
+    if (root_area <= 0.0f) {
+        return 0.0f;
+    }
+    // Every node is visited (its box is tested) with the probability that a ray through
+    // the root hits its parent's box, which for the SAH is taken as the ratio of areas.
+    // The triangles in a leaf are tested whenever the leaf's own box is hit.
+    double cost = kSahTraversalCost * root_area;
+    for (const NodeGL &node : bvh_nodes_) {
+        bool leaf = node.l_child_offset == -1 && node.r_child_offset == -1;
+        float area = surfaceArea(node.AABB);
+        if (leaf) {
+            cost += area * node.triangle_count * kSahIntersectCost;
+        }
+        else {
+            int children = (node.l_child_offset != -1) + (node.r_child_offset != -1);
+            cost += area * children * kSahTraversalCost;
+        }
+    }
+    return static_cast<float>(cost / root_area);
+}
+
+int leafDepthBound(size_t count, const BvhOptions &options) {
+    int max_leaf_size = std::min(std::max(options.max_leaf_size, 1), kMaxLeafSize);
+    int max_depth = std::min(std::max(options.max_depth, 1), kMaxLeafDepth);
+    return std::max(max_depth, balancedDepth(count, max_leaf_size));
+}
+
+int traversalStackSize(const NodeGL *nodes, size_t num_nodes) {
+    if (!num_nodes) {
+        return 0;
+    }
+    // every node, with the right children waiting on the stack when it is popped
+    std::vector<std::pair<int, int>> stack;
+    stack.emplace_back(0, 0);
+    int size = 1;
+    while (!stack.empty()) {
+        std::pair<int, int> entry = stack.back();
+        stack.pop_back();
+        const NodeGL &node = nodes[entry.first];
+        if (node.l_child_offset != -1 || node.r_child_offset != -1) {
+            size = std::max(size, entry.second + 2);
+            stack.emplace_back(node.r_child_offset, entry.second);
+            stack.emplace_back(node.l_child_offset, entry.second + 1);
+        }
+    }
+    return size;
+}
+
+BvhStats bvh::stats(int num_threads) const {
+    SceneBuffers buffers;
+    buffers.vertices = data(mesh_.vertices);
+    buffers.num_vertices = mesh_.vertices.size();
+    buffers.normals = data(mesh_.normals);
+    buffers.num_normals = mesh_.normals.size();
+    buffers.triangles = data(mesh_.triangles);
+    buffers.num_triangles = mesh_.triangles.size();
+    buffers.nodes = data(bvh_nodes_);
+    buffers.num_nodes = bvh_nodes_.size();
+    return measureBvh(buffers, num_threads);
+}
+
+bool bvh::refit(const std::vector<VertexGL> &vertices, const std::vector<VertexGL> &normals, BvhUpdate &update,
+                int num_threads) {
+    if (vertices.size() != mesh_.vertices.size() || (!normals.empty() && normals.size() != mesh_.normals.size())) {
+        std::cerr << "Couldn't refit the bvh: the mesh has " << mesh_.vertices.size() << " vertices and "
+                  << mesh_.normals.size() << " normals, not " << vertices.size() << " and " << normals.size() << std::endl;
+        return false;
+    }
+    if (num_threads <= 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    update = BvhUpdate();
+    if (built_sah_cost_ < 0.0f) {
+        // the first refit since the build, so the tree is still as it was built
+        built_sah_cost_ = sahCost();
+    }
+    update.vertices = changedRanges(vertices.size(), num_threads, [&](size_t i) {
+        return !samePoint(vertices[i], mesh_.vertices[i]);
+    });
+    mesh_.vertices = vertices;
+    if (!normals.empty()) {
+        update.normals = changedRanges(normals.size(), num_threads, [&](size_t i) {
+            return !samePoint(normals[i], mesh_.normals[i]);
         });
+        mesh_.normals = normals;
     }
-    else {
-        // split on z
-        std::sort(in_tris.begin(), in_tris.end(), [](const triangle_info& tri_1, const triangle_info &tri_2) {
-            return tri_1.centroid_.z < tri_2.centroid_.z;
+    if (bvh_nodes_.empty()) {
+        return true;
+    }
+
+    size_t num_nodes = bvh_nodes_.size();
+    size_t node_chunks = (num_nodes + kMortonChunk - 1) / kMortonChunk;
+    if (parents_.size() != num_nodes) {
+        parents_.assign(num_nodes, -1);
+        parallelFor(node_chunks, num_threads, [&](size_t chunk) {
+            size_t end = std::min(num_nodes, (chunk + 1) * kMortonChunk);
+            for (size_t i = chunk * kMortonChunk; i < end; ++i) {
+                const NodeGL &node = bvh_nodes_[i];
+                // the treelet layout's padding has no triangles and no children either
+                if (!node.triangle_count && node.l_child_offset != -1) {
+                    parents_[node.l_child_offset] = static_cast<int>(i);
+                    parents_[node.r_child_offset] = static_cast<int>(i);
+                }
+            }
         });
     }
+    // bound every leaf over its moved triangles, then climb from it to refit the inner nodes
+    std::vector<char> changed(num_nodes, 0);
+    std::vector<std::atomic<int>> arrived(num_nodes);
+    parallelFor(node_chunks, num_threads, [&](size_t chunk) {
+        size_t end = std::min(num_nodes, (chunk + 1) * kMortonChunk);
+        for (size_t i = chunk * kMortonChunk; i < end; ++i) {
+            NodeGL &node = bvh_nodes_[i];
+            if (!node.triangle_count) {
+                continue;
+            }
+            DimensionGL box;
+            for (int t = node.triangle_offset; t < node.triangle_offset + node.triangle_count; ++t) {
+                const TriangleIndexGL &tri = mesh_.triangles[t];
+                for (int v : { tri.v1, tri.v2, tri.v3 }) {
+                    const float *pos = mesh_.vertices[v].pos;
+                    growBox(box, Point3D(pos[0], pos[1], pos[2]));
+                }
+            }
+            changed[i] = !sameBox(box, node.AABB);
+            node.AABB = box;
+            boundAncestors(bvh_nodes_, parents_, arrived, static_cast<int>(i), &changed);
+        }
+    });
+    update.nodes = changedRanges(num_nodes, num_threads, [&](size_t i) { return changed[i] != 0; });
 
-    // now give half the leaves to each child
-    int half = in_tris.size() / 2;
-    bin_1 = std::vector<triangle_info>(in_tris.begin(), in_tris.begin() + half);
-    bin_2 = std::vector<triangle_info>(in_tris.begin() + half, in_tris.end());
+    update.sah_cost = sahCost();
+    update.built_sah_cost = built_sah_cost_;
+    if (rebuild_ratio_ > 0.0f && update.sah_cost > rebuild_ratio_ * built_sah_cost_) {
+        rebuild(num_threads, false);
+        built_sah_cost_ = sahCost();
+        update.rebuilt = true;
+        update.nodes.assign(1, BufferRange(0, bvh_nodes_.size()));
+        update.sah_cost = built_sah_cost_;
+        update.built_sah_cost = built_sah_cost_;
+    }
     return true;
-}
\ No newline at end of file
+}
+
+void bvh::rebuild(int num_threads, bool optimize) {
+    if (spatial_references_) {
+        dropSpatialReferences();
+    }
+    std::vector<triangle_info> leaves = boundTriangles();
+    build(leaves, num_threads, optimize ? optimize_seconds_ : 0.0f);
+}
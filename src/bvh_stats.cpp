@@ -0,0 +1,272 @@
+#include "bvh_stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+#include <tuple>
+#include <utility>
+
+#include "bvh.h"
+#include "parallel.h"
+
+namespace {
+
+// triangles clipped per task while measuring the EPO
+const size_t kEpoChunk = 1024;
+
+bool isLeaf(const NodeGL &node) {
+    return node.l_child_offset == -1 && node.r_child_offset == -1;
+}
+
+double surfaceArea(const DimensionGL &box) {
+    double dx = box.max_x - box.min_x;
+    double dy = box.max_y - box.min_y;
+    double dz = box.max_z - box.min_z;
+    if (dx < 0.0 || dy < 0.0 || dz < 0.0) {
+        return 0.0;
+    }
+    return 2.0 * (dx * dy + dy * dz + dz * dx);
+}
+
+DimensionGL intersectBoxes(const DimensionGL &a, const DimensionGL &b) {
+    DimensionGL box;
+    box.min_x = std::max(a.min_x, b.min_x);
+    box.min_y = std::max(a.min_y, b.min_y);
+    box.min_z = std::max(a.min_z, b.min_z);
+    box.max_x = std::min(a.max_x, b.max_x);
+    box.max_y = std::min(a.max_y, b.max_y);
+    box.max_z = std::min(a.max_z, b.max_z);
+    return box;
+}
+
+/**
+ * A convex polygon in 3D, big enough for a triangle clipped by the six planes of a box
+ */
+struct Polygon {
+    float points[9][3];
+    int count = 0;
+};
+
+/**
+ * Keep the part of polygon on the side of the plane at offset along axis which sign
+ * points away from (sign 1 keeps the low side, -1 the high side)
+ */
+Polygon clipPolygon(const Polygon &polygon, int axis, float offset, float sign) {
+    Polygon clipped;
+    for (int i = 0; i < polygon.count; ++i) {
+        const float *a = polygon.points[i];
+        const float *b = polygon.points[(i + 1) % polygon.count];
+        float da = sign * (a[axis] - offset);
+        float db = sign * (b[axis] - offset);
+        if (da <= 0.0f) {
+            std::copy(a, a + 3, clipped.points[clipped.count++]);
+        }
+        if ((da < 0.0f && db > 0.0f) || (da > 0.0f && db < 0.0f)) {
+            float t = da / (da - db);
+            float *point = clipped.points[clipped.count++];
+            for (int k = 0; k < 3; ++k) {
+                point[k] = a[k] + t * (b[k] - a[k]);
+            }
+        }
+    }
+    return clipped;
+}
+
+double polygonArea(const Polygon &polygon) {
+    double sum[3] = { 0.0, 0.0, 0.0 };
+    const float *p0 = polygon.points[0];
+    for (int i = 1; i + 1 < polygon.count; ++i) {
+        const float *p1 = polygon.points[i];
+        const float *p2 = polygon.points[i + 1];
+        double e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+        double e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+        sum[0] += e1[1] * e2[2] - e1[2] * e2[1];
+        sum[1] += e1[2] * e2[0] - e1[0] * e2[2];
+        sum[2] += e1[0] * e2[1] - e1[1] * e2[0];
+    }
+    return 0.5 * std::sqrt(sum[0] * sum[0] + sum[1] * sum[1] + sum[2] * sum[2]);
+}
+
+/**
+ * The area of the part of triangle inside box
+ */
+double clippedArea(const Polygon &triangle, const DimensionGL &box) {
+    const float low[3] = { box.min_x, box.min_y, box.min_z };
+    const float high[3] = { box.max_x, box.max_y, box.max_z };
+    Polygon clipped = triangle;
+    for (int axis = 0; axis < 3 && clipped.count >= 3; ++axis) {
+        clipped = clipPolygon(clipped, axis, high[axis], 1.0f);
+        if (clipped.count >= 3) {
+            clipped = clipPolygon(clipped, axis, low[axis], -1.0f);
+        }
+    }
+    return clipped.count >= 3 ? polygonArea(clipped) : 0.0;
+}
+
+bool boxesOverlap(const DimensionGL &a, const DimensionGL &b) {
+    return a.min_x <= b.max_x && b.min_x <= a.max_x && a.min_y <= b.max_y && b.min_y <= a.max_y
+           && a.min_z <= b.max_z && b.min_z <= a.max_z;
+}
+
+}  // namespace
+
+BvhStats measureBvh(const SceneBuffers &buffers, int num_threads) {
+    BvhStats stats;
+    stats.nodes = buffers.num_nodes;
+    stats.node_bytes = buffers.num_nodes * sizeof(NodeGL);
+    stats.triangle_bytes = buffers.num_triangles * sizeof(TriangleIndexGL);
+    stats.vertex_bytes = buffers.num_vertices * sizeof(VertexGL);
+    stats.normal_bytes = buffers.num_normals * sizeof(VertexGL);
+    if (!buffers.num_nodes) {
+        return stats;
+    }
+    if (num_threads <= 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    const NodeGL *nodes = buffers.nodes;
+    double root_area = surfaceArea(nodes[0].AABB);
+
+    // Walk the tree once for the depths, the counts and the overlap, and note the range of
+    // triangles under every node. The leaves are stored depth first like their triangles,
+    // so every subtree's triangles are one range.
+    std::vector<std::pair<int, int>> ranges(buffers.num_nodes, std::make_pair(0, 0));
+    std::vector<int> parents(buffers.num_nodes, -1);
+    std::vector<std::pair<int, int>> stack;
+    stack.emplace_back(0, 0);
+    double depth_sum = 0.0;
+    double cost = root_area * kSahTraversalCost;
+    while (!stack.empty()) {
+        std::pair<int, int> entry = stack.back();
+        stack.pop_back();
+        const NodeGL &node = nodes[entry.first];
+        double area = surfaceArea(node.AABB);
+        if (isLeaf(node)) {
+            ++stats.leaves;
+            stats.triangles += node.triangle_count;
+            if (stats.leaf_sizes.size() <= static_cast<size_t>(node.triangle_count)) {
+                stats.leaf_sizes.resize(node.triangle_count + 1, 0);
+            }
+            ++stats.leaf_sizes[node.triangle_count];
+            stats.max_depth = std::max(stats.max_depth, entry.second);
+            depth_sum += entry.second;
+            cost += area * node.triangle_count * kSahIntersectCost;
+            ranges[entry.first] = std::make_pair(node.triangle_offset, node.triangle_offset + node.triangle_count);
+            // widen the ancestors' ranges to cover the leaf
+            for (int parent = parents[entry.first]; parent != -1; parent = parents[parent]) {
+                std::pair<int, int> &range = ranges[parent];
+                range.first = std::min(range.first, node.triangle_offset);
+                range.second = std::max(range.second, node.triangle_offset + node.triangle_count);
+            }
+            continue;
+        }
+        ++stats.inner_nodes;
+        cost += area * 2 * kSahTraversalCost;
+        stats.child_overlap += surfaceArea(intersectBoxes(nodes[node.l_child_offset].AABB,
+                                                          nodes[node.r_child_offset].AABB));
+        ranges[entry.first] = std::make_pair(INT32_MAX, INT32_MIN);
+        parents[node.l_child_offset] = entry.first;
+        parents[node.r_child_offset] = entry.first;
+        stack.emplace_back(node.r_child_offset, entry.second + 1);
+        stack.emplace_back(node.l_child_offset, entry.second + 1);
+    }
+    stats.average_depth = stats.leaves ? depth_sum / stats.leaves : 0.0;
+    stats.stack_size = traversalStackSize(nodes, buffers.num_nodes);
+    if (root_area > 0.0) {
+        stats.sah_cost = cost / root_area;
+        stats.child_overlap /= root_area;
+    }
+
+    // Spatial splits leave copies of a triangle in several leaves, and a node is only
+    // overlapped by the triangle if none of them are under it, so gather the copies.
+    // copies holds every triangle's slots, grouped by the triangle, and groups the start
+    // of every group.
+    std::vector<int> copies(buffers.num_triangles);
+    for (size_t t = 0; t < buffers.num_triangles; ++t) {
+        copies[t] = static_cast<int>(t);
+    }
+    auto corners = [&](int t) {
+        const TriangleIndexGL &tri = buffers.triangles[t];
+        return std::make_tuple(tri.v1, tri.v2, tri.v3, tri.mat);
+    };
+    std::sort(copies.begin(), copies.end(), [&](int a, int b) {
+        return corners(a) < corners(b) || (corners(a) == corners(b) && a < b);
+    });
+    std::vector<size_t> groups;
+    for (size_t i = 0; i < copies.size(); ++i) {
+        if (!i || corners(copies[i]) != corners(copies[i - 1])) {
+            groups.push_back(i);
+        }
+    }
+    groups.push_back(copies.size());
+
+    // Clip every triangle against the boxes it overlaps but isn't under. Each chunk sums
+    // on its own, so the total doesn't depend on the threads.
+    size_t num_groups = groups.size() - 1;
+    size_t num_chunks = (num_groups + kEpoChunk - 1) / kEpoChunk;
+    std::vector<double> chunk_epo(num_chunks, 0.0);
+    std::vector<double> chunk_area(num_chunks, 0.0);
+    parallelFor(num_chunks, num_threads, [&](size_t chunk) {
+        std::vector<int> visit;
+        size_t end = std::min(num_groups, (chunk + 1) * kEpoChunk);
+        for (size_t group = chunk * kEpoChunk; group < end; ++group) {
+            const int *first = &copies[groups[group]];
+            const int *last = first + (groups[group + 1] - groups[group]);
+            const TriangleIndexGL &tri = buffers.triangles[*first];
+            Polygon triangle;
+            DimensionGL bounds;
+            for (int v : { tri.v1, tri.v2, tri.v3 }) {
+                const float *pos = buffers.vertices[v].pos;
+                std::copy(pos, pos + 3, triangle.points[triangle.count++]);
+                bounds.min_x = std::min(bounds.min_x, pos[0]);
+                bounds.min_y = std::min(bounds.min_y, pos[1]);
+                bounds.min_z = std::min(bounds.min_z, pos[2]);
+                bounds.max_x = std::max(bounds.max_x, pos[0]);
+                bounds.max_y = std::max(bounds.max_y, pos[1]);
+                bounds.max_z = std::max(bounds.max_z, pos[2]);
+            }
+            chunk_area[chunk] += polygonArea(triangle);
+            visit.assign(1, 0);
+            while (!visit.empty()) {
+                int index = visit.back();
+                visit.pop_back();
+                const NodeGL &node = nodes[index];
+                if (!boxesOverlap(node.AABB, bounds)) {
+                    continue;
+                }
+                const std::pair<int, int> &range = ranges[index];
+                bool under = std::any_of(first, last, [&](int t) { return t >= range.first && t < range.second; });
+                if (!under) {
+                    double weight = isLeaf(node) ? node.triangle_count * kSahIntersectCost : kSahTraversalCost;
+                    chunk_epo[chunk] += weight * clippedArea(triangle, node.AABB);
+                }
+                if (!isLeaf(node)) {
+                    visit.push_back(node.r_child_offset);
+                    visit.push_back(node.l_child_offset);
+                }
+            }
+        }
+    });
+    double epo = 0.0;
+    double total_area = 0.0;
+    for (size_t chunk = 0; chunk < num_chunks; ++chunk) {
+        epo += chunk_epo[chunk];
+        total_area += chunk_area[chunk];
+    }
+    stats.epo = total_area > 0.0 ? epo / total_area : 0.0;
+    return stats;
+}
+
+void writeJson(std::ostream &out, const BvhStats &stats) {
+    out << "{\"nodes\": " << stats.nodes << ", \"inner_nodes\": " << stats.inner_nodes << ", \"leaves\": "
+        << stats.leaves << ", \"triangles\": " << stats.triangles << ", \"leaf_sizes\": [";
+    for (size_t i = 0; i < stats.leaf_sizes.size(); ++i) {
+        out << (i ? ", " : "") << stats.leaf_sizes[i];
+    }
+    out << "], \"max_depth\": " << stats.max_depth << ", \"average_depth\": " << stats.average_depth
+        << ", \"stack_size\": " << stats.stack_size << ", \"sah_cost\": " << stats.sah_cost
+        << ", \"child_overlap\": " << stats.child_overlap << ", \"epo\": " << stats.epo << ", \"node_bytes\": "
+        << stats.node_bytes << ", \"triangle_bytes\": " << stats.triangle_bytes << ", \"vertex_bytes\": "
+        << stats.vertex_bytes << ", \"normal_bytes\": " << stats.normal_bytes << ", \"total_bytes\": "
+        << stats.totalBytes() << "}";
+}
@@ -0,0 +1,184 @@
+#include "instancing.h"
+
+#include <algorithm>
+
+#include "motor.h"
+
+namespace {
+
+/**
+ * The world box of a mesh whose own box is box, placed by motor: the box around its
+ * eight moved corners
+ */
+DimensionGL instanceBox(const DimensionGL &box, const Motor3D &motor) {
+    DimensionGL moved;
+    for (int corner = 0; corner < 8; ++corner) {
+        Point3D point(corner & 1 ? box.max_x : box.min_x, corner & 2 ? box.max_y : box.min_y,
+                      corner & 4 ? box.max_z : box.min_z);
+        point = motorPoint(motor, point);
+        moved.min_x = std::min(moved.min_x, point.x);
+        moved.min_y = std::min(moved.min_y, point.y);
+        moved.min_z = std::min(moved.min_z, point.z);
+        moved.max_x = std::max(moved.max_x, point.x);
+        moved.max_y = std::max(moved.max_y, point.y);
+        moved.max_z = std::max(moved.max_z, point.z);
+    }
+    return moved;
+}
+
+}  // namespace
+
+TwoLevelBvh::TwoLevelBvh(bvh &scene_bvh, SceneData &scene, const BvhOptions &options)
+    : top_level_options_(options) {
+    // one instance per top level leaf, so the top level always has 2n - 1 nodes. It is
+    // rebuilt every time an instance moves, so it isn't optimized, and it isn't laid out
+    // in treelets, whose padding would take more than those 2n - 1 nodes
+    top_level_options_.max_leaf_size = 1;
+    top_level_options_.optimize_seconds = 0.0f;
+    top_level_options_.treelet_nodes = 0;
+    int num_nodes;
+    scene_bvh.getCompact(num_nodes);
+    if (num_nodes) {
+        instances_.push_back({ 0, Motor3D() });
+    }
+    // Which meshes have triangles is only known once they are built, so the top level's
+    // room is reserved afterwards
+    // Every mesh, scene_bvh's too, gets its share of the triangles of one optimization budget
+    size_t all_triangles = scene_bvh.getMesh().triangles.size() - scene_bvh.spatialReferences();
+    for (const TriangleMesh &mesh : scene.instance_meshes) {
+        all_triangles += mesh.triangles.size();
+    }
+    std::vector<bvh> meshes;
+    meshes.reserve(scene.instance_meshes.size());
+    for (TriangleMesh &mesh : scene.instance_meshes) {
+        BvhOptions mesh_options = options;
+        mesh_options.optimize_seconds = all_triangles ? options.optimize_seconds * mesh.triangles.size() / all_triangles
+                                                      : 0.0f;
+        meshes.emplace_back(mesh, mesh_options);
+    }
+    int first_mesh = num_nodes ? 1 : 0;
+    for (const SceneInstance &instance : scene.instances) {
+        int mesh_nodes;
+        meshes[instance.mesh].getCompact(mesh_nodes);
+        if (!mesh_nodes) {
+            scene_instances_.push_back(-1);
+            continue;
+        }
+        scene_instances_.push_back(static_cast<int>(instances_.size()));
+        instances_.push_back({ first_mesh + instance.mesh, instance.motor });
+    }
+    top_level_nodes_ = instances_.empty() ? 0 : 2 * instances_.size() - 1;
+    nodes_.resize(top_level_nodes_);
+    if (num_nodes) {
+        appendMesh(scene_bvh);
+    }
+    for (bvh &mesh_bvh : meshes) {
+        appendMesh(mesh_bvh);
+    }
+    scene.instance_meshes.clear();
+    buildTopLevel();
+}
+
+/**
+ * Copy a bottom level bvh and its mesh onto the end of the combined buffers
+ */
+void TwoLevelBvh::appendMesh(bvh &mesh_bvh) {
+    int num_nodes;
+    const NodeGL *nodes = mesh_bvh.getCompact(num_nodes);
+    const TriangleMesh &mesh = mesh_bvh.getMesh();
+    mesh_stack_size_ = std::max(mesh_stack_size_, mesh_bvh.stackSize());
+    const int node_base = static_cast<int>(nodes_.size());
+    const int triangle_base = static_cast<int>(triangles_.size());
+    const int vertex_base = static_cast<int>(vertices_.size());
+    const int normal_base = static_cast<int>(normals_.size());
+    mesh_roots_.push_back(num_nodes ? node_base : -1);
+    mesh_boxes_.push_back(num_nodes ? nodes[0].AABB : DimensionGL());
+
+    vertices_.insert(vertices_.end(), mesh.vertices.begin(), mesh.vertices.end());
+    normals_.insert(normals_.end(), mesh.normals.begin(), mesh.normals.end());
+    for (TriangleIndexGL tri : mesh.triangles) {
+        tri.v1 += vertex_base;
+        tri.v2 += vertex_base;
+        tri.v3 += vertex_base;
+        if (tri.n1 >= 0) {
+            tri.n1 += normal_base;
+            tri.n2 += normal_base;
+            tri.n3 += normal_base;
+        }
+        triangles_.push_back(tri);
+    }
+    for (int i = 0; i < num_nodes; ++i) {
+        NodeGL node = nodes[i];
+        if (node.l_child_offset == -1 && node.r_child_offset == -1) {
+            node.triangle_offset += triangle_base;
+        }
+        else {
+            node.l_child_offset += node_base;
+            node.r_child_offset += node_base;
+        }
+        nodes_.push_back(node);
+    }
+}
+
+int TwoLevelBvh::stackSize() const {
+    // An inner node needs its ancestors' waiting right children plus its own two. Each of
+    // those covers an instance of its own, so no top level over n instances needs more than
+    // n, and no inner node is deeper than leafDepthBound - 1
+    int top_level = std::min(static_cast<int>(instances_.size()),
+                             leafDepthBound(instances_.size(), top_level_options_) + 1);
+    return top_level + mesh_stack_size_;
+}
+
+void TwoLevelBvh::moveInstance(int instance, const Motor3D &motor) {
+    int placed = scene_instances_[instance];
+    if (placed != -1) {
+        instances_[placed].motor = motor;
+    }
+}
+
+void TwoLevelBvh::buildTopLevel() {
+    if (instances_.empty()) {
+        return;
+    }
+    std::vector<triangle_info> leaves(instances_.size());
+    for (size_t i = 0; i < instances_.size(); ++i) {
+        triangle_info &leaf = leaves[i];
+        leaf.AABB_ = instanceBox(mesh_boxes_[instances_[i].mesh], instances_[i].motor);
+        leaf.centroid_ = Point3D((leaf.AABB_.min_x + leaf.AABB_.max_x) * .5f, (leaf.AABB_.min_y + leaf.AABB_.max_y) * .5f,
+                                 (leaf.AABB_.min_z + leaf.AABB_.max_z) * .5f);
+        leaf.tri_offset_ = static_cast<int>(i);
+    }
+    bvh top_level(leaves, top_level_options_);
+    int num_nodes;
+    const NodeGL *nodes = top_level.getCompact(num_nodes);
+    std::copy(nodes, nodes + num_nodes, nodes_.begin());
+    // the leaves are in the order their ranges index, so the instances follow them
+    gpu_instances_.resize(leaves.size());
+    for (size_t i = 0; i < leaves.size(); ++i) {
+        const Instance &instance = instances_[leaves[i].tri_offset_];
+        const Motor3D &motor = instance.motor;
+        InstanceGL &gpu = gpu_instances_[i];
+        gpu.rotation[0] = motor.s;
+        gpu.rotation[1] = motor.yz;
+        gpu.rotation[2] = motor.zx;
+        gpu.rotation[3] = motor.xy;
+        gpu.translation[0] = motor.wx;
+        gpu.translation[1] = motor.wy;
+        gpu.translation[2] = motor.wz;
+        gpu.translation[3] = motor.wxyz;
+        gpu.root = mesh_roots_[instance.mesh];
+    }
+}
+
+SceneBuffers TwoLevelBvh::buffers() const {
+    SceneBuffers buffers;
+    buffers.vertices = vertices_.data();
+    buffers.num_vertices = vertices_.size();
+    buffers.normals = normals_.data();
+    buffers.num_normals = normals_.size();
+    buffers.triangles = triangles_.data();
+    buffers.num_triangles = triangles_.size();
+    buffers.nodes = nodes_.data();
+    buffers.num_nodes = nodes_.size();
+    return buffers;
+}
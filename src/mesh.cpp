@@ -0,0 +1,215 @@
+#include "mesh.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "PGA_3D.h"
+
+namespace {
+
+/**
+ * PointKey - the exact bit pattern of a point. -0 and 0 are kept apart on purpose: a
+ * reflected ray built from either can end up with 1 / dir of +inf or -inf.
+ */
+struct PointKey {
+    uint32_t bits[3];
+    bool operator==(const PointKey &other) const {
+        return bits[0] == other.bits[0] && bits[1] == other.bits[1] && bits[2] == other.bits[2];
+    }
+};
+
+/**
+ * TriangleKey - the corners of a triangle sorted by (vertex, normal), so the same
+ * triangle matches whichever corner it starts at and whichever way it winds. The shader
+ * flips normals towards the ray, so winding doesn't change how a triangle looks.
+ */
+struct TriangleKey {
+    int corners[6];
+    int mat;
+    bool operator==(const TriangleKey &other) const {
+        return mat == other.mat && !memcmp(corners, other.corners, sizeof(corners));
+    }
+};
+
+inline uint64_t hashMix(uint64_t hash, uint64_t value) {
+    hash ^= value + 0x9E3779B97F4A7C15ull + (hash << 6) + (hash >> 2);
+    return hash * 0xFF51AFD7ED558CCDull;
+}
+
+struct PointKeyHash {
+    size_t operator()(const PointKey &key) const {
+        return static_cast<size_t>(hashMix(hashMix(hashMix(0, key.bits[0]), key.bits[1]), key.bits[2]));
+    }
+};
+
+struct TriangleKeyHash {
+    size_t operator()(const TriangleKey &key) const {
+        uint64_t hash = static_cast<uint32_t>(key.mat);
+        for (int corner : key.corners) {
+            hash = hashMix(hash, static_cast<uint32_t>(corner));
+        }
+        return static_cast<size_t>(hash);
+    }
+};
+
+PointKey pointKey(const VertexGL &point) {
+    PointKey key;
+    memcpy(key.bits, point.pos, sizeof(key.bits));
+    return key;
+}
+
+TriangleKey triangleKey(const TriangleIndexGL &tri) {
+    std::pair<int, int> corners[3] = { { tri.v1, tri.n1 }, { tri.v2, tri.n2 }, { tri.v3, tri.n3 } };
+    std::sort(corners, corners + 3);
+    TriangleKey key;
+    for (int i = 0; i < 3; ++i) {
+        key.corners[2 * i] = corners[i].first;
+        key.corners[2 * i + 1] = corners[i].second;
+    }
+    key.mat = tri.mat;
+    return key;
+}
+
+/**
+ * Merge points with identical coordinates, keeping the first of each in its original
+ * order. remap receives the new index of every old point. Returns how many were merged.
+ */
+size_t weldPoints(std::vector<VertexGL> &points, std::vector<int> &remap) {
+    std::unordered_map<PointKey, int, PointKeyHash> unique;
+    unique.reserve(points.size());
+    remap.resize(points.size());
+    size_t kept = 0;
+    for (size_t i = 0; i < points.size(); ++i) {
+        auto found = unique.emplace(pointKey(points[i]), static_cast<int>(kept));
+        if (found.second) {
+            points[kept++] = points[i];
+        }
+        remap[i] = found.first->second;
+    }
+    size_t welded = points.size() - kept;
+    points.resize(kept);
+    return welded;
+}
+
+/**
+ * Remove the points which none of the given triangle corners refer to and renumber the
+ * corners. Negative (flat shaded normal) corners are left alone. Returns how many were removed.
+ */
+size_t removeUnused(std::vector<VertexGL> &points, std::vector<TriangleIndexGL> &triangles, int TriangleIndexGL::*const corners[3]) {
+    std::vector<int> remap(points.size(), -1);
+    for (const TriangleIndexGL &tri : triangles) {
+        for (int c = 0; c < 3; ++c) {
+            if (tri.*corners[c] >= 0) {
+                remap[tri.*corners[c]] = 0;
+            }
+        }
+    }
+    int kept = 0;
+    for (size_t i = 0; i < points.size(); ++i) {
+        if (remap[i] == 0) {
+            points[kept] = points[i];
+            remap[i] = kept++;
+        }
+    }
+    for (TriangleIndexGL &tri : triangles) {
+        for (int c = 0; c < 3; ++c) {
+            if (tri.*corners[c] >= 0) {
+                tri.*corners[c] = remap[tri.*corners[c]];
+            }
+        }
+    }
+    size_t removed = points.size() - kept;
+    points.resize(kept);
+    return removed;
+}
+
+/**
+ * True if the triangle's plane normal, computed the way the shader does, is exactly zero
+ */
+bool zeroArea(const float *p1, const float *p2, const float *p3) {
+    float e1[3] = { p3[0] - p1[0], p3[1] - p1[1], p3[2] - p1[2] };
+    float e2[3] = { p2[0] - p1[0], p2[1] - p1[1], p2[2] - p1[2] };
+    return e1[1] * e2[2] - e1[2] * e2[1] == 0.0f &&
+           e1[2] * e2[0] - e1[0] * e2[2] == 0.0f &&
+           e1[0] * e2[1] - e1[1] * e2[0] == 0.0f;
+}
+
+}  // namespace
+
+void faceNormal(const float *p1, const float *p2, const float *p3, float *norm) {
+    Dir3D face = cross(Point3D(p2[0], p2[1], p2[2]) - Point3D(p1[0], p1[1], p1[2]),
+                       Point3D(p3[0], p3[1], p3[2]) - Point3D(p1[0], p1[1], p1[2]));
+    face = face.normalized();
+    norm[0] = face.x;
+    norm[1] = face.y;
+    norm[2] = face.z;
+}
+
+void expandTriangles(const VertexGL *vertices, const VertexGL *normals, const TriangleIndexGL *triangles,
+                     size_t num_triangles, std::vector<TriangleGL> &expanded) {
+    expanded.resize(num_triangles);
+    for (size_t i = 0; i < num_triangles; ++i) {
+        const TriangleIndexGL &tri = triangles[i];
+        TriangleGL &new_tri = expanded[i];
+        // Find the corresponding vertices in the vertex array and add them to the triangle
+        memcpy(new_tri.p1, vertices[tri.v1].pos, 3 * sizeof(float));
+        memcpy(new_tri.p2, vertices[tri.v2].pos, 3 * sizeof(float));
+        memcpy(new_tri.p3, vertices[tri.v3].pos, 3 * sizeof(float));
+        if (tri.n1 < 0) {
+            // Add the face normal to each vertex
+            float norm[3];
+            faceNormal(new_tri.p1, new_tri.p2, new_tri.p3, norm);
+            memcpy(new_tri.n1, norm, 3 * sizeof(float));
+            memcpy(new_tri.n2, norm, 3 * sizeof(float));
+            memcpy(new_tri.n3, norm, 3 * sizeof(float));
+        }
+        else {
+            memcpy(new_tri.n1, normals[tri.n1].pos, 3 * sizeof(float));
+            memcpy(new_tri.n2, normals[tri.n2].pos, 3 * sizeof(float));
+            memcpy(new_tri.n3, normals[tri.n3].pos, 3 * sizeof(float));
+        }
+        new_tri.mat = tri.mat;
+    }
+}
+
+MeshCleanStats cleanMesh(TriangleMesh &mesh) {
+    MeshCleanStats stats;
+    std::vector<int> vert_remap, norm_remap;
+    stats.welded_vertices = weldPoints(mesh.vertices, vert_remap);
+    stats.welded_normals = weldPoints(mesh.normals, norm_remap);
+
+    std::unordered_set<TriangleKey, TriangleKeyHash> seen;
+    seen.reserve(mesh.triangles.size());
+    size_t kept = 0;
+    for (size_t i = 0; i < mesh.triangles.size(); ++i) {
+        TriangleIndexGL tri = mesh.triangles[i];
+        tri.v1 = vert_remap[tri.v1];
+        tri.v2 = vert_remap[tri.v2];
+        tri.v3 = vert_remap[tri.v3];
+        if (tri.n1 >= 0) {
+            tri.n1 = norm_remap[tri.n1];
+            tri.n2 = norm_remap[tri.n2];
+            tri.n3 = norm_remap[tri.n3];
+        }
+        if (tri.v1 == tri.v2 || tri.v2 == tri.v3 || tri.v1 == tri.v3 ||
+            zeroArea(mesh.vertices[tri.v1].pos, mesh.vertices[tri.v2].pos, mesh.vertices[tri.v3].pos)) {
+            ++stats.degenerate_triangles;
+            continue;
+        }
+        if (!seen.insert(triangleKey(tri)).second) {
+            ++stats.duplicate_triangles;
+            continue;
+        }
+        mesh.triangles[kept++] = tri;
+    }
+    mesh.triangles.resize(kept);
+
+    static int TriangleIndexGL::*const vert_corners[3] = { &TriangleIndexGL::v1, &TriangleIndexGL::v2, &TriangleIndexGL::v3 };
+    static int TriangleIndexGL::*const norm_corners[3] = { &TriangleIndexGL::n1, &TriangleIndexGL::n2, &TriangleIndexGL::n3 };
+    stats.unused_vertices = removeUnused(mesh.vertices, mesh.triangles, vert_corners);
+    stats.unused_normals = removeUnused(mesh.normals, mesh.triangles, norm_corners);
+    return stats;
+}
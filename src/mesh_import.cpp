@@ -0,0 +1,695 @@
+#include "mesh_import.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+#include "mapped_file.h"
+#include "parallel.h"
+#include "scanner.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Scalar types which can appear in a PLY header
+enum PlyType {
+    PLY_INVALID,
+    PLY_INT8,
+    PLY_UINT8,
+    PLY_INT16,
+    PLY_UINT16,
+    PLY_INT32,
+    PLY_UINT32,
+    PLY_FLOAT32,
+    PLY_FLOAT64
+};
+
+PlyType plyType(const std::string &name) {
+    if (name == "char" || name == "int8") return PLY_INT8;
+    if (name == "uchar" || name == "uint8") return PLY_UINT8;
+    if (name == "short" || name == "int16") return PLY_INT16;
+    if (name == "ushort" || name == "uint16") return PLY_UINT16;
+    if (name == "int" || name == "int32") return PLY_INT32;
+    if (name == "uint" || name == "uint32") return PLY_UINT32;
+    if (name == "float" || name == "float32") return PLY_FLOAT32;
+    if (name == "double" || name == "float64") return PLY_FLOAT64;
+    return PLY_INVALID;
+}
+
+size_t plySize(PlyType type) {
+    switch (type) {
+        case PLY_INT8:
+        case PLY_UINT8:
+            return 1;
+        case PLY_INT16:
+        case PLY_UINT16:
+            return 2;
+        case PLY_INT32:
+        case PLY_UINT32:
+        case PLY_FLOAT32:
+            return 4;
+        case PLY_FLOAT64:
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Read one little endian scalar of the given type. The caller checks the bounds.
+ */
+double plyValue(const char *p, PlyType type) {
+    switch (type) {
+        case PLY_INT8: { int8_t v; memcpy(&v, p, 1); return v; }
+        case PLY_UINT8: { uint8_t v; memcpy(&v, p, 1); return v; }
+        case PLY_INT16: { int16_t v; memcpy(&v, p, 2); return v; }
+        case PLY_UINT16: { uint16_t v; memcpy(&v, p, 2); return v; }
+        case PLY_INT32: { int32_t v; memcpy(&v, p, 4); return v; }
+        case PLY_UINT32: { uint32_t v; memcpy(&v, p, 4); return v; }
+        case PLY_FLOAT32: { float v; memcpy(&v, p, 4); return v; }
+        case PLY_FLOAT64: { double v; memcpy(&v, p, 8); return v; }
+        default: return 0.0;
+    }
+}
+
+struct PlyProperty {
+    std::string name;
+    PlyType type = PLY_INVALID;
+    // list properties store a count of count_type followed by that many values of type
+    bool is_list = false;
+    PlyType count_type = PLY_INVALID;
+    // byte offset inside a row, only meaningful while every property before it is fixed size
+    size_t offset = 0;
+};
+
+struct PlyElement {
+    std::string name;
+    size_t count = 0;
+    std::vector<PlyProperty> props;
+    // bytes per row, or 0 if the element has list properties
+    size_t stride = 0;
+
+    int find(const char *prop_name) const {
+        for (size_t i = 0; i < props.size(); ++i) {
+            if (props[i].name == prop_name) {
+                return static_cast<int>(i);
+            }
+        }
+        return -1;
+    }
+};
+
+/**
+ * Parse the ASCII header at the start of a PLY file. header_size is set to the offset
+ * of the binary body.
+ */
+bool parsePlyHeader(const char *data, size_t size, std::vector<PlyElement> &elements, size_t &header_size, std::string &error) {
+    const char end_marker[] = "end_header";
+    const char *end = data + size;
+    if (size < 4 || memcmp(data, "ply", 3) || (data[3] != '\n' && data[3] != '\r')) {
+        error = "not a PLY file";
+        return false;
+    }
+    const char *line = data;
+    bool found_format = false;
+    while (line < end) {
+        const char *nl = static_cast<const char *>(memchr(line, '\n', end - line));
+        if (!nl) {
+            break;
+        }
+        std::istringstream words(std::string(line, nl));
+        line = nl + 1;
+        std::string keyword;
+        words >> keyword;
+        if (keyword == "format") {
+            std::string format;
+            words >> format;
+            if (format != "binary_little_endian") {
+                error = "only binary_little_endian PLY files are supported, not " + format;
+                return false;
+            }
+            found_format = true;
+        }
+        else if (keyword == "element") {
+            PlyElement element;
+            words >> element.name >> element.count;
+            elements.push_back(element);
+        }
+        else if (keyword == "property") {
+            if (elements.empty()) {
+                error = "property outside of an element";
+                return false;
+            }
+            PlyProperty prop;
+            std::string type;
+            words >> type;
+            if (type == "list") {
+                std::string count_type;
+                words >> count_type >> type;
+                prop.is_list = true;
+                prop.count_type = plyType(count_type);
+                if (prop.count_type == PLY_INVALID || prop.count_type == PLY_FLOAT32 || prop.count_type == PLY_FLOAT64) {
+                    error = "unsupported list count type " + count_type;
+                    return false;
+                }
+            }
+            prop.type = plyType(type);
+            if (prop.type == PLY_INVALID) {
+                error = "unsupported property type " + type;
+                return false;
+            }
+            words >> prop.name;
+            elements.back().props.push_back(prop);
+        }
+        else if (keyword == end_marker) {
+            header_size = line - data;
+            if (!found_format) {
+                error = "missing format line";
+                return false;
+            }
+            for (PlyElement &element : elements) {
+                size_t offset = 0;
+                bool fixed = true;
+                for (PlyProperty &prop : element.props) {
+                    prop.offset = offset;
+                    fixed = fixed && !prop.is_list;
+                    offset += plySize(prop.type);
+                }
+                element.stride = fixed ? offset : 0;
+            }
+            return true;
+        }
+        // comment, obj_info and anything unknown is skipped
+    }
+    error = "missing end_header";
+    return false;
+}
+
+/**
+ * Step over one row of an element with list properties. Returns nullptr if the row
+ * runs past the end of the file.
+ */
+const char *skipPlyRow(const char *p, const char *end, const PlyElement &element) {
+    for (const PlyProperty &prop : element.props) {
+        size_t bytes = plySize(prop.type);
+        if (prop.is_list) {
+            size_t count_size = plySize(prop.count_type);
+            if (static_cast<size_t>(end - p) < count_size) {
+                return nullptr;
+            }
+            bytes *= static_cast<size_t>(plyValue(p, prop.count_type));
+            p += count_size;
+        }
+        if (static_cast<size_t>(end - p) < bytes) {
+            return nullptr;
+        }
+        p += bytes;
+    }
+    return p;
+}
+
+/**
+ * Split a polygon into a fan of triangles. corners holds vertex indices; triangles
+ * which index a vertex outside [0, num_verts) are dropped and counted in bad.
+ */
+void addFan(const int *corners, size_t count, int num_verts, bool has_normals, std::vector<TriangleIndexGL> &tris, size_t &bad) {
+    for (size_t i = 1; i + 1 < count; ++i) {
+        int v1 = corners[0], v2 = corners[i], v3 = corners[i + 1];
+        if (v1 < 0 || v2 < 0 || v3 < 0 || v1 >= num_verts || v2 >= num_verts || v3 >= num_verts) {
+            ++bad;
+            continue;
+        }
+        TriangleIndexGL tri;
+        tri.v1 = v1;
+        tri.v2 = v2;
+        tri.v3 = v3;
+        tri.mat = -1;
+        tri.n1 = has_normals ? v1 : -1;
+        tri.n2 = has_normals ? v2 : -1;
+        tri.n3 = has_normals ? v3 : -1;
+        tri.padding = 0;
+        tris.push_back(tri);
+    }
+}
+
+bool importError(const std::string &file_name, const std::string &error) {
+    std::cerr << "ERROR: Couldn't import " << file_name << ": " << error << std::endl;
+    return false;
+}
+
+// Flags stored with every OBJ triangle until its indices are resolved
+enum ObjFlags {
+    OBJ_LOCAL_V = 1,  // bits 0-2: v[i] counts from the start of the chunk (a negative index in the file)
+    OBJ_LOCAL_N = 8,  // bits 3-5: the same for n[i]
+    OBJ_FACE_NORMAL = 64  // not every corner had a normal, so the face normal is used
+};
+
+struct ObjTriangle {
+    int v[3];
+    int n[3];
+    int mat;  // usemtl slot of the chunk, -1 for the material active when the chunk began
+    int flags;
+};
+
+/**
+ * ObjChunk - everything read from one line aligned slice of an OBJ file
+ */
+struct ObjChunk {
+    std::vector<VertexGL> verts;
+    std::vector<VertexGL> norms;
+    std::vector<ObjTriangle> tris;
+    std::vector<std::string> mat_names;
+    std::vector<std::string> libs;
+    // filled in during resolution
+    size_t vert_base = 0;
+    size_t norm_base = 0;
+    int start_mat = -1;
+    std::vector<TriangleIndexGL> resolved;
+    size_t bad = 0;
+};
+
+/**
+ * Parse one face corner, "v", "v/vt", "v//vn" or "v/vt/vn". Missing indices are 0.
+ */
+bool parseCorner(const char *tok, size_t len, int &v, int &vn) {
+    Scanner scan = { tok, tok + len };
+    vn = 0;
+    if (!scan.readInt(v) || v == 0) {
+        return false;
+    }
+    if (scan.cur < scan.end && *scan.cur == '/') {
+        ++scan.cur;
+        int vt;
+        if (scan.cur < scan.end && *scan.cur != '/' && !scan.readInt(vt)) {
+            return false;
+        }
+        if (scan.cur < scan.end && *scan.cur == '/') {
+            ++scan.cur;
+            if (!scan.readInt(vn)) {
+                return false;
+            }
+        }
+    }
+    return scan.cur == scan.end;
+}
+
+void parseObjChunk(const char *begin, const char *end, ObjChunk &chunk) {
+    Scanner scan = { begin, end };
+    int cur_mat = -1;
+    const char *tok;
+    size_t len;
+    std::vector<int> corners, corner_norms, corner_flags;
+    while (scan.nextToken(tok, len)) {
+        bool ok = true;
+        if (matches(tok, len, "v")) {
+            VertexGL v = {};
+            ok = scan.readFloats(v.pos, 3);
+            if (ok) {
+                chunk.verts.push_back(v);
+            }
+        }
+        else if (matches(tok, len, "vn")) {
+            VertexGL n = {};
+            ok = scan.readFloats(n.pos, 3);
+            if (ok) {
+                chunk.norms.push_back(n);
+            }
+        }
+        else if (matches(tok, len, "f")) {
+            const char *nl = static_cast<const char *>(memchr(scan.cur, '\n', scan.end - scan.cur));
+            Scanner line = { scan.cur, nl ? nl : scan.end };
+            corners.clear();
+            corner_norms.clear();
+            corner_flags.clear();
+            int local_verts = static_cast<int>(chunk.verts.size());
+            int local_norms = static_cast<int>(chunk.norms.size());
+            bool all_normals = true;
+            while (ok && line.nextToken(tok, len)) {
+                int v = 0, vn = 0;
+                ok = parseCorner(tok, len, v, vn);
+                // positive indices count from 1, negative ones back from the last vertex
+                // read so far, which is only known relative to the start of the chunk
+                corners.push_back(v > 0 ? v - 1 : local_verts + v);
+                corner_norms.push_back(vn > 0 ? vn - 1 : local_norms + vn);
+                corner_flags.push_back((v < 0 ? OBJ_LOCAL_V : 0) | (vn < 0 ? OBJ_LOCAL_N : 0));
+                all_normals = all_normals && vn != 0;
+            }
+            scan.cur = line.end;
+            ok = ok && corners.size() >= 3;
+            if (ok) {
+                for (size_t i = 1; i + 1 < corners.size(); ++i) {
+                    ObjTriangle tri;
+                    size_t idx[3] = { 0, i, i + 1 };
+                    tri.flags = all_normals ? 0 : OBJ_FACE_NORMAL;
+                    for (int k = 0; k < 3; ++k) {
+                        tri.v[k] = corners[idx[k]];
+                        tri.n[k] = corner_norms[idx[k]];
+                        tri.flags |= corner_flags[idx[k]] << k;
+                    }
+                    tri.mat = cur_mat;
+                    chunk.tris.push_back(tri);
+                }
+            }
+        }
+        else if (matches(tok, len, "usemtl")) {
+            ok = scan.restOfLine(tok, len);
+            if (ok) {
+                cur_mat = static_cast<int>(chunk.mat_names.size());
+                chunk.mat_names.push_back(std::string(tok, len));
+            }
+            continue;
+        }
+        else if (matches(tok, len, "mtllib")) {
+            ok = scan.restOfLine(tok, len);
+            if (ok) {
+                chunk.libs.push_back(std::string(tok, len));
+            }
+            continue;
+        }
+        else {
+            // texture coordinates, groups, comments and the like are skipped
+            scan.skipLine();
+            continue;
+        }
+        if (!ok) {
+            ++chunk.bad;
+            scan.skipLine();
+        }
+    }
+}
+
+/**
+ * Read the materials of an MTL file into mats, recording the offset of every name.
+ * Ka, Kd, Ks, Ns, Ni and d (as the transmissive color) are understood.
+ */
+bool loadMtl(const std::string &file_name, std::vector<MaterialGL> &mats, std::unordered_map<std::string, int> &names) {
+    MappedFile file;
+    if (!file.open(file_name)) {
+        return false;
+    }
+    Scanner scan = { file.data(), file.data() + file.size() };
+    MaterialGL *mat = nullptr;
+    const char *tok;
+    size_t len;
+    while (scan.nextToken(tok, len)) {
+        if (matches(tok, len, "newmtl")) {
+            if (scan.restOfLine(tok, len)) {
+                names[std::string(tok, len)] = static_cast<int>(mats.size());
+                mats.push_back(MaterialGL());
+                mat = &mats.back();
+            }
+            continue;
+        }
+        bool ok = true;
+        if (!mat) {
+            ok = false;
+        }
+        else if (matches(tok, len, "Ka")) {
+            ok = scan.readFloats(mat->ka, 3);
+        }
+        else if (matches(tok, len, "Kd")) {
+            ok = scan.readFloats(mat->kd, 3);
+        }
+        else if (matches(tok, len, "Ks")) {
+            ok = scan.readFloats(mat->ks, 3);
+        }
+        else if (matches(tok, len, "Ns")) {
+            ok = scan.readFloat(mat->ns);
+        }
+        else if (matches(tok, len, "Ni")) {
+            ok = scan.readFloat(mat->ior);
+        }
+        else if (matches(tok, len, "d")) {
+            float dissolve;
+            ok = scan.readFloat(dissolve);
+            if (ok) {
+                mat->kt[0] = mat->kt[1] = mat->kt[2] = 1.0f - dissolve;
+            }
+        }
+        else {
+            ok = false;
+        }
+        if (!ok) {
+            scan.skipLine();
+        }
+    }
+    return true;
+}
+
+}  // namespace
+
+bool importPly(const std::string &file_name, ImportedMesh &out) {
+    MappedFile file;
+    if (!file.open(file_name)) {
+        return importError(file_name, "can't open the file");
+    }
+    std::vector<PlyElement> elements;
+    size_t header_size = 0;
+    std::string error;
+    if (!parsePlyHeader(file.data(), file.size(), elements, header_size, error)) {
+        return importError(file_name, error);
+    }
+    const char *p = file.data() + header_size;
+    const char *end = file.data() + file.size();
+    TriangleMesh &mesh = out.mesh;
+    bool has_normals = false;
+    size_t bad = 0;
+    for (const PlyElement &element : elements) {
+        if (element.name == "vertex") {
+            int x = element.find("x"), y = element.find("y"), z = element.find("z");
+            int nx = element.find("nx"), ny = element.find("ny"), nz = element.find("nz");
+            if (x < 0 || y < 0 || z < 0 || !element.stride) {
+                return importError(file_name, "vertices need fixed size x, y and z properties");
+            }
+            if (static_cast<size_t>(end - p) / element.stride < element.count) {
+                return importError(file_name, "the vertex data is truncated");
+            }
+            has_normals = nx >= 0 && ny >= 0 && nz >= 0;
+            const PlyProperty *pos[3] = { &element.props[x], &element.props[y], &element.props[z] };
+            mesh.vertices.resize(element.count);
+            // tightly packed float positions are copied straight out of the mapping
+            bool packed = pos[0]->type == PLY_FLOAT32 && pos[1]->type == PLY_FLOAT32 && pos[2]->type == PLY_FLOAT32 &&
+                          pos[1]->offset == pos[0]->offset + 4 && pos[2]->offset == pos[0]->offset + 8;
+            for (size_t i = 0; i < element.count; ++i) {
+                const char *row = p + i * element.stride;
+                VertexGL &v = mesh.vertices[i];
+                v.padding = 0.0f;
+                if (packed) {
+                    memcpy(v.pos, row + pos[0]->offset, 3 * sizeof(float));
+                }
+                else {
+                    for (int k = 0; k < 3; ++k) {
+                        v.pos[k] = static_cast<float>(plyValue(row + pos[k]->offset, pos[k]->type));
+                    }
+                }
+            }
+            if (has_normals) {
+                const PlyProperty *norm[3] = { &element.props[nx], &element.props[ny], &element.props[nz] };
+                mesh.normals.resize(element.count);
+                for (size_t i = 0; i < element.count; ++i) {
+                    const char *row = p + i * element.stride;
+                    VertexGL &n = mesh.normals[i];
+                    n.padding = 0.0f;
+                    for (int k = 0; k < 3; ++k) {
+                        n.pos[k] = static_cast<float>(plyValue(row + norm[k]->offset, norm[k]->type));
+                    }
+                }
+            }
+            p += element.count * element.stride;
+        }
+        else if (element.name == "face") {
+            int list = element.find("vertex_indices");
+            if (list < 0) {
+                list = element.find("vertex_index");
+            }
+            if (list < 0 || !element.props[list].is_list) {
+                return importError(file_name, "faces need a vertex_indices list");
+            }
+            const PlyProperty &indices = element.props[list];
+            int num_verts = static_cast<int>(mesh.vertices.size());
+            mesh.triangles.reserve(element.count);
+            // the common layout, a byte count and 32 bit indices with nothing else, is read in bulk
+            bool simple = element.props.size() == 1 && indices.count_type == PLY_UINT8 &&
+                          (indices.type == PLY_INT32 || indices.type == PLY_UINT32);
+            std::vector<int> corners;
+            for (size_t i = 0; i < element.count; ++i) {
+                if (simple) {
+                    if (p == end) {
+                        return importError(file_name, "the face data is truncated");
+                    }
+                    size_t count = static_cast<uint8_t>(*p);
+                    if (static_cast<size_t>(end - p - 1) < 4 * count) {
+                        return importError(file_name, "the face data is truncated");
+                    }
+                    corners.resize(count);
+                    memcpy(corners.data(), p + 1, 4 * count);
+                    p += 1 + 4 * count;
+                    addFan(corners.data(), count, num_verts, has_normals, mesh.triangles, bad);
+                    continue;
+                }
+                const char *row = p;
+                p = skipPlyRow(p, end, element);
+                if (!p) {
+                    return importError(file_name, "the face data is truncated");
+                }
+                // walk to the index list
+                for (int k = 0; k < list; ++k) {
+                    const PlyProperty &prop = element.props[k];
+                    row += prop.is_list ? plySize(prop.count_type) + plySize(prop.type) * static_cast<size_t>(plyValue(row, prop.count_type))
+                                        : plySize(prop.type);
+                }
+                size_t count = static_cast<size_t>(plyValue(row, indices.count_type));
+                row += plySize(indices.count_type);
+                corners.resize(count);
+                for (size_t k = 0; k < count; ++k) {
+                    corners[k] = static_cast<int>(plyValue(row + k * plySize(indices.type), indices.type));
+                }
+                addFan(corners.data(), count, num_verts, has_normals, mesh.triangles, bad);
+            }
+        }
+        else if (element.stride) {
+            // some other element which isn't needed
+            if (static_cast<size_t>(end - p) / element.stride < element.count) {
+                return importError(file_name, "the " + element.name + " data is truncated");
+            }
+            p += element.count * element.stride;
+        }
+        else {
+            for (size_t i = 0; i < element.count && p; ++i) {
+                p = skipPlyRow(p, end, element);
+            }
+            if (!p) {
+                return importError(file_name, "the " + element.name + " data is truncated");
+            }
+        }
+    }
+    if (bad) {
+        std::cerr << "ERROR: SKIPPED " << bad << " TRIANGLES WITH OUT OF RANGE INDICES IN " << file_name << std::endl;
+    }
+    return true;
+}
+
+bool importObj(const std::string &file_name, ImportedMesh &out, int num_threads) {
+    MappedFile file;
+    if (!file.open(file_name)) {
+        return importError(file_name, "can't open the file");
+    }
+    if (num_threads <= 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    std::vector<const char *> bounds = lineChunks(file.data(), file.size(), num_threads);
+    std::vector<ObjChunk> chunks(bounds.size() - 1);
+    parallelFor(chunks.size(), num_threads, [&](size_t i) {
+        parseObjChunk(bounds[i], bounds[i + 1], chunks[i]);
+    });
+
+    // Load the material libraries, relative to the OBJ file
+    std::unordered_map<std::string, int> mat_names;
+    fs::path dir = fs::path(file_name).parent_path();
+    for (const ObjChunk &chunk : chunks) {
+        for (const std::string &lib : chunk.libs) {
+            if (!loadMtl((dir / lib).string(), out.materials, mat_names)) {
+                std::cerr << "ERROR: Couldn't open material library " << (dir / lib).string() << std::endl;
+            }
+        }
+    }
+
+    // Carry the counts and the active material across chunks, then resolve in parallel
+    size_t num_verts = 0, num_norms = 0;
+    int cur_mat = -1;
+    size_t unknown_mats = 0;
+    std::vector<std::vector<int>> slot_mats(chunks.size());
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        ObjChunk &chunk = chunks[i];
+        chunk.vert_base = num_verts;
+        chunk.norm_base = num_norms;
+        chunk.start_mat = cur_mat;
+        num_verts += chunk.verts.size();
+        num_norms += chunk.norms.size();
+        for (const std::string &name : chunk.mat_names) {
+            auto found = mat_names.find(name);
+            if (found == mat_names.end()) {
+                // unknown materials fall back to the scenefile material
+                ++unknown_mats;
+            }
+            slot_mats[i].push_back(found == mat_names.end() ? -1 : found->second);
+        }
+        if (!slot_mats[i].empty()) {
+            cur_mat = slot_mats[i].back();
+        }
+    }
+    TriangleMesh &mesh = out.mesh;
+    mesh.vertices.resize(num_verts);
+    mesh.normals.resize(num_norms);
+    parallelFor(chunks.size(), num_threads, [&](size_t i) {
+        ObjChunk &chunk = chunks[i];
+        std::copy(chunk.verts.begin(), chunk.verts.end(), mesh.vertices.begin() + chunk.vert_base);
+        std::copy(chunk.norms.begin(), chunk.norms.end(), mesh.normals.begin() + chunk.norm_base);
+        chunk.resolved.reserve(chunk.tris.size());
+        for (const ObjTriangle &tri : chunk.tris) {
+            int v[3], n[3];
+            bool valid = true;
+            bool face = (tri.flags & OBJ_FACE_NORMAL) != 0;
+            for (int k = 0; k < 3; ++k) {
+                int64_t vk = tri.v[k] + static_cast<int64_t>(tri.flags & (OBJ_LOCAL_V << k) ? chunk.vert_base : 0);
+                int64_t nk = tri.n[k] + static_cast<int64_t>(tri.flags & (OBJ_LOCAL_N << k) ? chunk.norm_base : 0);
+                valid = valid && vk >= 0 && static_cast<size_t>(vk) < num_verts;
+                valid = valid && (face || (nk >= 0 && static_cast<size_t>(nk) < num_norms));
+                v[k] = static_cast<int>(vk);
+                n[k] = face ? -1 : static_cast<int>(nk);
+            }
+            if (!valid) {
+                ++chunk.bad;
+                continue;
+            }
+            TriangleIndexGL out_tri;
+            out_tri.v1 = v[0];
+            out_tri.v2 = v[1];
+            out_tri.v3 = v[2];
+            out_tri.mat = tri.mat < 0 ? chunk.start_mat : slot_mats[i][tri.mat];
+            out_tri.n1 = n[0];
+            out_tri.n2 = n[1];
+            out_tri.n3 = n[2];
+            out_tri.padding = 0;
+            chunk.resolved.push_back(out_tri);
+        }
+        std::vector<ObjTriangle>().swap(chunk.tris);
+    });
+    size_t num_tris = 0, bad = 0;
+    std::vector<size_t> tri_base(chunks.size());
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        tri_base[i] = num_tris;
+        num_tris += chunks[i].resolved.size();
+        bad += chunks[i].bad;
+    }
+    mesh.triangles.resize(num_tris);
+    parallelFor(chunks.size(), num_threads, [&](size_t i) {
+        std::copy(chunks[i].resolved.begin(), chunks[i].resolved.end(), mesh.triangles.begin() + tri_base[i]);
+    });
+    if (unknown_mats) {
+        std::cerr << "ERROR: " << unknown_mats << " UNKNOWN MATERIALS IN " << file_name << std::endl;
+    }
+    if (bad) {
+        std::cerr << "ERROR: SKIPPED " << bad << " MALFORMED FACES IN " << file_name << std::endl;
+    }
+    return true;
+}
+
+bool importMesh(const std::string &file_name, ImportedMesh &out, int num_threads) {
+    std::string ext = fs::path(file_name).extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return static_cast<char>(tolower(c)); });
+    if (ext == ".ply") {
+        return importPly(file_name, out);
+    }
+    if (ext == ".obj") {
+        return importObj(file_name, out, num_threads);
+    }
+    std::cerr << "ERROR: Couldn't import " << file_name << ": only .ply and .obj meshes are supported" << std::endl;
+    return false;
+}
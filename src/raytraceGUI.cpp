@@ -2,6 +2,7 @@
 #include <GLFW/glfw3.h>
 #include <glad/glad.h>
 
+#include <algorithm>
 #include <string>
 #include <cstring>
 #include <vector>
@@ -11,12 +12,20 @@
 #include <math.h>
 #include <iostream>
 #include <fstream>
+#include <thread>
 
 // PGA is included only for the Cross product and Point3D so calculating face normals can be done easily
 #include "PGA_3D.h"
 #include "structs.h"
 #include "config.h"
 #include "bvh.h"
+#include "bvh_stats.h"
+#include "mesh.h"
+#include "scene.h"
+#include "scene_cache.h"
+#include "skip_bvh.h"
+#include "wide_bvh.h"
+#include "instancing.h"
 
 #define DEBUG
 float vertices[] = {  // This are the verts for the fullscreen quad
@@ -60,6 +69,34 @@ const GLchar* fragment_source =
 std::vector<MaterialGL> mats(0);  // all the materials in the scenefile
 std::vector<LightGL> lights(0);  // all the lights in the scenefile
 bvh scene_bvh;  // all the triangles in the scene
+SceneCache scene_cache;  // the compiled scene, when it was loaded from a cache
+SceneBuffers gpu_scene;  // the arrays which are uploaded to the GPU
+bool use_cache = true;  // load and write compiled .rtscene caches
+bool indexed_layout = true;  // upload indexed vertex/normal/triangle buffers instead of expanded TriangleGLs
+bool clean_mesh = false;  // weld the mesh and drop triangles which can't be seen before building the bvh
+BvhSplitMethod bvh_split = SPLIT_SAH;  // how the bvh nodes are split
+int bvh_leaf_size = BvhOptions().max_leaf_size;  // the most triangles in a bvh leaf
+int bvh_max_depth = kMaxLeafDepth;  // no bvh leaf goes deeper than this
+int shader_stack_size = 0;  // the most entries sceneIntersect's stack needs for the loaded bvh
+float spatial_budget = kSpatialSplitBudget;  // duplicate references per triangle a spatial split bvh may add
+float optimize_seconds = 0.0f;  // time spent improving the bvh after the build
+float optimize_sah_cost = 0.0f;  // ...unless its SAH cost gets down to this first
+int bvh_width = 2;  // children per bvh node on the GPU: 2, or 4 or 8 to collapse the tree into a wide bvh
+int bvh_quantize_bits = 0;  // 8 or 16 to quantize the wide bvh's child bounds, 0 to keep floats
+bool stackless = false;  // thread the bvh with skip links and traverse it without a stack
+bool treelet_layout = false;  // store the bvh nodes in treelets instead of depth first
+// the uploaded nodes when they aren't gpu_scene's: a wide, quantized or skip link bvh
+std::vector<unsigned char> packed_bvh;
+bool deform = false;  // twist the mesh back and forth, refitting the bvh every frame
+bool print_bvh_stats = false;  // print the bvh's statistics as JSON once it is loaded
+bool two_level = false;  // the scene has instances, so gpu_scene comes from instanced_bvh
+TwoLevelBvh instanced_bvh;  // the meshes' bvhs under a top level over the instances
+
+// The undeformed mesh, when deform is set
+std::vector<VertexGL> rest_vertices;
+std::vector<VertexGL> rest_normals;
+std::vector<int> normal_vertex;  // a vertex each normal is used with, which it turns with
+DimensionGL rest_box;
 
 // These are the camera values
 size_t img_width = 1080;  // raytracer virtual image width
@@ -172,144 +209,299 @@ static void windowSizeCallback(GLFWwindow *window, int width, int height) {
 }
 
 /**
- * Load a scenefile and initialize all the data which needs to be sent to the GPU 
+ * Insert a #define for each name right after the #version line of a shader source
  */
-void loadFromFile(string input_file_name) {
-    std::ifstream in_file(input_file_name);
-    if (!in_file.good()) {
-        std::cerr << "Couldn't open file: " << input_file_name << endl;
-        exit(1);
-    }
-    // The file was opened, so we are good to parse data now!
-    std::vector<TriangleGL> bvh_tris;
-    // The default material is a matte white
-    MaterialGL cur_mat;
-    // we allow at most 100 materials and 100 lights in the shader
-    mats.push_back(cur_mat);
-
-    std::vector<float> verts;
-    std::vector<float> norms;
-    // The maximum and minimum bounds of the scene. Used when generating the BVH
-    Point3D min_pt(INFINITY, INFINITY, INFINITY), max_pt(-INFINITY, -INFINITY, -INFINITY);
-    int max_vert(-1), max_norm(-1), nindex(0), vindex(0), tindex(0);
-    // Read each line in the file
-    string command, line;
-    while (!in_file.eof()) {
-        in_file >> command;
-        if (!command.compare("camera_fwd:")) {
-            in_file >> fwd[0] >> fwd[1] >> fwd[2];
-        }
-        else if (!command.compare("camera_up:")) {
-            in_file >> up[0] >> up[1] >> up[2];
-        }
-        else if (!command.compare("camera_pos:")) {
-            in_file >> eye[0] >> eye[1] >> eye[2];
-        }
-        else if (!command.compare("camera_fov_ha:")) {
-            in_file >> half_fov;
-        }
-        else if (!command.compare("material:")) {
-            in_file >> cur_mat.ka[0] >> cur_mat.ka[1] >> cur_mat.ka[2]
-                    >> cur_mat.kd[0] >> cur_mat.kd[1] >> cur_mat.kd[2]
-                    >> cur_mat.ks[0] >> cur_mat.ks[1] >> cur_mat.ks[2]
-                    >> cur_mat.ns
-                    >> cur_mat.kt[0] >> cur_mat.kt[1] >> cur_mat.kt[2]
-                    >> cur_mat.ior;
-            mats.push_back(cur_mat);
+std::string injectDefines(const std::string &source, const std::vector<std::string> &defines) {
+    size_t version = source.find("#version");
+    size_t line_end = version == std::string::npos ? 0 : source.find('\n', version);
+    line_end = line_end == std::string::npos ? source.size() : line_end + 1;
+    std::string header;
+    for (const std::string &define : defines) {
+        header += "#define " + define + "\n";
+    }
+    return source.substr(0, line_end) + header + source.substr(line_end);
+}
+
+/**
+ * Create a shader storage buffer holding size bytes of data and bind it to binding.
+ * Empty arrays still get a small buffer so every binding in the shader is valid.
+ */
+GLuint createStorageBuffer(GLuint binding, size_t size, const void *data) {
+    GLuint ssbo;
+    glGenBuffers(1, &ssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+    if (size == 0) {
+        glBufferData(GL_SHADER_STORAGE_BUFFER, 16, NULL, GL_STREAM_READ);
+    }
+    else {
+        glBufferData(GL_SHADER_STORAGE_BUFFER, size, data, GL_STREAM_READ);
+    }
+    // Bind the SSBO in the Compute Shader
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, ssbo);
+    // unbind the SSBO
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    return ssbo;
+}
+
+/**
+ * Copy the ranges of elements, each element_size bytes, from data into ssbo
+ */
+void updateStorageBuffer(GLuint ssbo, const std::vector<BufferRange> &ranges, const void *data, size_t element_size) {
+    const char *bytes = static_cast<const char *>(data);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+    for (const BufferRange &range : ranges) {
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, range.first * element_size, (range.second - range.first) * element_size,
+                        bytes + range.first * element_size);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+/**
+ * Replace everything in ssbo with size bytes of data
+ */
+void refillStorageBuffer(GLuint ssbo, size_t size, const void *data) {
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, size, data, GL_STREAM_READ);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+/**
+ * Point the GPU arrays at the mesh and nodes of scene_bvh
+ */
+void setSceneBuffers() {
+    const TriangleMesh &mesh = scene_bvh.getMesh();
+    gpu_scene.vertices = data(mesh.vertices);
+    gpu_scene.num_vertices = mesh.vertices.size();
+    gpu_scene.normals = data(mesh.normals);
+    gpu_scene.num_normals = mesh.normals.size();
+    gpu_scene.triangles = data(mesh.triangles);
+    gpu_scene.num_triangles = mesh.triangles.size();
+    int num_nodes;
+    gpu_scene.nodes = scene_bvh.getCompact(num_nodes);
+    gpu_scene.num_nodes = num_nodes;
+}
+
+/**
+ * Remember the mesh of scene_bvh as it was loaded, which every frame of --deform twists
+ */
+void saveRestPose() {
+    const TriangleMesh &mesh = scene_bvh.getMesh();
+    rest_vertices = mesh.vertices;
+    rest_normals = mesh.normals;
+    normal_vertex.assign(rest_normals.size(), -1);
+    for (const TriangleIndexGL &tri : mesh.triangles) {
+        const int corners[3][2] = { { tri.n1, tri.v1 }, { tri.n2, tri.v2 }, { tri.n3, tri.v3 } };
+        for (const int *corner : corners) {
+            if (corner[0] >= 0 && normal_vertex[corner[0]] == -1) {
+                normal_vertex[corner[0]] = corner[1];
+            }
         }
-        else if (!command.compare("max_vertices:")) {
-            in_file >> max_vert;
-            // Reserve space for the vertices
-            verts.reserve(3 * max_vert);
+    }
+    int num_nodes;
+    const NodeGL *nodes = scene_bvh.getCompact(num_nodes);
+    rest_box = num_nodes ? nodes[0].AABB : DimensionGL();
+}
+
+/**
+ * Twist the rest pose about the vertical axis through the middle of its box, by angle
+ * radians at the top and not at all at the bottom
+ */
+void twistMesh(float angle, std::vector<VertexGL> &vertices, std::vector<VertexGL> &normals) {
+    float center_x = 0.5f * (rest_box.min_x + rest_box.max_x);
+    float center_z = 0.5f * (rest_box.min_z + rest_box.max_z);
+    float height = rest_box.max_y - rest_box.min_y;
+    auto turn = [&](const VertexGL &vertex) {
+        return height > 0.0f ? angle * (vertex.pos[1] - rest_box.min_y) / height : 0.0f;
+    };
+    auto rotate = [](VertexGL &vertex, float turn, float x_0, float z_0) {
+        float x = vertex.pos[0] - x_0;
+        float z = vertex.pos[2] - z_0;
+        vertex.pos[0] = x_0 + x * cos(turn) - z * sin(turn);
+        vertex.pos[2] = z_0 + x * sin(turn) + z * cos(turn);
+    };
+    vertices = rest_vertices;
+    for (VertexGL &vertex : vertices) {
+        rotate(vertex, turn(vertex), center_x, center_z);
+    }
+    normals = rest_normals;
+    for (size_t i = 0; i < normals.size(); ++i) {
+        if (normal_vertex[i] >= 0) {
+            rotate(normals[i], turn(rest_vertices[normal_vertex[i]]), 0.0f, 0.0f);
         }
-        else if (!command.compare("max_normals:")) {
-            in_file >> max_norm;
-            // Reserve space for the normals
-            norms.reserve(3 * max_norm);
-            norms.resize(3 * max_norm);
+    }
+}
+
+/**
+ * Copy nodes into the bytes of the packed bvh
+ */
+template<typename Node>
+void setPackedBvh(const std::vector<Node> &nodes) {
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data(nodes));
+    packed_bvh.assign(bytes, bytes + nodes.size() * sizeof(Node));
+}
+
+/**
+ * Collapse the binary bvh in gpu_scene into the Width wide bvh which is uploaded,
+ * quantizing its bounds if bvh_quantize_bits is set
+ */
+template<int Width>
+void prepareWideBvh() {
+    std::vector<WideNodeGL<Width>> wide;
+    shader_stack_size = collapseBvh<Width>(gpu_scene.nodes, gpu_scene.num_nodes, wide);
+    if (bvh_quantize_bits == 8) {
+        std::vector<QuantizedNodeGL<Width, 8>> quantized;
+        quantizeBvh<Width, 8>(wide, quantized);
+        setPackedBvh(quantized);
+    }
+    else if (bvh_quantize_bits == 16) {
+        std::vector<QuantizedNodeGL<Width, 16>> quantized;
+        quantizeBvh<Width, 16>(wide, quantized);
+        setPackedBvh(quantized);
+    }
+    else {
+        setPackedBvh(wide);
+    }
+}
+
+/**
+ * Thread the binary bvh in gpu_scene with skip links into the packed bvh
+ */
+void prepareSkipBvh() {
+    std::vector<SkipNodeGL> threaded;
+    threadBvh(gpu_scene.nodes, gpu_scene.num_nodes, threaded);
+    setPackedBvh(threaded);
+}
+
+/**
+ * Load a scenefile and initialize all the data which needs to be sent to the GPU.
+ * If the scene has a valid compiled .rtscene cache, the GPU arrays come straight
+ * from the cache; otherwise the scene is parsed, the bvh is built and the cache is written.
+ * The parser and bvh builder run as a pipeline: triangles are bounded on the builder
+ * thread while the rest of the file is still being parsed.
+ * Returns false if the scenefile could not be opened.
+ */
+bool loadFromFile(string input_file_name) {
+    SceneData scene;
+    uint32_t cache_flags = static_cast<uint32_t>(bvh_leaf_size) << CACHE_LEAF_SIZE_SHIFT;
+    cache_flags |= static_cast<uint32_t>(bvh_max_depth) << CACHE_MAX_DEPTH_SHIFT;
+    if (clean_mesh) {
+        cache_flags |= CACHE_CLEANED_MESH;
+    }
+    if (bvh_split == SPLIT_MEDIAN) {
+        cache_flags |= CACHE_MEDIAN_BVH;
+    }
+    if (bvh_split == SPLIT_MORTON) {
+        cache_flags |= CACHE_MORTON_BVH;
+    }
+    if (treelet_layout) {
+        cache_flags |= CACHE_TREELET_BVH;
+    }
+    if (bvh_split == SPLIT_SBVH) {
+        cache_flags |= CACHE_SPATIAL_BVH | (static_cast<uint32_t>(spatial_budget * 100.0f + 0.5f) << CACHE_SPATIAL_BUDGET_SHIFT);
+    }
+    BvhOptions bvh_options(bvh_split, 0, bvh_leaf_size);
+    bvh_options.spatial_budget = spatial_budget;
+    bvh_options.max_depth = bvh_max_depth;
+    bvh_options.treelet_nodes = treelet_layout ? kTreeletNodes : 0;
+    bvh_options.optimize_seconds = optimize_seconds;
+    bvh_options.optimize_sah_cost = optimize_sah_cost;
+    if (use_cache && scene_cache.open(input_file_name, scene, gpu_scene, cache_flags)) {
+        cout << "Loaded " << gpu_scene.num_triangles << " triangles from " << SceneCache::cachePath(input_file_name) << endl;
+    }
+    else {
+        bvh_builder builder(bvh_options);
+        if (!loadScene(input_file_name, scene, 0, builder.sink())) {
+            std::cerr << "Couldn't open file: " << input_file_name << endl;
+            return false;
         }
-        else if (!command.compare("vertex:")) {
-            // Add another vertex to the master list
-            float vert_x, vert_y, vert_z;
-            in_file >> vert_x >> vert_y >> vert_z;
-            verts.push_back(vert_x);
-            verts.push_back(vert_y);
-            verts.push_back(vert_z);
+        cout << "Loaded " << scene.mesh.triangles.size() << " triangles" << endl;
+        if (!scene.instances.empty()) {
+            // the instanced meshes share the optimization budget with the scene's own mesh
+            size_t all_triangles = scene.mesh.triangles.size();
+            for (const TriangleMesh &mesh : scene.instance_meshes) {
+                all_triangles += mesh.triangles.size();
+            }
+            builder.setOptimizeSeconds(optimize_seconds * scene.mesh.triangles.size() / std::max<size_t>(all_triangles, 1));
         }
-        else if (!command.compare("normal:")) {
-            // Add another normal to the master list
-            in_file >> norms[nindex++] >> norms[nindex++] >> norms[nindex++];
+        if (clean_mesh) {
+            MeshCleanStats stats = cleanMesh(scene.mesh);
+            cout << "Welded " << stats.welded_vertices << " vertices and " << stats.welded_normals << " normals, removed "
+                 << stats.degenerate_triangles << " degenerate and " << stats.duplicate_triangles << " duplicate triangles and "
+                 << stats.unused_vertices << " unused vertices and " << stats.unused_normals << " unused normals" << endl;
         }
-        else if (!command.compare("triangle:")) {
-            if (max_vert < 0) {
-                std::cerr << "ERROR: NUMBER OF VERTICES NOT SPECIFIED. SKIPPING" << endl;
-                continue;
+        // make the BVH. If cleaning removed triangles, the bounds gathered while parsing
+        // no longer line up and the builder starts over from the cleaned mesh
+        scene_bvh = builder.finish(scene.mesh);
+        if (!scene.instances.empty()) {
+            if (bvh_width != 2 || bvh_quantize_bits || deform || !indexed_layout || stackless) {
+                std::cerr << "Couldn't use a wide or quantized bvh, --deform, --stackless or the expanded layout: "
+                          << "instanced scenes need the indexed layout and the binary bvh" << endl;
+                bvh_width = 2;
+                bvh_quantize_bits = 0;
+                deform = false;
+                indexed_layout = true;
+                stackless = false;
             }
-            int p1, p2, p3;
-            TriangleGL new_tri;
-            in_file >> p1 >> p2 >> p3;
-            // Find the corresponding vertices in the vertex array and add them to the triangle
-            memcpy(new_tri.p1, &verts[p1*3], 3 * sizeof(float));
-            memcpy(new_tri.p2, &verts[p2*3], 3 * sizeof(float));
-            memcpy(new_tri.p3, &verts[p3*3], 3 * sizeof(float));
-            // now get the face normal
-            float norm[3];
-            Dir3D face = cross(Point3D(new_tri.p2[0], new_tri.p2[1], new_tri.p2[2]) - Point3D(new_tri.p1[0], new_tri.p1[1], new_tri.p1[2]), 
-                               Point3D(new_tri.p3[0], new_tri.p3[1], new_tri.p3[2]) - Point3D(new_tri.p1[0], new_tri.p1[1], new_tri.p1[2]));
-            face = face.normalized();
-            norm[0] = face.x;
-            norm[1] = face.y;
-            norm[2] = face.z;
-            // Add the normal to each vertex
-            memcpy(new_tri.n1, norm, 3 * sizeof(float));
-            memcpy(new_tri.n2, norm, 3 * sizeof(float));
-            memcpy(new_tri.n3, norm, 3 * sizeof(float));
-            new_tri.mat = cur_mat;
-            bvh_tris.push_back(new_tri);
+            // Every instanced mesh gets a bvh of its own under a top level over the
+            // instances. The cache has no room for instances, so it isn't written
+            instanced_bvh = TwoLevelBvh(scene_bvh, scene, bvh_options);
+            scene_bvh = bvh();
+            gpu_scene = instanced_bvh.buffers();
+            two_level = true;
+            cout << "Placed " << instanced_bvh.gpuInstances().size() << " instances over " << gpu_scene.num_triangles
+                 << " unique triangles" << endl;
         }
-        else if (!command.compare("normal_triangle:")) {
-            if (max_vert < 0 || max_norm < 0) {
-                std::cerr << "ERROR: NUMBER OF VERTICES/NORMALS NOT SPECIFIED. SKIPPING" << endl;
-                continue;
+        else {
+            setSceneBuffers();
+            if (deform) {
+                saveRestPose();
+            }
+            if (use_cache && !SceneCache::write(input_file_name, scene, gpu_scene, cache_flags)) {
+                std::cerr << "Couldn't write scene cache: " << SceneCache::cachePath(input_file_name) << endl;
             }
-            int p1, p2, p3, n1, n2, n3;
-            in_file >> p1 >> p2 >> p3 >> n1 >> n2 >> n3;
-            TriangleGL new_tri;
-            memcpy(new_tri.p1, &verts[p1*3], 3 * sizeof(float));
-            memcpy(new_tri.p2, &verts[p2*3], 3 * sizeof(float));
-            memcpy(new_tri.p3, &verts[p3*3], 3 * sizeof(float));
-
-            memcpy(new_tri.n1, &norms[n1*3], 3 * sizeof(float));
-            memcpy(new_tri.n2, &norms[n2*3], 3 * sizeof(float));
-            memcpy(new_tri.n3, &norms[n3*3], 3 * sizeof(float));
-            new_tri.mat = cur_mat;
-            bvh_tris.push_back(new_tri);
-        }
-        else if (!command.compare("background:")) {
-            in_file >> b_clr[0] >> b_clr[1] >> b_clr[2];
-        }
-        else if (!command.compare("point_light:")) {
-            LightGL light;
-            in_file >> light.clr[0] >> light.clr[1] >> light.clr[2]
-                    >> light.pos[0] >> light.pos[1] >> light.pos[2];
-            light.type = POINT_LIGHT;
-            lights.push_back(light);
         }
-        else if (!command.compare("directional_light:")) {
-            LightGL light;
-            in_file >> light.clr[0] >> light.clr[1] >> light.clr[2]
-                    >> light.dir[0] >> light.dir[1] >> light.dir[2];
-            light.type = DIRECTION_LIGHT;
-            lights.push_back(light);
+    }
+    if (print_bvh_stats) {
+        if (two_level) {
+            std::cerr << "Couldn't measure the bvh: the statistics are for one level bvhs" << endl;
         }
         else {
-            // Unsupported command or comment, just skip it
-            std::getline(in_file, line);
-            continue;
+            writeJson(cout, measureBvh(gpu_scene));
+            cout << endl;
         }
     }
-    in_file.close();
-    cout << "Loaded " << bvh_tris.size() << " triangles" << endl;
+    if (bvh_width == 2 && bvh_quantize_bits) {
+        prepareWideBvh<2>();
+    }
+    else if (bvh_width == 4) {
+        prepareWideBvh<4>();
+    }
+    else if (bvh_width == 8) {
+        prepareWideBvh<8>();
+    }
+    else if (stackless) {
+        prepareSkipBvh();
+    }
+    else if (two_level) {
+        shader_stack_size = instanced_bvh.stackSize();
+    }
+    else if (deform) {
+        // a refit may rebuild the tree, which can go as deep as the cap allows, or deeper
+        // if there are too many triangles to fit under it
+        size_t triangles = scene_bvh.getMesh().triangles.size() - scene_bvh.spatialReferences();
+        shader_stack_size = leafDepthBound(triangles, bvh_options) + 1;
+    }
+    else {
+        shader_stack_size = traversalStackSize(gpu_scene.nodes, gpu_scene.num_nodes);
+    }
+    // The file was parsed, so copy out the global scene values
+    mats = std::move(scene.materials);
+    lights = std::move(scene.lights);
+    memcpy(eye, scene.eye, 3 * sizeof(float));
+    memcpy(fwd, scene.fwd, 3 * sizeof(float));
+    memcpy(up, scene.up, 3 * sizeof(float));
+    memcpy(b_clr, scene.background, 3 * sizeof(float));
+    half_fov = scene.half_fov;
     // orthogonalize the camera basis
     Dir3D forward(fwd[0], fwd[1], fwd[2]);
     Dir3D u(up[0], up[1], up[2]);
@@ -328,19 +520,124 @@ void loadFromFile(string input_file_name) {
     up[0] = u.x;
     up[1] = u.y;
     up[2] = u.z;
-    
-    // make the BVH
-    scene_bvh = bvh(bvh_tris);
+    return true;
 }
 
 int main(int argc, char *argv[]){
     string file_name;
-    std::cin >> file_name;
-    // Try loading the scene information 
-    loadFromFile(file_name);
-    // Load successful, create a GLFW window and OpenGL context
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--no-cache")) {
+            // always parse the text scenefile, and don't write a cache
+            use_cache = false;
+        }
+        else if (!strcmp(argv[i], "--layout") && i + 1 < argc) {
+            // indexed (default) or expanded triangle buffers
+            indexed_layout = strcmp(argv[++i], "expanded") != 0;
+        }
+        else if (!strcmp(argv[i], "--bvh") && i + 1 < argc) {
+            // sah (default), median, morton (linear bvh) or sbvh (spatial splits)
+            ++i;
+            if (!strcmp(argv[i], "median")) {
+                bvh_split = SPLIT_MEDIAN;
+            }
+            else if (!strcmp(argv[i], "morton")) {
+                bvh_split = SPLIT_MORTON;
+            }
+            else if (!strcmp(argv[i], "sbvh")) {
+                bvh_split = SPLIT_SBVH;
+            }
+            else if (!strcmp(argv[i], "sah")) {
+                bvh_split = SPLIT_SAH;
+            }
+            else {
+                std::cerr << "Couldn't use --bvh " << argv[i] << ": the methods are sah, median, morton and sbvh" << endl;
+            }
+        }
+        else if (!strcmp(argv[i], "--spatial-budget") && i + 1 < argc) {
+            // at most this many duplicate references per triangle for --bvh sbvh
+            spatial_budget = std::min(std::max(0.0f, static_cast<float>(atof(argv[++i]))), 10.0f);
+        }
+        else if (!strcmp(argv[i], "--bvh-width") && i + 1 < argc) {
+            // 2 (default) traverses the binary bvh, 4 or 8 collapse it into a wide bvh
+            bvh_width = atoi(argv[++i]);
+            bvh_width = bvh_width == 4 || bvh_width == 8 ? bvh_width : 2;
+        }
+        else if (!strcmp(argv[i], "--bvh-quantize") && i + 1 < argc) {
+            // 8 or 16 bit child bounds in a wide bvh (2 wide unless --bvh-width says otherwise)
+            bvh_quantize_bits = atoi(argv[++i]);
+            bvh_quantize_bits = bvh_quantize_bits == 8 || bvh_quantize_bits == 16 ? bvh_quantize_bits : 0;
+        }
+        else if (!strcmp(argv[i], "--leaf-size") && i + 1 < argc) {
+            // the most triangles a bvh leaf may hold, 1 to 8
+            bvh_leaf_size = std::min(std::max(1, atoi(argv[++i])), kMaxLeafSize);
+        }
+        else if (!strcmp(argv[i], "--max-depth") && i + 1 < argc) {
+            // cap the bvh's depth, which also caps the shader's traversal stack
+            bvh_max_depth = std::min(std::max(1, atoi(argv[++i])), kMaxLeafDepth);
+        }
+        else if (!strcmp(argv[i], "--stackless")) {
+            // follow skip links through the bvh instead of keeping a traversal stack
+            stackless = true;
+        }
+        else if (!strcmp(argv[i], "--optimize") && i + 1 < argc) {
+            // spend up to this many seconds moving bvh subtrees to lower the SAH cost
+            optimize_seconds = std::max(0.0f, static_cast<float>(atof(argv[++i])));
+        }
+        else if (!strcmp(argv[i], "--optimize-sah") && i + 1 < argc) {
+            // stop optimizing once the bvh's SAH cost is down to this
+            optimize_sah_cost = std::max(0.0f, static_cast<float>(atof(argv[++i])));
+        }
+        else if (!strcmp(argv[i], "--treelets")) {
+            // store the bvh nodes in small treelets so the nodes a ray visits share cache lines
+            treelet_layout = true;
+        }
+        else if (!strcmp(argv[i], "--bvh-stats")) {
+            // print the bvh's depth, overlap, leaf sizes and memory as JSON
+            print_bvh_stats = true;
+        }
+        else if (!strcmp(argv[i], "--deform")) {
+            // twist the mesh back and forth, refitting the bvh instead of rebuilding it
+            deform = true;
+        }
+        else if (!strcmp(argv[i], "--clean-mesh")) {
+            // weld duplicate vertices and normals and drop degenerate and duplicate triangles
+            clean_mesh = true;
+        }
+        else {
+            file_name = argv[i];
+        }
+    }
+    if (file_name.empty()) {
+        std::cin >> file_name;
+    }
+    if (stackless && (bvh_width != 2 || bvh_quantize_bits)) {
+        std::cerr << "Couldn't use the stackless traversal: skip links need the binary bvh" << endl;
+        stackless = false;
+    }
+    if (stackless && treelet_layout) {
+        std::cerr << "Couldn't use the stackless traversal: skip links need the depth first node order" << endl;
+        stackless = false;
+    }
+    if (deform && (bvh_width != 2 || bvh_quantize_bits || !indexed_layout)) {
+        std::cerr << "Couldn't deform the mesh: --deform needs the indexed layout and the binary bvh" << endl;
+        deform = false;
+    }
+    if (deform) {
+        // the refit needs the bvh, which a cached scene doesn't have
+        use_cache = false;
+    }
+    if (optimize_seconds > 0.0f) {
+        // the optimized tree depends on how much got done in the time, so it isn't cached
+        use_cache = false;
+    }
+    auto launch = std::chrono::high_resolution_clock::now();
+    // Load the scene information in the background. Creating the window and the OpenGL
+    // context takes a while, so it happens while the scene loads
+    bool loaded = false;
+    std::thread loader([&]() { loaded = loadFromFile(file_name); });
     if (!glfwInit()) {
         // GLFW initilization failed
+        loader.join();
         return 1;
     }
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
@@ -353,6 +650,8 @@ int main(int argc, char *argv[]){
     GLFWwindow* window = glfwCreateWindow(img_width, img_height, "RayTracer", NULL, NULL);
     if (!window) {
         // Window or OpenGL context creation failed
+        loader.join();
+        glfwTerminate();
         return 1;
     }
    
@@ -373,6 +672,8 @@ int main(int argc, char *argv[]){
     }
     else {
         printf("ERROR: Failed to initialize OpenGL context.\n");
+        loader.join();
+        glfwTerminate();
         return 1;
     }
 
@@ -415,6 +716,33 @@ int main(int argc, char *argv[]){
         compute_file.open(INSTALL_DIR + std::string("/rayTrace_Compute.glsl"));
     }
     std::string compute_source((std::istreambuf_iterator<char>(compute_file)), std::istreambuf_iterator<char>());
+
+    // Everything from here on needs the scene, even the shader: which parts of it are
+    // used depends on whether the scene has instances
+    loader.join();
+    if (!loaded) {
+        glfwTerminate();
+        return 1;
+    }
+    // Select the parts of the shader which match the buffer layout
+    std::vector<std::string> shader_defines;
+    if (indexed_layout) {
+        shader_defines.push_back("INDEXED_TRIANGLES");
+    }
+    if (bvh_width != 2 || bvh_quantize_bits) {
+        shader_defines.push_back("BVH_WIDTH " + std::to_string(bvh_width));
+    }
+    if (bvh_quantize_bits) {
+        shader_defines.push_back("QUANTIZED_BITS " + std::to_string(bvh_quantize_bits));
+    }
+    if (two_level) {
+        shader_defines.push_back("TWO_LEVEL");
+    }
+    if (stackless) {
+        shader_defines.push_back("STACKLESS");
+    }
+    shader_defines.push_back("STACK_SIZE " + std::to_string(std::max(shader_stack_size, 1)));
+    compute_source = injectDefines(compute_source, shader_defines);
    
     compute_shader = glCreateShader(GL_COMPUTE_SHADER);
     const char* src = compute_source.c_str();
@@ -439,8 +767,7 @@ int main(int argc, char *argv[]){
    glUseProgram(ray_tracer);
 
    // Grab the triangle information
-   int num_triangles;
-   TriangleGL* triangles = scene_bvh.getTriangles(num_triangles);
+   int num_triangles = gpu_scene.num_triangles;
    // set all the compute shader uniforms
    // 0 since we are using texture 0
    glUniform1i(glGetUniformLocation(ray_tracer, "result"), 0);
@@ -464,38 +791,50 @@ int main(int argc, char *argv[]){
    GLuint result_loc = glGetUniformLocation(ray_tracer, "result");
    glUniform1i(result_loc, 0);
 
-   // create the triangle buffer
+   // create the triangle buffers
    // Since we are storing a LOT of triangles, we will use a Shared Storage Buffer object (SSBO)
    // they can hold lots more than a uniform buffer
-   GLuint tri_ssbo, light_ssbo;
-   glGenBuffers(1, &tri_ssbo);
-   glBindBuffer(GL_SHADER_STORAGE_BUFFER, tri_ssbo);
-   // send triangle data to the GPU
-   glBufferData(GL_SHADER_STORAGE_BUFFER, num_triangles * sizeof(TriangleGL), triangles, GL_STREAM_READ);
-   // Bind the SSBO in the Compute Shader
-   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, tri_ssbo);
-   // unbind the SSBO
-   glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+   GLuint tri_ssbo, light_ssbo, vert_ssbo = 0, norm_ssbo = 0;
+   size_t triangle_bytes;
+   if (indexed_layout) {
+       // triangles only hold offsets into the shared vertex and normal buffers
+       triangle_bytes = num_triangles * sizeof(TriangleIndexGL) + (gpu_scene.num_vertices + gpu_scene.num_normals) * sizeof(VertexGL);
+       tri_ssbo = createStorageBuffer(1, num_triangles * sizeof(TriangleIndexGL), gpu_scene.triangles);
+       vert_ssbo = createStorageBuffer(4, gpu_scene.num_vertices * sizeof(VertexGL), gpu_scene.vertices);
+       norm_ssbo = createStorageBuffer(5, gpu_scene.num_normals * sizeof(VertexGL), gpu_scene.normals);
+   }
+   else {
+       // every triangle carries copies of its points and normals
+       std::vector<TriangleGL> expanded;
+       expandTriangles(gpu_scene.vertices, gpu_scene.normals, gpu_scene.triangles, num_triangles, expanded);
+       triangle_bytes = expanded.size() * sizeof(TriangleGL);
+       tri_ssbo = createStorageBuffer(1, triangle_bytes, data(expanded));
+   }
+   cout << "Triangle buffers: " << triangle_bytes / 1024 << " KB" << endl;
+
+   // create an SSBO for the materials. Triangles store an offset into this array
+   GLuint mat_ssbo = createStorageBuffer(6, mats.size() * sizeof(MaterialGL), data(mats));
 
    // create an SSBO for the lights
-   glGenBuffers(1, &light_ssbo);
-   glBindBuffer(GL_SHADER_STORAGE_BUFFER, light_ssbo);
-   // upload lights to the GPU
-   glBufferData(GL_SHADER_STORAGE_BUFFER, lights.size() * sizeof(LightGL), data(lights), GL_STREAM_READ);
-   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, light_ssbo);
-   glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0); // reset the bound buffer
+   light_ssbo = createStorageBuffer(2, lights.size() * sizeof(LightGL), data(lights));
 
-   GLuint bvh_ssbo;
    // create an SSBO for the bvh
-   glGenBuffers(1, &bvh_ssbo);
-   glBindBuffer(GL_SHADER_STORAGE_BUFFER, bvh_ssbo);
-   // upload bvh nodes to the GPU
-   int num_nodes;
-   // We must collapse the BVH from a tree into an array to access it on the GPU
-   NodeGL* bvh_data = scene_bvh.getCompact(num_nodes);
-   glBufferData(GL_SHADER_STORAGE_BUFFER, num_nodes * sizeof(NodeGL), bvh_data, GL_STREAM_READ);
-   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, bvh_ssbo);
-   glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0); // reset the bound buffer
+   // The BVH was collapsed from a tree into an array when the scene was loaded
+   GLuint bvh_ssbo;
+   if (bvh_width != 2 || bvh_quantize_bits || stackless) {
+       bvh_ssbo = createStorageBuffer(3, packed_bvh.size(), data(packed_bvh));
+   }
+   else {
+       bvh_ssbo = createStorageBuffer(3, gpu_scene.num_nodes * sizeof(NodeGL), gpu_scene.nodes);
+   }
+   // and one for the instances, which the top level of a two level bvh's leaves index
+   GLuint instance_ssbo = 0;
+   if (two_level) {
+       const std::vector<InstanceGL> &instances = instanced_bvh.gpuInstances();
+       instance_ssbo = createStorageBuffer(7, instances.size() * sizeof(InstanceGL), data(instances));
+   }
+   // Everything has been copied to the GPU, so the cache mapping is no longer needed
+   scene_cache.close();
 
    // Load the vertex Shader
    GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
@@ -554,8 +893,38 @@ int main(int argc, char *argv[]){
     cout << "time elapsed: " << ms << endl;
     glUseProgram(shader_program);
     int t = 0;
+    bool first_frame = true;
+    auto deform_start = std::chrono::high_resolution_clock::now();
+    std::vector<VertexGL> deformed_vertices, deformed_normals;
     while (!glfwWindowShouldClose(window)) {
         glfwPollEvents();
+        if (deform) {
+            // Move the mesh, refit the bvh to it and upload only what changed. When the
+            // tree has grown too loose it is rebuilt, and the triangles and nodes all change
+            float secs = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - deform_start).count();
+            twistMesh(0.25f * M_PI * sin(secs), deformed_vertices, deformed_normals);
+            BvhUpdate update;
+            scene_bvh.refit(deformed_vertices, deformed_normals, update);
+            setSceneBuffers();
+            // the threaded nodes sit where the binary ones do, so the same ranges changed
+            const void *nodes = gpu_scene.nodes;
+            size_t node_size = sizeof(NodeGL);
+            if (stackless) {
+                prepareSkipBvh();
+                nodes = data(packed_bvh);
+                node_size = sizeof(SkipNodeGL);
+            }
+            updateStorageBuffer(vert_ssbo, update.vertices, gpu_scene.vertices, sizeof(VertexGL));
+            updateStorageBuffer(norm_ssbo, update.normals, gpu_scene.normals, sizeof(VertexGL));
+            if (update.rebuilt) {
+                refillStorageBuffer(tri_ssbo, gpu_scene.num_triangles * sizeof(TriangleIndexGL), gpu_scene.triangles);
+                refillStorageBuffer(bvh_ssbo, gpu_scene.num_nodes * node_size, nodes);
+            }
+            else {
+                updateStorageBuffer(bvh_ssbo, update.nodes, nodes, node_size);
+            }
+            image_dirty = true;
+        }
         if (image_dirty) {
             glUseProgram(ray_tracer);
             glUniform3fv(glGetUniformLocation(ray_tracer, "eye"), 1, eye);
@@ -574,6 +943,12 @@ int main(int argc, char *argv[]){
         glUseProgram(shader_program);   
         glDrawArrays(GL_TRIANGLE_STRIP, 0, 4); //Draw the two triangles (4 vertices) making up the square
         glfwSwapBuffers(window);
+        if (first_frame) {
+            glFinish();
+            auto shown = std::chrono::high_resolution_clock::now();
+            cout << "Time to first frame: " << std::chrono::duration_cast<std::chrono::milliseconds>(shown - launch).count() << " ms" << endl;
+            first_frame = false;
+        }
     }
     // cleanup
     glDeleteProgram(ray_tracer);
@@ -587,6 +962,14 @@ int main(int argc, char *argv[]){
     glDeleteBuffers(1, &tri_ssbo);
     glDeleteBuffers(1, &light_ssbo);
     glDeleteBuffers(1, &bvh_ssbo);
+    glDeleteBuffers(1, &mat_ssbo);
+    if (indexed_layout) {
+        glDeleteBuffers(1, &vert_ssbo);
+        glDeleteBuffers(1, &norm_ssbo);
+    }
+    if (two_level) {
+        glDeleteBuffers(1, &instance_ssbo);
+    }
 
     //Clean Up
     glfwTerminate();
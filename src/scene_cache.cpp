@@ -0,0 +1,291 @@
+#include "scene_cache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const char kMagic[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0' };
+// Bump this whenever the layout of the file or of any ____GL struct changes
+const uint32_t kVersion = 7;
+// Sections start on a cache line so the mapped arrays are well aligned
+const uint64_t kAlignment = 64;
+
+enum SectionId : uint32_t {
+    SECTION_TRIANGLES = 1,
+    SECTION_NODES = 2,
+    SECTION_MATERIALS = 3,
+    SECTION_LIGHTS = 4,
+    SECTION_VERTICES = 5,
+    SECTION_NORMALS = 6,
+    // byte blob of IncludeStamp records, one per include_mesh: file
+    SECTION_INCLUDES = 7,
+    NUM_SECTION_IDS
+};
+
+struct SectionEntry {
+    uint32_t id;
+    uint32_t elem_size;
+    uint64_t count;
+    uint64_t offset;
+};
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_sections;
+    // identifies the scenefile the cache was compiled from
+    uint64_t source_size;
+    int64_t source_mtime;
+    // the camera exactly as it appeared in the scenefile
+    float eye[3];
+    float fwd[3];
+    float up[3];
+    float half_fov;
+    float background[3];
+    // SceneCacheFlags the arrays were compiled with
+    uint32_t flags;
+};
+
+/**
+ * Look up the size and modification time of the scenefile. Returns false if it is missing.
+ */
+bool sourceStamp(const std::string &scene_file, uint64_t &size, int64_t &mtime) {
+    std::error_code err;
+    size = fs::file_size(scene_file, err);
+    if (err) {
+        return false;
+    }
+    fs::file_time_type time = fs::last_write_time(scene_file, err);
+    if (err) {
+        return false;
+    }
+    mtime = static_cast<int64_t>(time.time_since_epoch().count());
+    return true;
+}
+
+/**
+ * IncludeStamp - identifies a mesh file the scene was built from. Stored unaligned in
+ * the includes section, followed by path_len bytes of path.
+ */
+#pragma pack(push, 1)
+struct IncludeStamp {
+    uint64_t size;
+    int64_t mtime;
+    uint32_t path_len;
+};
+#pragma pack(pop)
+
+/**
+ * Read the included files out of the includes section and check that none of them have
+ * changed since the cache was written. Fills includes with their paths.
+ */
+bool includesCurrent(const char *data, uint64_t size, std::vector<std::string> &includes) {
+    uint64_t pos = 0;
+    while (pos < size) {
+        IncludeStamp stamp;
+        if (size - pos < sizeof(stamp)) {
+            return false;
+        }
+        memcpy(&stamp, data + pos, sizeof(stamp));
+        pos += sizeof(stamp);
+        if (size - pos < stamp.path_len) {
+            return false;
+        }
+        std::string path(data + pos, stamp.path_len);
+        pos += stamp.path_len;
+        uint64_t file_size;
+        int64_t file_mtime;
+        if (!sourceStamp(path, file_size, file_mtime) || file_size != stamp.size || file_mtime != stamp.mtime) {
+            return false;
+        }
+        includes.push_back(path);
+    }
+    return true;
+}
+
+uint64_t alignUp(uint64_t value) {
+    return (value + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+}  // namespace
+
+std::string SceneCache::cachePath(const std::string &scene_file) {
+    return fs::path(scene_file).replace_extension(".rtscene").string();
+}
+
+bool SceneCache::open(const std::string &scene_file, SceneData &scene, SceneBuffers &buffers, uint32_t flags) {
+    close();
+    uint64_t source_size;
+    int64_t source_mtime;
+    if (!sourceStamp(scene_file, source_size, source_mtime) || !file_.open(cachePath(scene_file))) {
+        return false;
+    }
+    const char *base = file_.data();
+    size_t size = file_.size();
+    if (size < sizeof(CacheHeader)) {
+        close();
+        return false;
+    }
+    CacheHeader header;
+    memcpy(&header, base, sizeof(header));
+    if (memcmp(header.magic, kMagic, sizeof(kMagic)) || header.version != kVersion) {
+        std::cout << "Scene cache was written by a different version, rebuilding" << std::endl;
+        close();
+        return false;
+    }
+    if (header.source_size != source_size || header.source_mtime != source_mtime) {
+        std::cout << "Scene cache is out of date, rebuilding" << std::endl;
+        close();
+        return false;
+    }
+    if (header.flags != flags) {
+        std::cout << "Scene cache was compiled with different options, rebuilding" << std::endl;
+        close();
+        return false;
+    }
+    uint64_t table_end = sizeof(CacheHeader) + header.num_sections * static_cast<uint64_t>(sizeof(SectionEntry));
+    if (table_end > size) {
+        close();
+        return false;
+    }
+
+    // Find every section and make sure it lies inside the file
+    const void *sections[NUM_SECTION_IDS] = { nullptr };
+    uint64_t counts[NUM_SECTION_IDS] = { 0 };
+    const uint32_t elem_sizes[NUM_SECTION_IDS] = { 0, sizeof(TriangleIndexGL), sizeof(NodeGL), sizeof(MaterialGL),
+                                                   sizeof(LightGL), sizeof(VertexGL), sizeof(VertexGL), 1 };
+    for (uint32_t i = 0; i < header.num_sections; ++i) {
+        SectionEntry entry;
+        memcpy(&entry, base + sizeof(CacheHeader) + i * sizeof(SectionEntry), sizeof(entry));
+        if (entry.id < SECTION_TRIANGLES || entry.id >= NUM_SECTION_IDS) {
+            // unknown sections are skipped
+            continue;
+        }
+        if (entry.elem_size != elem_sizes[entry.id] || entry.offset % kAlignment ||
+            entry.offset > size || entry.count > (size - entry.offset) / entry.elem_size) {
+            close();
+            return false;
+        }
+        sections[entry.id] = base + entry.offset;
+        counts[entry.id] = entry.count;
+    }
+    if (!sections[SECTION_TRIANGLES] || !sections[SECTION_NODES] || !sections[SECTION_VERTICES] || !sections[SECTION_NORMALS]) {
+        close();
+        return false;
+    }
+    std::vector<std::string> includes;
+    if (!includesCurrent(static_cast<const char *>(sections[SECTION_INCLUDES]), counts[SECTION_INCLUDES], includes)) {
+        std::cout << "An included mesh has changed, rebuilding the scene cache" << std::endl;
+        close();
+        return false;
+    }
+
+    scene.includes = std::move(includes);
+    memcpy(scene.eye, header.eye, 3 * sizeof(float));
+    memcpy(scene.fwd, header.fwd, 3 * sizeof(float));
+    memcpy(scene.up, header.up, 3 * sizeof(float));
+    scene.half_fov = header.half_fov;
+    memcpy(scene.background, header.background, 3 * sizeof(float));
+    const MaterialGL *mats = static_cast<const MaterialGL *>(sections[SECTION_MATERIALS]);
+    scene.materials.assign(mats, mats + counts[SECTION_MATERIALS]);
+    const LightGL *lights = static_cast<const LightGL *>(sections[SECTION_LIGHTS]);
+    scene.lights.assign(lights, lights + counts[SECTION_LIGHTS]);
+
+    buffers.vertices = static_cast<const VertexGL *>(sections[SECTION_VERTICES]);
+    buffers.num_vertices = counts[SECTION_VERTICES];
+    buffers.normals = static_cast<const VertexGL *>(sections[SECTION_NORMALS]);
+    buffers.num_normals = counts[SECTION_NORMALS];
+    buffers.triangles = static_cast<const TriangleIndexGL *>(sections[SECTION_TRIANGLES]);
+    buffers.num_triangles = counts[SECTION_TRIANGLES];
+    buffers.nodes = static_cast<const NodeGL *>(sections[SECTION_NODES]);
+    buffers.num_nodes = counts[SECTION_NODES];
+    return true;
+}
+
+void SceneCache::close() {
+    file_.close();
+}
+
+bool SceneCache::write(const std::string &scene_file, const SceneData &scene, const SceneBuffers &buffers, uint32_t flags) {
+    CacheHeader header = {};
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.flags = flags;
+    if (!sourceStamp(scene_file, header.source_size, header.source_mtime)) {
+        return false;
+    }
+    memcpy(header.eye, scene.eye, 3 * sizeof(float));
+    memcpy(header.fwd, scene.fwd, 3 * sizeof(float));
+    memcpy(header.up, scene.up, 3 * sizeof(float));
+    header.half_fov = scene.half_fov;
+    memcpy(header.background, scene.background, 3 * sizeof(float));
+
+    // Stamp every included mesh so editing one invalidates the cache like the scenefile
+    std::vector<char> includes;
+    for (const std::string &path : scene.includes) {
+        IncludeStamp stamp;
+        if (!sourceStamp(path, stamp.size, stamp.mtime)) {
+            return false;
+        }
+        stamp.path_len = static_cast<uint32_t>(path.size());
+        const char *bytes = reinterpret_cast<const char *>(&stamp);
+        includes.insert(includes.end(), bytes, bytes + sizeof(stamp));
+        includes.insert(includes.end(), path.begin(), path.end());
+    }
+
+    struct Payload {
+        SectionEntry entry;
+        const void *data;
+    };
+    std::vector<Payload> payloads = {
+        { { SECTION_VERTICES, sizeof(VertexGL), buffers.num_vertices, 0 }, buffers.vertices },
+        { { SECTION_NORMALS, sizeof(VertexGL), buffers.num_normals, 0 }, buffers.normals },
+        { { SECTION_TRIANGLES, sizeof(TriangleIndexGL), buffers.num_triangles, 0 }, buffers.triangles },
+        { { SECTION_NODES, sizeof(NodeGL), buffers.num_nodes, 0 }, buffers.nodes },
+        { { SECTION_MATERIALS, sizeof(MaterialGL), scene.materials.size(), 0 }, scene.materials.data() },
+        { { SECTION_LIGHTS, sizeof(LightGL), scene.lights.size(), 0 }, scene.lights.data() },
+        { { SECTION_INCLUDES, 1, includes.size(), 0 }, includes.data() }
+    };
+    header.num_sections = static_cast<uint32_t>(payloads.size());
+    uint64_t offset = alignUp(sizeof(CacheHeader) + payloads.size() * sizeof(SectionEntry));
+    for (Payload &payload : payloads) {
+        payload.entry.offset = offset;
+        offset = alignUp(offset + payload.entry.count * payload.entry.elem_size);
+    }
+
+    std::string cache_file = cachePath(scene_file);
+    std::string temp_file = cache_file + ".tmp";
+    std::ofstream out(temp_file, std::ios::binary | std::ios::trunc);
+    if (!out.good()) {
+        return false;
+    }
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (const Payload &payload : payloads) {
+        out.write(reinterpret_cast<const char *>(&payload.entry), sizeof(SectionEntry));
+    }
+    const char zeros[kAlignment] = { 0 };
+    for (const Payload &payload : payloads) {
+        uint64_t pos = static_cast<uint64_t>(out.tellp());
+        out.write(zeros, payload.entry.offset - pos);
+        out.write(static_cast<const char *>(payload.data), payload.entry.count * payload.entry.elem_size);
+    }
+    out.close();
+    std::error_code err;
+    if (out.fail()) {
+        fs::remove(temp_file, err);
+        return false;
+    }
+    fs::rename(temp_file, cache_file, err);
+    if (err) {
+        fs::remove(temp_file, err);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,643 @@
+#define _USE_MATH_DEFINES
+#include "scene.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include "mapped_file.h"
+#include "mesh_import.h"
+#include "motor.h"
+#include "scanner.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Every command understood by the scenefile format
+enum Command {
+    CMD_UNKNOWN,
+    CMD_CAMERA_POS,
+    CMD_CAMERA_FWD,
+    CMD_CAMERA_UP,
+    CMD_CAMERA_FOV_HA,
+    CMD_MATERIAL,
+    CMD_MAX_VERTICES,
+    CMD_MAX_NORMALS,
+    CMD_MAX_TRIANGLES,
+    CMD_VERTEX,
+    CMD_NORMAL,
+    CMD_TRIANGLE,
+    CMD_NORMAL_TRIANGLE,
+    CMD_BACKGROUND,
+    CMD_POINT_LIGHT,
+    CMD_DIRECTIONAL_LIGHT,
+    CMD_INCLUDE_MESH,
+    CMD_INSTANCE
+};
+
+/**
+ * Map a token onto its command without building a std::string. The most
+ * common commands (geometry) are checked first.
+ */
+Command lookupCommand(const char *tok, size_t len) {
+    switch (tok[0]) {
+        case 'v':
+            if (matches(tok, len, "vertex:")) return CMD_VERTEX;
+            break;
+        case 't':
+            if (matches(tok, len, "triangle:")) return CMD_TRIANGLE;
+            break;
+        case 'n':
+            if (matches(tok, len, "normal:")) return CMD_NORMAL;
+            if (matches(tok, len, "normal_triangle:")) return CMD_NORMAL_TRIANGLE;
+            break;
+        case 'c':
+            if (matches(tok, len, "camera_pos:")) return CMD_CAMERA_POS;
+            if (matches(tok, len, "camera_fwd:")) return CMD_CAMERA_FWD;
+            if (matches(tok, len, "camera_up:")) return CMD_CAMERA_UP;
+            if (matches(tok, len, "camera_fov_ha:")) return CMD_CAMERA_FOV_HA;
+            break;
+        case 'm':
+            if (matches(tok, len, "material:")) return CMD_MATERIAL;
+            if (matches(tok, len, "max_vertices:")) return CMD_MAX_VERTICES;
+            if (matches(tok, len, "max_normals:")) return CMD_MAX_NORMALS;
+            if (matches(tok, len, "max_triangles:")) return CMD_MAX_TRIANGLES;
+            break;
+        case 'b':
+            if (matches(tok, len, "background:")) return CMD_BACKGROUND;
+            break;
+        case 'p':
+            if (matches(tok, len, "point_light:")) return CMD_POINT_LIGHT;
+            break;
+        case 'd':
+            if (matches(tok, len, "directional_light:")) return CMD_DIRECTIONAL_LIGHT;
+            break;
+        case 'i':
+            if (matches(tok, len, "include_mesh:")) return CMD_INCLUDE_MESH;
+            if (matches(tok, len, "instance:")) return CMD_INSTANCE;
+            break;
+    }
+    return CMD_UNKNOWN;
+}
+
+// Flags stored with every triangle record until its indices are resolved
+enum TriangleFlags {
+    TRI_FACE_NORMAL = 1,  // triangle: record, the normal comes from the vertices
+    TRI_SEEN_MAX_VERTICES = 2,  // max_vertices: appeared earlier in the same chunk
+    TRI_SEEN_MAX_NORMALS = 4  // max_normals: appeared earlier in the same chunk
+};
+
+/**
+ * RawTriangle - a triangle record exactly as it appears in the file. Vertex and normal
+ * indices are global, but the material index is local to the chunk that read it
+ * (-1 means the material that was active when the chunk began).
+ */
+struct RawTriangle {
+    int v[3];
+    int n[3];
+    int mat;
+    int flags;
+    // vertices and normals read earlier in the same chunk, which bounds the valid indices
+    int verts_before;
+    int norms_before;
+};
+
+// Bits for the camera values a chunk has set
+enum CameraFlags {
+    CAM_EYE = 1,
+    CAM_FWD = 2,
+    CAM_UP = 4,
+    CAM_FOV = 8,
+    CAM_BACKGROUND = 16
+};
+
+/**
+ * MeshInclude - a mesh file pulled in by include_mesh:. It is imported when its chunk
+ * is resolved, not while the chunk is parsed, so the importer's own threads don't run
+ * on top of the chunk workers, and spliced into the scene where the command appeared.
+ */
+struct MeshInclude {
+    std::string path;
+    // position of the command among the chunk's own records
+    size_t verts_before = 0;
+    size_t norms_before = 0;
+    size_t tris_before = 0;
+    // material active at the command, local to the chunk like RawTriangle::mat
+    int mat = -1;
+};
+
+/**
+ * MeshInstance - a copy of a mesh file placed by instance:. The file is only imported
+ * once for every material it is placed with, when the first such instance is resolved.
+ */
+struct MeshInstance {
+    std::string path;
+    // the rotation axis, the angle in degrees and the offset, as they appear in the file
+    float placement[7];
+    // material active at the command, local to the chunk like RawTriangle::mat
+    int mat = -1;
+};
+
+/**
+ * ChunkResult - everything read from one line aligned slice of the file. Chunks are
+ * parsed independently, then stitched together in file order by resolveChunks.
+ */
+struct ChunkResult {
+    std::vector<VertexGL> verts;
+    std::vector<VertexGL> norms;
+    std::vector<RawTriangle> tris;
+    std::vector<MaterialGL> mats;
+    std::vector<LightGL> lights;
+    std::vector<MeshInclude> includes;
+    std::vector<MeshInstance> instances;
+    // the last value of every camera command in the chunk
+    SceneData camera;
+    int camera_set = 0;
+    bool seen_max_vert = false;
+    bool seen_max_norm = false;
+    size_t vert_hint = 0;
+    size_t norm_hint = 0;
+    size_t tri_hint = 0;
+    size_t malformed = 0;
+};
+
+/**
+ * The absolute path of a mesh file named in the scenefile
+ */
+std::string meshPath(const char *path, size_t path_len, const std::string &base_dir) {
+    fs::path mesh_path(std::string(path, path_len));
+    if (mesh_path.is_relative() && !base_dir.empty()) {
+        mesh_path = fs::path(base_dir) / mesh_path;
+    }
+    return fs::absolute(mesh_path).lexically_normal().string();
+}
+
+/**
+ * Parse every record in [begin, end). Records only reference what came before them,
+ * so a chunk can be parsed without knowing anything about the chunks before it.
+ */
+void parseChunk(const char *begin, const char *end, const std::string &base_dir, ChunkResult &chunk) {
+    Scanner scan = { begin, end };
+    int cur_mat = -1;
+    const char *tok;
+    size_t len;
+    while (scan.nextToken(tok, len)) {
+        Command command = lookupCommand(tok, len);
+        bool ok = true;
+        switch (command) {
+            case CMD_VERTEX: {
+                // Add another vertex to the master list
+                VertexGL v = {};
+                ok = scan.readFloats(v.pos, 3);
+                if (ok) {
+                    chunk.verts.push_back(v);
+                }
+                break;
+            }
+            case CMD_NORMAL: {
+                // Add another normal to the master list
+                VertexGL n = {};
+                ok = scan.readFloats(n.pos, 3);
+                if (ok) {
+                    chunk.norms.push_back(n);
+                }
+                break;
+            }
+            case CMD_TRIANGLE:
+            case CMD_NORMAL_TRIANGLE: {
+                RawTriangle tri;
+                ok = scan.readInts(tri.v, 3);
+                if (command == CMD_NORMAL_TRIANGLE) {
+                    ok = ok && scan.readInts(tri.n, 3);
+                    tri.flags = 0;
+                }
+                else {
+                    tri.flags = TRI_FACE_NORMAL;
+                }
+                if (ok) {
+                    tri.mat = cur_mat;
+                    tri.flags |= (chunk.seen_max_vert ? TRI_SEEN_MAX_VERTICES : 0) |
+                                 (chunk.seen_max_norm ? TRI_SEEN_MAX_NORMALS : 0);
+                    tri.verts_before = static_cast<int>(chunk.verts.size());
+                    tri.norms_before = static_cast<int>(chunk.norms.size());
+                    chunk.tris.push_back(tri);
+                }
+                break;
+            }
+            case CMD_MATERIAL: {
+                float m[14];
+                ok = scan.readFloats(m, 14);
+                if (!ok) {
+                    break;
+                }
+                MaterialGL mat;
+                memcpy(mat.ka, m, 3 * sizeof(float));
+                memcpy(mat.kd, m + 3, 3 * sizeof(float));
+                memcpy(mat.ks, m + 6, 3 * sizeof(float));
+                mat.ns = m[9];
+                memcpy(mat.kt, m + 10, 3 * sizeof(float));
+                mat.ior = m[13];
+                cur_mat = static_cast<int>(chunk.mats.size());
+                chunk.mats.push_back(mat);
+                break;
+            }
+            case CMD_MAX_VERTICES: {
+                int max_vert;
+                ok = scan.readInt(max_vert);
+                chunk.seen_max_vert |= ok && max_vert >= 0;
+                if (ok && max_vert > 0) {
+                    // Reserve space for the vertices
+                    chunk.vert_hint = max_vert;
+                    chunk.verts.reserve(max_vert);
+                }
+                break;
+            }
+            case CMD_MAX_NORMALS: {
+                int max_norm;
+                ok = scan.readInt(max_norm);
+                chunk.seen_max_norm |= ok && max_norm >= 0;
+                if (ok && max_norm > 0) {
+                    // Reserve space for the normals
+                    chunk.norm_hint = max_norm;
+                    chunk.norms.reserve(max_norm);
+                }
+                break;
+            }
+            case CMD_MAX_TRIANGLES: {
+                // only a hint, so it is fine if it is wrong
+                int max_tris;
+                ok = scan.readInt(max_tris);
+                if (ok && max_tris > 0) {
+                    chunk.tri_hint = max_tris;
+                    chunk.tris.reserve(max_tris);
+                }
+                break;
+            }
+            case CMD_CAMERA_POS:
+                ok = scan.readFloats(chunk.camera.eye, 3);
+                chunk.camera_set |= ok ? CAM_EYE : 0;
+                break;
+            case CMD_CAMERA_FWD:
+                ok = scan.readFloats(chunk.camera.fwd, 3);
+                chunk.camera_set |= ok ? CAM_FWD : 0;
+                break;
+            case CMD_CAMERA_UP:
+                ok = scan.readFloats(chunk.camera.up, 3);
+                chunk.camera_set |= ok ? CAM_UP : 0;
+                break;
+            case CMD_CAMERA_FOV_HA:
+                ok = scan.readFloat(chunk.camera.half_fov);
+                chunk.camera_set |= ok ? CAM_FOV : 0;
+                break;
+            case CMD_BACKGROUND:
+                ok = scan.readFloats(chunk.camera.background, 3);
+                chunk.camera_set |= ok ? CAM_BACKGROUND : 0;
+                break;
+            case CMD_POINT_LIGHT:
+            case CMD_DIRECTIONAL_LIGHT: {
+                LightGL light{};
+                ok = scan.readFloats(light.clr, 3) &&
+                     scan.readFloats(command == CMD_POINT_LIGHT ? light.pos : light.dir, 3);
+                if (ok) {
+                    light.type = command == CMD_POINT_LIGHT ? POINT_LIGHT : DIRECTION_LIGHT;
+                    chunk.lights.push_back(light);
+                }
+                break;
+            }
+            case CMD_INCLUDE_MESH: {
+                // The rest of the line is the mesh file, relative to the scenefile
+                const char *path;
+                size_t path_len;
+                ok = scan.restOfLine(path, path_len);
+                if (!ok) {
+                    break;
+                }
+                MeshInclude include;
+                include.path = meshPath(path, path_len, base_dir);
+                include.verts_before = chunk.verts.size();
+                include.norms_before = chunk.norms.size();
+                include.tris_before = chunk.tris.size();
+                include.mat = cur_mat;
+                chunk.includes.push_back(std::move(include));
+                break;
+            }
+            case CMD_INSTANCE: {
+                // axis x y z, angle, offset x y z, then the mesh file for the rest of the line
+                MeshInstance instance;
+                const char *path;
+                size_t path_len;
+                ok = scan.readFloats(instance.placement, 7) && scan.restOfLine(path, path_len);
+                if (!ok) {
+                    break;
+                }
+                instance.path = meshPath(path, path_len, base_dir);
+                instance.mat = cur_mat;
+                chunk.instances.push_back(std::move(instance));
+                break;
+            }
+            case CMD_UNKNOWN:
+                // Unsupported command or comment, just skip it
+                scan.skipLine();
+                break;
+        }
+        if (!ok) {
+            // the arguments could not be read, so give up on the rest of the line
+            ++chunk.malformed;
+            scan.skipLine();
+        }
+    }
+}
+
+/**
+ * ResolveState - the scene state which is carried from one chunk to the next while
+ * the chunks are resolved in file order.
+ */
+struct ResolveState {
+    int cur_mat = 0;
+    bool seen_max_vert = false;
+    bool seen_max_norm = false;
+    // vertices and normals from the scenefile itself, which is what its indices count
+    size_t text_verts = 0;
+    size_t text_norms = 0;
+    // Included meshes sit between the scenefile's own vertices in the mesh. Each entry
+    // is (scenefile count at the include, total included so far), which is how far
+    // every later scenefile index is shifted
+    std::vector<std::pair<size_t, size_t>> vert_shifts;
+    std::vector<std::pair<size_t, size_t>> norm_shifts;
+    // The instance_meshes offset of every instanced mesh file and the material its
+    // triangles default to, or -1 if it couldn't be imported. The triangles carry their
+    // material, so a mesh placed under another material needs a copy of its own
+    std::map<std::pair<std::string, int>, int> instance_meshes;
+    // why triangles and lines were dropped, reported once the whole file is done
+    size_t skipped_tris = 0;
+    size_t invalid_tris = 0;
+    size_t malformed = 0;
+};
+
+/**
+ * Check a triangle record against the sequential rules of the format. Returns 0 if the
+ * triangle is usable, otherwise the reason it has to be dropped (1 = counts not
+ * specified, 2 = index out of range). num_verts/num_norms are the counts at the start
+ * of the chunk.
+ */
+int validateTriangle(const RawTriangle &tri, const ResolveState &state, size_t num_verts, size_t num_norms) {
+    bool face = (tri.flags & TRI_FACE_NORMAL) != 0;
+    bool has_verts = state.seen_max_vert || (tri.flags & TRI_SEEN_MAX_VERTICES);
+    bool has_norms = state.seen_max_norm || (tri.flags & TRI_SEEN_MAX_NORMALS);
+    if (!has_verts || (!face && !has_norms)) {
+        return 1;
+    }
+    // only vertices and normals which appeared above the triangle can be indexed
+    size_t vert_limit = num_verts + tri.verts_before;
+    size_t norm_limit = num_norms + tri.norms_before;
+    for (int i = 0; i < 3; ++i) {
+        if (tri.v[i] < 0 || static_cast<size_t>(tri.v[i]) >= vert_limit) {
+            return 2;
+        }
+        if (!face && (tri.n[i] < 0 || static_cast<size_t>(tri.n[i]) >= norm_limit)) {
+            return 2;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Map a scenefile vertex or normal index onto its offset in the mesh
+ */
+int shiftIndex(int index, const std::vector<std::pair<size_t, size_t>> &shifts) {
+    if (shifts.empty() || static_cast<size_t>(index) < shifts.front().first) {
+        return index;
+    }
+    auto after = std::upper_bound(shifts.begin(), shifts.end(), static_cast<size_t>(index),
+                                  [](size_t value, const std::pair<size_t, size_t> &shift) { return value < shift.first; });
+    return index + static_cast<int>((after - 1)->second);
+}
+
+/**
+ * Stitch one chunk onto the end of the scene. Scene state (materials, the camera,
+ * max_vertices:/max_normals:) is carried over from the chunks before it, its vertices
+ * and normals are appended to the mesh and its triangles are resolved and handed to sink.
+ */
+void resolveChunk(ChunkResult &chunk, ResolveState &state, SceneData &scene, int num_threads, const TriangleSink &sink) {
+    TriangleMesh &mesh = scene.mesh;
+    size_t text_vert_base = state.text_verts;
+    size_t text_norm_base = state.text_norms;
+    int start_mat = state.cur_mat;
+    int mat_base = static_cast<int>(scene.materials.size());
+    if (!chunk.mats.empty()) {
+        state.cur_mat = mat_base + static_cast<int>(chunk.mats.size()) - 1;
+        scene.materials.insert(scene.materials.end(), chunk.mats.begin(), chunk.mats.end());
+    }
+    scene.lights.insert(scene.lights.end(), chunk.lights.begin(), chunk.lights.end());
+    // camera commands later in the file win
+    const SceneData &cam = chunk.camera;
+    if (chunk.camera_set & CAM_EYE) memcpy(scene.eye, cam.eye, 3 * sizeof(float));
+    if (chunk.camera_set & CAM_FWD) memcpy(scene.fwd, cam.fwd, 3 * sizeof(float));
+    if (chunk.camera_set & CAM_UP) memcpy(scene.up, cam.up, 3 * sizeof(float));
+    if (chunk.camera_set & CAM_FOV) scene.half_fov = cam.half_fov;
+    if (chunk.camera_set & CAM_BACKGROUND) memcpy(scene.background, cam.background, 3 * sizeof(float));
+
+    // Reserve for the vertices and normals so triangles can index them. max_vertices: and
+    // friends are honoured when they over-allocate, just like the sequential reserve did
+    mesh.vertices.reserve(std::max(mesh.vertices.size() + chunk.verts.size(), chunk.vert_hint));
+    mesh.normals.reserve(std::max(mesh.normals.size() + chunk.norms.size(), chunk.norm_hint));
+    mesh.triangles.reserve(std::max(mesh.triangles.size() + chunk.tris.size(), chunk.tri_hint));
+
+    TriangleBatch batch;
+    batch.first = mesh.triangles.size();
+    if (sink) {
+        batch.points.reserve(3 * chunk.tris.size());
+    }
+    auto addTriangle = [&](const TriangleIndexGL &tri) {
+        mesh.triangles.push_back(tri);
+        if (sink) {
+            batch.points.push_back(mesh.vertices[tri.v1]);
+            batch.points.push_back(mesh.vertices[tri.v2]);
+            batch.points.push_back(mesh.vertices[tri.v3]);
+        }
+    };
+    // Append the chunk's own records up to the given counts. Triangles the sequential
+    // rules reject are dropped and the rest are resolved
+    size_t verts_done = 0, norms_done = 0, tris_done = 0;
+    auto addRecords = [&](size_t verts_end, size_t norms_end, size_t tris_end) {
+        mesh.vertices.insert(mesh.vertices.end(), chunk.verts.begin() + verts_done, chunk.verts.begin() + verts_end);
+        mesh.normals.insert(mesh.normals.end(), chunk.norms.begin() + norms_done, chunk.norms.begin() + norms_end);
+        for (size_t i = tris_done; i < tris_end; ++i) {
+            const RawTriangle &tri = chunk.tris[i];
+            int reason = validateTriangle(tri, state, text_vert_base, text_norm_base);
+            if (reason) {
+                (reason == 1 ? state.skipped_tris : state.invalid_tris)++;
+                continue;
+            }
+            bool face = (tri.flags & TRI_FACE_NORMAL) != 0;
+            TriangleIndexGL out;
+            out.v1 = shiftIndex(tri.v[0], state.vert_shifts);
+            out.v2 = shiftIndex(tri.v[1], state.vert_shifts);
+            out.v3 = shiftIndex(tri.v[2], state.vert_shifts);
+            out.mat = tri.mat < 0 ? start_mat : mat_base + tri.mat;
+            out.n1 = face ? -1 : shiftIndex(tri.n[0], state.norm_shifts);
+            out.n2 = face ? -1 : shiftIndex(tri.n[1], state.norm_shifts);
+            out.n3 = face ? -1 : shiftIndex(tri.n[2], state.norm_shifts);
+            out.padding = 0;
+            addTriangle(out);
+        }
+        verts_done = verts_end;
+        norms_done = norms_end;
+        tris_done = tris_end;
+    };
+    for (const MeshInclude &include : chunk.includes) {
+        addRecords(include.verts_before, include.norms_before, include.tris_before);
+        ImportedMesh imported_mesh;
+        if (!importMesh(include.path, imported_mesh, num_threads)) {
+            continue;
+        }
+        scene.includes.push_back(include.path);
+        const TriangleMesh &imported = imported_mesh.mesh;
+        int vert_offset = static_cast<int>(mesh.vertices.size());
+        int norm_offset = static_cast<int>(mesh.normals.size());
+        int imported_mats = static_cast<int>(scene.materials.size());
+        int default_mat = include.mat < 0 ? start_mat : mat_base + include.mat;
+        state.vert_shifts.emplace_back(text_vert_base + include.verts_before,
+                                       (state.vert_shifts.empty() ? 0 : state.vert_shifts.back().second) + imported.vertices.size());
+        state.norm_shifts.emplace_back(text_norm_base + include.norms_before,
+                                       (state.norm_shifts.empty() ? 0 : state.norm_shifts.back().second) + imported.normals.size());
+        mesh.vertices.insert(mesh.vertices.end(), imported.vertices.begin(), imported.vertices.end());
+        mesh.normals.insert(mesh.normals.end(), imported.normals.begin(), imported.normals.end());
+        scene.materials.insert(scene.materials.end(), imported_mesh.materials.begin(), imported_mesh.materials.end());
+        for (TriangleIndexGL tri : imported.triangles) {
+            tri.v1 += vert_offset;
+            tri.v2 += vert_offset;
+            tri.v3 += vert_offset;
+            if (tri.n1 >= 0) {
+                tri.n1 += norm_offset;
+                tri.n2 += norm_offset;
+                tri.n3 += norm_offset;
+            }
+            tri.mat = tri.mat < 0 ? default_mat : imported_mats + tri.mat;
+            addTriangle(tri);
+        }
+    }
+    addRecords(chunk.verts.size(), chunk.norms.size(), chunk.tris.size());
+    for (const MeshInstance &instance : chunk.instances) {
+        int default_mat = instance.mat < 0 ? start_mat : mat_base + instance.mat;
+        auto found = state.instance_meshes.find(std::make_pair(instance.path, default_mat));
+        if (found == state.instance_meshes.end()) {
+            // the first copy of this mesh with this material, so bring it in
+            ImportedMesh imported;
+            int mesh = -1;
+            if (importMesh(instance.path, imported, num_threads)) {
+                int imported_mats = static_cast<int>(scene.materials.size());
+                scene.materials.insert(scene.materials.end(), imported.materials.begin(), imported.materials.end());
+                for (TriangleIndexGL &tri : imported.mesh.triangles) {
+                    tri.mat = tri.mat < 0 ? default_mat : imported_mats + tri.mat;
+                }
+                mesh = static_cast<int>(scene.instance_meshes.size());
+                scene.instance_meshes.push_back(std::move(imported.mesh));
+            }
+            found = state.instance_meshes.emplace(std::make_pair(instance.path, default_mat), mesh).first;
+        }
+        if (found->second < 0) {
+            continue;
+        }
+        const float *place = instance.placement;
+        SceneInstance placed;
+        placed.mesh = found->second;
+        placed.motor = rigidMotor(Dir3D(place[0], place[1], place[2]), place[3] * static_cast<float>(M_PI) / 180.0f,
+                                  Dir3D(place[4], place[5], place[6]));
+        scene.instances.push_back(placed);
+    }
+    state.text_verts += chunk.verts.size();
+    state.text_norms += chunk.norms.size();
+    state.seen_max_vert |= chunk.seen_max_vert;
+    state.seen_max_norm |= chunk.seen_max_norm;
+    state.malformed += chunk.malformed;
+    // the chunk is part of the scene now, so give its memory back
+    chunk = ChunkResult();
+    if (sink && !batch.points.empty()) {
+        sink(std::move(batch));
+    }
+}
+
+}  // namespace
+
+bool loadScene(const std::string &file_name, SceneData &scene, int num_threads, const TriangleSink &sink) {
+    MappedFile file;
+    if (!file.open(file_name)) {
+        return false;
+    }
+    parseScene(file.data(), file.size(), scene, num_threads, sink, fs::path(file_name).parent_path().string());
+    return true;
+}
+
+void parseScene(const char *text, size_t size, SceneData &scene, int num_threads, const TriangleSink &sink,
+                const std::string &base_dir) {
+    if (num_threads <= 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    std::vector<const char *> bounds = lineChunks(text, size, num_threads);
+    size_t num_chunks = bounds.size() - 1;
+
+    // The default material is a matte white
+    scene.materials.push_back(MaterialGL());
+    ResolveState state;
+    std::vector<ChunkResult> chunks(num_chunks);
+    size_t workers = std::min(static_cast<size_t>(num_threads), num_chunks);
+    if (workers <= 1) {
+        for (size_t i = 0; i < num_chunks; ++i) {
+            parseChunk(bounds[i], bounds[i + 1], base_dir, chunks[i]);
+            resolveChunk(chunks[i], state, scene, num_threads, sink);
+        }
+    }
+    else {
+        // The workers parse chunks in any order while this thread resolves them in file
+        // order as soon as each one is ready, so resolving overlaps with parsing
+        std::atomic<size_t> next(0);
+        std::mutex mutex;
+        std::condition_variable parsed;
+        std::vector<char> done(num_chunks, 0);
+        auto work = [&]() {
+            for (size_t i = next++; i < num_chunks; i = next++) {
+                parseChunk(bounds[i], bounds[i + 1], base_dir, chunks[i]);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    done[i] = 1;
+                }
+                parsed.notify_one();
+            }
+        };
+        std::vector<std::thread> threads;
+        threads.reserve(workers);
+        for (size_t t = 0; t < workers; ++t) {
+            threads.emplace_back(work);
+        }
+        for (size_t i = 0; i < num_chunks; ++i) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                parsed.wait(lock, [&]() { return done[i] != 0; });
+            }
+            resolveChunk(chunks[i], state, scene, num_threads, sink);
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+    }
+
+    if (state.skipped_tris) {
+        std::cerr << "ERROR: NUMBER OF VERTICES/NORMALS NOT SPECIFIED. SKIPPED " << state.skipped_tris << " TRIANGLES" << std::endl;
+    }
+    if (state.invalid_tris) {
+        std::cerr << "ERROR: SKIPPED " << state.invalid_tris << " TRIANGLES WITH OUT OF RANGE INDICES" << std::endl;
+    }
+    if (state.malformed) {
+        std::cerr << "ERROR: SKIPPED " << state.malformed << " MALFORMED LINES" << std::endl;
+    }
+}
@@ -0,0 +1,30 @@
+#include "skip_bvh.h"
+
+#include <utility>
+
+void threadBvh(const NodeGL *nodes, size_t num_nodes, std::vector<SkipNodeGL> &threaded) {
+    threaded.resize(num_nodes);
+    if (!num_nodes) {
+        return;
+    }
+    // every node still to be threaded, and where a ray goes once it is done with it
+    std::vector<std::pair<int, int>> stack;
+    stack.emplace_back(0, -1);
+    while (!stack.empty()) {
+        std::pair<int, int> entry = stack.back();
+        stack.pop_back();
+        const NodeGL &node = nodes[entry.first];
+        SkipNodeGL &skip_node = threaded[entry.first];
+        skip_node.AABB = node.AABB;
+        skip_node.skip_offset = entry.second;
+        skip_node.padding = 0;
+        skip_node.triangle_offset = node.triangle_offset;
+        skip_node.triangle_count = node.triangle_count;
+        if (node.l_child_offset != -1 || node.r_child_offset != -1) {
+            // the left subtree is followed by the right one, and the right one by whatever
+            // follows this node
+            stack.emplace_back(node.r_child_offset, entry.second);
+            stack.emplace_back(node.l_child_offset, node.r_child_offset);
+        }
+    }
+}
@@ -0,0 +1,494 @@
+#define _USE_MATH_DEFINES
+#include "traversal.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "PGA_3D.h"
+#include "motor.h"
+#include "wide_bvh.h"
+
+namespace {
+
+inline void sub(const float *a, const float *b, float *out) {
+    out[0] = a[0] - b[0];
+    out[1] = a[1] - b[1];
+    out[2] = a[2] - b[2];
+}
+
+inline void cross(const float *a, const float *b, float *out) {
+    out[0] = a[1] * b[2] - a[2] * b[1];
+    out[1] = a[2] * b[0] - a[0] * b[2];
+    out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+inline float dot(const float *a, const float *b) {
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+inline float length(const float *a) {
+    return std::sqrt(dot(a, a));
+}
+
+/**
+ * AABBIntersect from the shader: true if the ray hits the box in front of its origin
+ */
+bool boxHit(const DimensionGL &box, const float *pos, const float *inv_dir) {
+    float tmin = -INFINITY;
+    float tmax = INFINITY;
+    const float box_min[3] = { box.min_x, box.min_y, box.min_z };
+    const float box_max[3] = { box.max_x, box.max_y, box.max_z };
+    for (int axis = 0; axis < 3; ++axis) {
+        float t1 = (box_min[axis] - pos[axis]) * inv_dir[axis];
+        float t2 = (box_max[axis] - pos[axis]) * inv_dir[axis];
+        tmin = std::max(tmin, std::min(t1, t2));
+        tmax = std::min(tmax, std::max(t1, t2));
+    }
+    return tmax > 0 && tmax >= tmin;
+}
+
+/**
+ * triangleIntersect from the shader: the plane test followed by the barycentric
+ * inside-outside test. Returns true and the hit time if the triangle is hit.
+ */
+bool triangleHit(const float *p1, const float *p2, const float *p3, const float *pos, const float *dir, float &time) {
+    float to_plane[3], e1[3], e2[3], norm[3];
+    sub(p1, pos, to_plane);
+    sub(p3, p1, e1);
+    sub(p2, p1, e2);
+    cross(e1, e2, norm);
+    float denom = dot(norm, dir);
+    if (std::abs(denom) < .001f) {
+        return false;
+    }
+    time = dot(to_plane, norm) / denom;
+    if (time < 0.0f) {
+        return false;
+    }
+    float hit_pos[3] = { pos[0] + dir[0] * time, pos[1] + dir[1] * time, pos[2] + dir[2] * time };
+    float area_cross[3];
+    cross(e2, e1, area_cross);
+    float tri_area = length(area_cross);
+    float to_p1[3], to_p2[3], to_p3[3], sub_area[3];
+    sub(p1, hit_pos, to_p1);
+    sub(p2, hit_pos, to_p2);
+    sub(p3, hit_pos, to_p3);
+    cross(to_p3, to_p2, sub_area);
+    float a = length(sub_area) / tri_area;
+    cross(to_p3, to_p1, sub_area);
+    float b = length(sub_area) / tri_area;
+    cross(to_p1, to_p2, sub_area);
+    float c = length(sub_area) / tri_area;
+    return a <= 1.0001f && b <= 1.0001f && c <= 1.0001f && (a + b + c) <= 1.0001f;
+}
+
+/**
+ * Read item through the stats' cache model, if there is one
+ */
+template<typename T>
+inline void fetch(TraversalStats &stats, const T &item) {
+    if (stats.cache) {
+        stats.cache->read(&item, sizeof(T));
+    }
+}
+
+/**
+ * Test the triangles [first, first + count) of a leaf, keeping the closest hit
+ */
+void leafHit(const SceneBuffers &buffers, int first, int count, const float *origin, const float *dir, RayHit &hit,
+             TraversalStats &stats) {
+    for (int i = first; i < first + count; ++i) {
+        const TriangleIndexGL &tri = buffers.triangles[i];
+        float time;
+        ++stats.triangles_tested;
+        fetch(stats, tri);
+        fetch(stats, buffers.vertices[tri.v1]);
+        fetch(stats, buffers.vertices[tri.v2]);
+        fetch(stats, buffers.vertices[tri.v3]);
+        if (triangleHit(buffers.vertices[tri.v1].pos, buffers.vertices[tri.v2].pos, buffers.vertices[tri.v3].pos,
+                        origin, dir, time) && time < hit.time) {
+            hit.hit = true;
+            hit.time = time;
+            hit.triangle = i;
+        }
+    }
+}
+
+// Reading the children of the wide node formats
+
+template<int Width>
+DimensionGL childBox(const WideNodeGL<Width> &node, int child) {
+    DimensionGL box;
+    box.min_x = node.min_x[child];
+    box.min_y = node.min_y[child];
+    box.min_z = node.min_z[child];
+    box.max_x = node.max_x[child];
+    box.max_y = node.max_y[child];
+    box.max_z = node.max_z[child];
+    return box;
+}
+
+template<int Width>
+int childTriangles(const WideNodeGL<Width> &node, int child) {
+    return node.triangle_count[child];
+}
+
+template<int Width, int Bits>
+DimensionGL childBox(const QuantizedNodeGL<Width, Bits> &node, int child) {
+    DimensionGL box;
+    box.min_x = quantizedBound(node, 0, child);
+    box.min_y = quantizedBound(node, 1, child);
+    box.min_z = quantizedBound(node, 2, child);
+    box.max_x = quantizedBound(node, 3, child);
+    box.max_y = quantizedBound(node, 4, child);
+    box.max_z = quantizedBound(node, 5, child);
+    return box;
+}
+
+template<int Width, int Bits>
+int childTriangles(const QuantizedNodeGL<Width, Bits> &node, int child) {
+    return quantizedTriangles(node, child);
+}
+
+template<int Width>
+constexpr int nodeWidth(const WideNodeGL<Width> *) {
+    return Width;
+}
+
+template<int Width, int Bits>
+constexpr int nodeWidth(const QuantizedNodeGL<Width, Bits> *) {
+    return Width;
+}
+
+/**
+ * Call trace(origin, dir, hit) for the primary ray of every pixel of a width x height
+ * image, using the camera of scene the way the raytracer sets it up
+ */
+template<typename Trace>
+void forEachCameraRay(const SceneData &scene, int width, int height, Trace trace) {
+    // orthogonalize the camera basis the way the raytracer does
+    Dir3D forward(scene.fwd[0], scene.fwd[1], scene.fwd[2]);
+    Dir3D up(scene.up[0], scene.up[1], scene.up[2]);
+    Dir3D right = cross(up, forward).normalized();
+    up = cross(forward, right).normalized();
+    forward = forward.normalized();
+    float d = (height * .5f) / std::tan(scene.half_fov * (M_PI / 180.0));
+
+    RayHit hit;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            // the same pixel offsets as main() in the shader
+            float u = width * .5f - (x + 0.5f);
+            float v = height * .5f - (y + 0.5f);
+            float dir[3] = { -d * forward.x + u * right.x + v * up.x,
+                             -d * forward.y + u * right.y + v * up.y,
+                             -d * forward.z + u * right.z + v * up.z };
+            trace(scene.eye, dir, hit);
+        }
+    }
+}
+
+}  // namespace
+
+bool traceRay(const SceneBuffers &buffers, const float *origin, const float *dir, RayHit &hit, TraversalStats &stats) {
+    float inv_dir[3] = { 1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2] };
+    hit = RayHit();
+    hit.time = INFINITY;
+    ++stats.rays;
+    if (!buffers.num_nodes) {
+        return false;
+    }
+    std::vector<int> stack;
+    stack.reserve(64);
+    stack.push_back(0);
+    ++stats.stack_pushes;
+    while (!stack.empty()) {
+        stats.max_stack = std::max(stats.max_stack, stack.size());
+        int node_index = stack.back();
+        stack.pop_back();
+        if (node_index == -1) {
+            continue;
+        }
+        const NodeGL &node = buffers.nodes[node_index];
+        fetch(stats, node);
+        ++stats.nodes_visited;
+        ++stats.boxes_tested;
+        if (!boxHit(node.AABB, origin, inv_dir)) {
+            continue;
+        }
+        if (node.l_child_offset == -1 && node.r_child_offset == -1) {
+            leafHit(buffers, node.triangle_offset, node.triangle_count, origin, dir, hit, stats);
+        }
+        else {
+            // right child first, so the left child is visited next
+            stack.push_back(node.r_child_offset);
+            stack.push_back(node.l_child_offset);
+            stats.stack_pushes += 2;
+        }
+    }
+    stats.hits += hit.hit;
+    return hit.hit;
+}
+
+bool traceRay(const SceneBuffers &buffers, const InstanceGL *instances, const float *origin, const float *dir,
+              RayHit &hit, TraversalStats &stats) {
+    // the ray in the space of the instance being visited, or the world
+    float pos[3] = { origin[0], origin[1], origin[2] };
+    float ray_dir[3] = { dir[0], dir[1], dir[2] };
+    float inv_dir[3] = { 1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2] };
+    hit = RayHit();
+    hit.time = INFINITY;
+    ++stats.rays;
+    if (!buffers.num_nodes) {
+        return false;
+    }
+    std::vector<int> stack;
+    stack.reserve(64);
+    stack.push_back(0);
+    ++stats.stack_pushes;
+    // the instance being visited, and how deep the stack was when its root went on
+    int instance = -1;
+    size_t instance_stack = 0;
+    while (!stack.empty()) {
+        if (instance != -1 && stack.size() == instance_stack) {
+            // the instance is done, so go back to the world ray
+            std::copy(origin, origin + 3, pos);
+            std::copy(dir, dir + 3, ray_dir);
+            for (int axis = 0; axis < 3; ++axis) {
+                inv_dir[axis] = 1.0f / dir[axis];
+            }
+            instance = -1;
+        }
+        stats.max_stack = std::max(stats.max_stack, stack.size());
+        int node_index = stack.back();
+        stack.pop_back();
+        const NodeGL &node = buffers.nodes[node_index];
+        fetch(stats, node);
+        ++stats.nodes_visited;
+        ++stats.boxes_tested;
+        if (!boxHit(node.AABB, pos, inv_dir)) {
+            continue;
+        }
+        if (node.l_child_offset != -1 || node.r_child_offset != -1) {
+            // right child first, so the left child is visited next
+            stack.push_back(node.r_child_offset);
+            stack.push_back(node.l_child_offset);
+            stats.stack_pushes += 2;
+        }
+        else if (instance != -1) {
+            float closest = hit.time;
+            leafHit(buffers, node.triangle_offset, node.triangle_count, pos, ray_dir, hit, stats);
+            if (hit.time < closest) {
+                hit.instance = instance;
+            }
+        }
+        else {
+            // a top level leaf, so move the ray into the instance's space. The motor is
+            // rigid, so hit times stay the same
+            instance = node.triangle_offset;
+            const InstanceGL &placed = instances[instance];
+            fetch(stats, placed);
+            Motor3D to_world(placed.rotation[0], placed.translation[0], placed.translation[1], placed.translation[2],
+                             placed.rotation[1], placed.rotation[2], placed.rotation[3], placed.translation[3]);
+            Motor3D to_instance = inverseMotor(to_world);
+            Point3D local_pos = motorPoint(to_instance, Point3D(origin[0], origin[1], origin[2]));
+            Dir3D local_dir = motorDirection(to_instance, Dir3D(dir[0], dir[1], dir[2]));
+            pos[0] = local_pos.x;
+            pos[1] = local_pos.y;
+            pos[2] = local_pos.z;
+            ray_dir[0] = local_dir.x;
+            ray_dir[1] = local_dir.y;
+            ray_dir[2] = local_dir.z;
+            for (int axis = 0; axis < 3; ++axis) {
+                inv_dir[axis] = 1.0f / ray_dir[axis];
+            }
+            instance_stack = stack.size();
+            stack.push_back(placed.root);
+            ++stats.stack_pushes;
+        }
+    }
+    stats.hits += hit.hit;
+    return hit.hit;
+}
+
+bool traceRay(const SceneBuffers &buffers, const SkipNodeGL *nodes, size_t num_nodes, const float *origin,
+              const float *dir, RayHit &hit, TraversalStats &stats) {
+    float inv_dir[3] = { 1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2] };
+    hit = RayHit();
+    hit.time = INFINITY;
+    ++stats.rays;
+    int node_index = num_nodes ? 0 : -1;
+    while (node_index != -1) {
+        const SkipNodeGL &node = nodes[node_index];
+        fetch(stats, node);
+        ++stats.nodes_visited;
+        ++stats.boxes_tested;
+        if (!boxHit(node.AABB, origin, inv_dir)) {
+            node_index = node.skip_offset;
+        }
+        else if (node.triangle_count) {
+            leafHit(buffers, node.triangle_offset, node.triangle_count, origin, dir, hit, stats);
+            node_index = node.skip_offset;
+        }
+        else {
+            // the left child is next in depth first order
+            ++node_index;
+        }
+    }
+    stats.hits += hit.hit;
+    return hit.hit;
+}
+
+template<typename WideNode>
+bool traceRay(const SceneBuffers &buffers, const WideNode *nodes, size_t num_nodes, const float *origin,
+              const float *dir, RayHit &hit, TraversalStats &stats) {
+    const int width = nodeWidth(nodes);
+    float inv_dir[3] = { 1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2] };
+    hit = RayHit();
+    hit.time = INFINITY;
+    ++stats.rays;
+    if (!num_nodes) {
+        return false;
+    }
+    std::vector<int> stack;
+    stack.reserve(64);
+    stack.push_back(0);
+    ++stats.stack_pushes;
+    while (!stack.empty()) {
+        stats.max_stack = std::max(stats.max_stack, stack.size());
+        const WideNode &node = nodes[stack.back()];
+        stack.pop_back();
+        fetch(stats, node);
+        ++stats.nodes_visited;
+        // the empty slots come last
+        for (int i = 0; i < width && node.child[i] != -1; ++i) {
+            ++stats.boxes_tested;
+            if (!boxHit(childBox(node, i), origin, inv_dir)) {
+                continue;
+            }
+            int triangles = childTriangles(node, i);
+            if (triangles) {
+                leafHit(buffers, node.child[i], triangles, origin, dir, hit, stats);
+            }
+            else {
+                stack.push_back(node.child[i]);
+                ++stats.stack_pushes;
+            }
+        }
+    }
+    stats.hits += hit.hit;
+    return hit.hit;
+}
+
+TraversalStats traceCameraRays(const SceneBuffers &buffers, const SceneData &scene, int width, int height,
+                               CacheModel *cache) {
+    TraversalStats stats;
+    stats.cache = cache;
+    forEachCameraRay(scene, width, height, [&](const float *origin, const float *dir, RayHit &hit) {
+        traceRay(buffers, origin, dir, hit, stats);
+    });
+    return stats;
+}
+
+TraversalStats traceBounceRays(const SceneBuffers &buffers, const SceneData &scene, int width, int height,
+                               CacheModel *cache) {
+    TraversalStats stats;
+    stats.cache = cache;
+    // a fixed seed, so every layout traces the same bounces
+    std::mt19937 random(1);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    forEachCameraRay(scene, width, height, [&](const float *origin, const float *dir, RayHit &hit) {
+        TraversalStats primary;
+        if (!traceRay(buffers, origin, dir, hit, primary)) {
+            return;
+        }
+        const TriangleIndexGL &tri = buffers.triangles[hit.triangle];
+        const float *p1 = buffers.vertices[tri.v1].pos;
+        const float *p2 = buffers.vertices[tri.v2].pos;
+        const float *p3 = buffers.vertices[tri.v3].pos;
+        float e1[3], e2[3], normal[3];
+        sub(p2, p1, e1);
+        sub(p3, p1, e2);
+        cross(e1, e2, normal);
+        float normal_length = length(normal);
+        if (normal_length <= 0.0f) {
+            return;
+        }
+        // face the normal back towards the ray, and pick a direction on its side
+        float side = dot(normal, dir) > 0.0f ? -1.0f : 1.0f;
+        float bounce[3];
+        do {
+            for (float &axis : bounce) {
+                axis = unit(random);
+            }
+        } while (dot(bounce, bounce) > 1.0f || dot(bounce, bounce) < 1e-6f);
+        if (side * dot(bounce, normal) < 0.0f) {
+            for (float &axis : bounce) {
+                axis = -axis;
+            }
+        }
+        float pos[3];
+        for (int axis = 0; axis < 3; ++axis) {
+            pos[axis] = origin[axis] + hit.time * dir[axis] + 1e-4f * side * normal[axis] / normal_length;
+        }
+        RayHit bounce_hit;
+        traceRay(buffers, pos, bounce, bounce_hit, stats);
+    });
+    return stats;
+}
+
+TraversalStats traceCameraRays(const SceneBuffers &buffers, const InstanceGL *instances, const SceneData &scene,
+                               int width, int height, CacheModel *cache) {
+    TraversalStats stats;
+    stats.cache = cache;
+    forEachCameraRay(scene, width, height, [&](const float *origin, const float *dir, RayHit &hit) {
+        traceRay(buffers, instances, origin, dir, hit, stats);
+    });
+    return stats;
+}
+
+TraversalStats traceCameraRays(const SceneBuffers &buffers, const SkipNodeGL *nodes, size_t num_nodes,
+                               const SceneData &scene, int width, int height, CacheModel *cache) {
+    TraversalStats stats;
+    stats.cache = cache;
+    forEachCameraRay(scene, width, height, [&](const float *origin, const float *dir, RayHit &hit) {
+        traceRay(buffers, nodes, num_nodes, origin, dir, hit, stats);
+    });
+    return stats;
+}
+
+template<typename WideNode>
+TraversalStats traceCameraRays(const SceneBuffers &buffers, const WideNode *nodes, size_t num_nodes,
+                               const SceneData &scene, int width, int height, CacheModel *cache) {
+    TraversalStats stats;
+    stats.cache = cache;
+    forEachCameraRay(scene, width, height, [&](const float *origin, const float *dir, RayHit &hit) {
+        traceRay(buffers, nodes, num_nodes, origin, dir, hit, stats);
+    });
+    return stats;
+}
+
+#define INSTANTIATE_WIDE_TRAVERSAL(WideNode) \
+    template bool traceRay(const SceneBuffers &buffers, const WideNode *nodes, size_t num_nodes, const float *origin, \
+                           const float *dir, RayHit &hit, TraversalStats &stats); \
+    template TraversalStats traceCameraRays(const SceneBuffers &buffers, const WideNode *nodes, size_t num_nodes, \
+                                            const SceneData &scene, int width, int height, CacheModel *cache);
+
+INSTANTIATE_WIDE_TRAVERSAL(WideNodeGL<2>)
+INSTANTIATE_WIDE_TRAVERSAL(WideNodeGL<4>)
+INSTANTIATE_WIDE_TRAVERSAL(WideNodeGL<8>)
+// the commas would split the macro's argument
+using QuantizedNode2x8 = QuantizedNodeGL<2, 8>;
+using QuantizedNode2x16 = QuantizedNodeGL<2, 16>;
+using QuantizedNode4x8 = QuantizedNodeGL<4, 8>;
+using QuantizedNode4x16 = QuantizedNodeGL<4, 16>;
+using QuantizedNode8x8 = QuantizedNodeGL<8, 8>;
+using QuantizedNode8x16 = QuantizedNodeGL<8, 16>;
+INSTANTIATE_WIDE_TRAVERSAL(QuantizedNode2x8)
+INSTANTIATE_WIDE_TRAVERSAL(QuantizedNode2x16)
+INSTANTIATE_WIDE_TRAVERSAL(QuantizedNode4x8)
+INSTANTIATE_WIDE_TRAVERSAL(QuantizedNode4x16)
+INSTANTIATE_WIDE_TRAVERSAL(QuantizedNode8x8)
+INSTANTIATE_WIDE_TRAVERSAL(QuantizedNode8x16)
@@ -0,0 +1,229 @@
+#include "wide_bvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+namespace {
+
+bool isLeaf(const NodeGL &node) {
+    return node.l_child_offset == -1 && node.r_child_offset == -1;
+}
+
+/**
+ * The binary nodes which become the children of the wide node over node: everything
+ * levels below it, or the leaves above that. Returns how many there are.
+ */
+template<int Width>
+int wideChildren(const NodeGL *nodes, int node, int levels, int *children) {
+    if (isLeaf(nodes[node])) {
+        // only a root which is a leaf gets here
+        children[0] = node;
+        return 1;
+    }
+    int count = 0;
+    children[count++] = node;
+    for (int level = 0; level < levels; ++level) {
+        int next[2 * Width];
+        int next_count = 0;
+        for (int i = 0; i < count; ++i) {
+            const NodeGL &child = nodes[children[i]];
+            if (isLeaf(child)) {
+                next[next_count++] = children[i];
+            }
+            else {
+                next[next_count++] = child.l_child_offset;
+                next[next_count++] = child.r_child_offset;
+            }
+        }
+        std::copy(next, next + next_count, children);
+        count = next_count;
+    }
+    return count;
+}
+
+/**
+ * Reorder the children of node: inner children by the stack they need, most first, then
+ * the leaves, then the empty slots
+ */
+template<int Width>
+void sortChildren(WideNodeGL<Width> &node, const std::vector<int> &stack_need) {
+    int order[Width];
+    for (int i = 0; i < Width; ++i) {
+        order[i] = i;
+    }
+    auto rank = [&](int i) {
+        if (node.child[i] == -1) {
+            return -2;
+        }
+        return node.triangle_count[i] ? -1 : stack_need[node.child[i]];
+    };
+    std::stable_sort(order, order + Width, [&](int a, int b) { return rank(a) > rank(b); });
+    WideNodeGL<Width> sorted;
+    for (int i = 0; i < Width; ++i) {
+        int from = order[i];
+        sorted.min_x[i] = node.min_x[from];
+        sorted.min_y[i] = node.min_y[from];
+        sorted.min_z[i] = node.min_z[from];
+        sorted.max_x[i] = node.max_x[from];
+        sorted.max_y[i] = node.max_y[from];
+        sorted.max_z[i] = node.max_z[from];
+        sorted.child[i] = node.child[from];
+        sorted.triangle_count[i] = node.triangle_count[from];
+    }
+    node = sorted;
+}
+
+/**
+ * The power of two step which spans [low, high] in max_steps steps from low
+ */
+float quantizationStep(float low, float high, uint32_t max_steps) {
+    float extent = high - low;
+    if (!(extent > 0.0f)) {
+        return 1.0f;
+    }
+    int exponent;
+    std::frexp(extent / max_steps, &exponent);
+    float step = std::ldexp(1.0f, exponent);
+    // the division and the sum can round, so grow the step until the top really is reached
+    while (static_cast<float>(max_steps) * step + low < high) {
+        step *= 2.0f;
+    }
+    return step;
+}
+
+/**
+ * Quantize value to steps of step from low, rounding down for a min bound or up for a
+ * max bound, checked against the exact decoding so the decoded box never shrinks
+ */
+uint32_t quantize(float value, float low, float step, uint32_t max_steps, bool round_up) {
+    float steps = (value - low) / step;
+    double rounded = round_up ? std::ceil(steps) : std::floor(steps);
+    uint32_t q = static_cast<uint32_t>(std::min(std::max(rounded, 0.0), static_cast<double>(max_steps)));
+    if (round_up) {
+        while (q < max_steps && static_cast<float>(q) * step + low < value) {
+            ++q;
+        }
+    }
+    else {
+        while (q > 0 && static_cast<float>(q) * step + low > value) {
+            --q;
+        }
+    }
+    return q;
+}
+
+}  // namespace
+
+template<int Width>
+int collapseBvh(const NodeGL *nodes, size_t num_nodes, std::vector<WideNodeGL<Width>> &wide) {
+    wide.clear();
+    if (!num_nodes) {
+        return 0;
+    }
+    const int levels = wideLevels(Width);
+    // binary nodes still to be collapsed, and the wide node and slot which points at each
+    struct Pending {
+        int node;
+        int parent;
+        int slot;
+    };
+    std::vector<Pending> stack(1, { 0, -1, 0 });
+    while (!stack.empty()) {
+        Pending pending = stack.back();
+        stack.pop_back();
+        int index = static_cast<int>(wide.size());
+        if (pending.parent != -1) {
+            wide[pending.parent].child[pending.slot] = index;
+        }
+        wide.emplace_back();
+        int children[Width];
+        int count = wideChildren<Width>(nodes, pending.node, levels, children);
+        // push the last child first so the wide nodes come out depth first
+        for (int i = count - 1; i >= 0; --i) {
+            const NodeGL &child = nodes[children[i]];
+            WideNodeGL<Width> &node = wide[index];
+            node.min_x[i] = child.AABB.min_x;
+            node.min_y[i] = child.AABB.min_y;
+            node.min_z[i] = child.AABB.min_z;
+            node.max_x[i] = child.AABB.max_x;
+            node.max_y[i] = child.AABB.max_y;
+            node.max_z[i] = child.AABB.max_z;
+            if (isLeaf(child)) {
+                node.child[i] = child.triangle_offset;
+                node.triangle_count[i] = child.triangle_count;
+            }
+            else {
+                stack.push_back({ children[i], index, i });
+            }
+        }
+    }
+
+    // Children come after their parents, so working backwards every node's stack need is
+    // known before its parent's. Popping a node and pushing k hit inner children leaves the
+    // i-th pushed one with i entries beneath it while its subtree is traversed.
+    std::vector<int> stack_need(wide.size(), 0);
+    for (size_t index = wide.size(); index-- > 0;) {
+        WideNodeGL<Width> &node = wide[index];
+        sortChildren(node, stack_need);
+        int need = 0;
+        for (int i = 0; i < Width && node.child[i] != -1 && !node.triangle_count[i]; ++i) {
+            need = std::max(need, std::max(i + 1, i + stack_need[node.child[i]]));
+        }
+        stack_need[index] = need;
+    }
+    return std::max(1, stack_need[0]);
+}
+
+template<int Width, int Bits>
+void quantizeBvh(const std::vector<WideNodeGL<Width>> &wide, std::vector<QuantizedNodeGL<Width, Bits>> &quantized) {
+    const uint32_t max_steps = (1u << Bits) - 1;
+    quantized.assign(wide.size(), QuantizedNodeGL<Width, Bits>());
+    for (size_t index = 0; index < wide.size(); ++index) {
+        const WideNodeGL<Width> &node = wide[index];
+        QuantizedNodeGL<Width, Bits> &packed = quantized[index];
+        std::fill(std::begin(packed.bounds), std::end(packed.bounds), 0u);
+        std::fill(std::begin(packed.triangle_count), std::end(packed.triangle_count), 0u);
+        // the node's box is the union of its children's
+        DimensionGL box;
+        for (int i = 0; i < Width && node.child[i] != -1; ++i) {
+            box.min_x = std::min(box.min_x, node.min_x[i]);
+            box.min_y = std::min(box.min_y, node.min_y[i]);
+            box.min_z = std::min(box.min_z, node.min_z[i]);
+            box.max_x = std::max(box.max_x, node.max_x[i]);
+            box.max_y = std::max(box.max_y, node.max_y[i]);
+            box.max_z = std::max(box.max_z, node.max_z[i]);
+        }
+        const float low[3] = { box.min_x, box.min_y, box.min_z };
+        const float high[3] = { box.max_x, box.max_y, box.max_z };
+        for (int axis = 0; axis < 3; ++axis) {
+            packed.origin[axis] = std::isfinite(low[axis]) ? low[axis] : 0.0f;
+            packed.scale[axis] = quantizationStep(low[axis], high[axis], max_steps);
+        }
+        for (int i = 0; i < Width; ++i) {
+            packed.child[i] = node.child[i];
+            if (node.child[i] == -1) {
+                continue;
+            }
+            packed.triangle_count[i >> 2] |= static_cast<uint32_t>(node.triangle_count[i]) << ((i & 3) * 8);
+            const float bounds[6] = { node.min_x[i], node.min_y[i], node.min_z[i], node.max_x[i], node.max_y[i], node.max_z[i] };
+            for (int side = 0; side < 6; ++side) {
+                int axis = side % 3;
+                uint32_t q = quantize(bounds[side], packed.origin[axis], packed.scale[axis], max_steps, side >= 3);
+                int bit = (side * Width + i) * Bits;
+                packed.bounds[bit >> 5] |= q << (bit & 31);
+            }
+        }
+    }
+}
+
+template int collapseBvh<2>(const NodeGL *nodes, size_t num_nodes, std::vector<WideNodeGL<2>> &wide);
+template int collapseBvh<4>(const NodeGL *nodes, size_t num_nodes, std::vector<WideNodeGL<4>> &wide);
+template int collapseBvh<8>(const NodeGL *nodes, size_t num_nodes, std::vector<WideNodeGL<8>> &wide);
+
+template void quantizeBvh<2, 8>(const std::vector<WideNodeGL<2>> &wide, std::vector<QuantizedNodeGL<2, 8>> &quantized);
+template void quantizeBvh<2, 16>(const std::vector<WideNodeGL<2>> &wide, std::vector<QuantizedNodeGL<2, 16>> &quantized);
+template void quantizeBvh<4, 8>(const std::vector<WideNodeGL<4>> &wide, std::vector<QuantizedNodeGL<4, 8>> &quantized);
+template void quantizeBvh<4, 16>(const std::vector<WideNodeGL<4>> &wide, std::vector<QuantizedNodeGL<4, 16>> &quantized);
+template void quantizeBvh<8, 8>(const std::vector<WideNodeGL<8>> &wide, std::vector<QuantizedNodeGL<8, 8>> &quantized);
+template void quantizeBvh<8, 16>(const std::vector<WideNodeGL<8>> &wide, std::vector<QuantizedNodeGL<8, 16>> &quantized);